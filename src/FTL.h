@@ -59,30 +59,47 @@
 // Default: -60 (one minute before a full hour)
 #define GCdelay (-60)
 
+// For how long may the garbage collection hold the lock at once? [microseconds]
+// Default: 1000 (one millisecond)
+#define GC_SLICE_USEC 1000
+
+// Pause between two garbage collection slices [milliseconds]
+// Default: 10
+#define GC_SLICE_PAUSE 10
+
 // How many client connection do we accept at once?
 #define MAXCONNS 255
 
+// How many threads process API requests?
+#define API_WORKERS 4
+
+// After how many seconds do we give up sending a reply to an API client which
+// does not read it?
+#define API_SEND_TIMEOUT 10
+
 // Over how many queries do we iterate at most when trying to find a match?
 #define MAXITER 1000
 
-// How many hours do we want to store in FTL's memory? [hours]
+// How many hours do we want to store in FTL's memory by default? [hours]
+// This can be changed at runtime using MAXLOGAGE in pihole-FTL.conf
 #define MAXLOGAGE 24
 
+// Up to how many hours can be kept in FTL's memory? [hours]
+// Default: 168 (one week)
+#define MAXLOGAGE_LIMIT 168
+
 // Interval for overTime data [seconds]
 // Default: 600 (10 minute intervals)
 #define OVERTIME_INTERVAL 600
 
-// How many overTime slots do we need?
-// (24+1) hours * number of intervals per hour
-// We need to be able to hold 25 hours as we need some reserve
-// due to that GC is only running once an hours so the shown data
-// can be 24 hours + 59 minutes
-#define OVERTIME_SLOTS ((MAXLOGAGE+1)*3600/OVERTIME_INTERVAL)
-
 // Interval for re-resolving ALL known host names [seconds]
 // Default: 3600 (once every hour)
 #define RERESOLVE_INTERVAL 3600
 
+// Maximum random delay of re-resolving host names [seconds]
+// Default: 300 (five minutes)
+#define RERESOLVE_JITTER 300
+
 // Privacy mode constants
 #define HIDDEN_DOMAIN "hidden"
 #define HIDDEN_CLIENT "0.0.0.0"
@@ -144,9 +161,7 @@
 #define str(x) # x
 #define xstr(x) str(x)
 
-extern pthread_t telnet_listenthreadv4;
-extern pthread_t telnet_listenthreadv6;
-extern pthread_t socket_listenthread;
+extern pthread_t api_listenthread;
 extern pthread_t DBthread;
 extern pthread_t GCthread;
 extern pthread_t DNSclientthread;
@@ -38,6 +38,10 @@
 #include "../regex_r.h"
 // get_aliasclient_list()
 #include "../database/aliasclients.h"
+// struct lockStats
+#include "../lockstats.h"
+// get_stats_snapshot()
+#include "../snapshot.h"
 
 #define min(a,b) ({ __typeof__ (a) _a = (a); __typeof__ (b) _b = (b); _a < _b ? _a : _b; })
 
@@ -71,8 +75,13 @@ static int __attribute__((pure)) cmpdesc(const void *a, const void *b)
 
 void getStats(const int *sock)
 {
-	const int blocked = counters->blocked;
-	const int total = counters->queries;
+	// Get most recently published statistics
+	statsSnapshot stats;
+	get_stats_snapshot(&stats);
+	const countersStruct *counts = &stats.counters;
+
+	const int blocked = counts->blocked;
+	const int total = counts->queries;
 	float percentage = 0.0f;
 
 	// Avoid 1/0 condition
@@ -80,44 +89,34 @@ void getStats(const int *sock)
 		percentage = 1e2f*blocked/total;
 
 	// Send domains being blocked
-	if(istelnet[*sock]) {
-		ssend(*sock, "domains_being_blocked %i\n", counters->gravity);
+	if(istelnet(*sock)) {
+		ssend(*sock, "domains_being_blocked %i\n", counts->gravity);
 	}
 	else
-		pack_int32(*sock, counters->gravity);
+		pack_int32(*sock, counts->gravity);
 
 	// unique_clients: count only clients that have been active within the most recent 24 hours
-	int activeclients = 0;
-	for(int clientID=0; clientID < counters->clients; clientID++)
-	{
-		// Get client pointer
-		const clientsData* client = getClient(clientID, true);
-		if(client == NULL)
-			continue;
-
-		if(client->count > 0)
-			activeclients++;
-	}
+	const int activeclients = stats.activeclients;
 
-	if(istelnet[*sock]) {
+	if(istelnet(*sock)) {
 		ssend(*sock, "dns_queries_today %i\nads_blocked_today %i\nads_percentage_today %f\n",
 		      total, blocked, percentage);
 		ssend(*sock, "unique_domains %i\nqueries_forwarded %i\nqueries_cached %i\n",
-		      counters->domains, counters->forwarded, counters->cached);
-		ssend(*sock, "clients_ever_seen %i\n", counters->clients);
+		      counts->domains, counts->forwarded, counts->cached);
+		ssend(*sock, "clients_ever_seen %i\n", counts->clients);
 		ssend(*sock, "unique_clients %i\n", activeclients);
 
 		// Sum up all query types (A, AAAA, ANY, SRV, SOA, ...)
 		int sumalltypes = 0;
 		for(int queryType=0; queryType < TYPE_MAX-1; queryType++)
 		{
-			sumalltypes += counters->querytype[queryType];
+			sumalltypes += counts->querytype[queryType];
 		}
 		ssend(*sock, "dns_queries_all_types %i\n", sumalltypes);
 
 		// Send individual reply type counters
 		ssend(*sock, "reply_NODATA %i\nreply_NXDOMAIN %i\nreply_CNAME %i\nreply_IP %i\n",
-		      counters->reply_NODATA, counters->reply_NXDOMAIN, counters->reply_CNAME, counters->reply_IP);
+		      counts->reply_NODATA, counts->reply_NXDOMAIN, counts->reply_CNAME, counts->reply_IP);
 		ssend(*sock, "privacy_level %i\n", config.privacylevel);
 	}
 	else
@@ -125,15 +124,15 @@ void getStats(const int *sock)
 		pack_int32(*sock, total);
 		pack_int32(*sock, blocked);
 		pack_float(*sock, percentage);
-		pack_int32(*sock, counters->domains);
-		pack_int32(*sock, counters->forwarded);
-		pack_int32(*sock, counters->cached);
-		pack_int32(*sock, counters->clients);
+		pack_int32(*sock, counts->domains);
+		pack_int32(*sock, counts->forwarded);
+		pack_int32(*sock, counts->cached);
+		pack_int32(*sock, counts->clients);
 		pack_int32(*sock, activeclients);
 	}
 
 	// Send status
-	if(istelnet[*sock]) {
+	if(istelnet(*sock)) {
 		ssend(*sock, "status %s\n", blockingstatus ? "enabled" : "disabled");
 	}
 	else
@@ -142,44 +141,23 @@ void getStats(const int *sock)
 
 void getOverTime(const int *sock)
 {
-	int from = 0, until = OVERTIME_SLOTS;
-	bool found = false;
-	time_t mintime = overTime[0].timestamp;
-
-	// Start with the first non-empty overTime slot
-	for(int slot = 0; slot < OVERTIME_SLOTS; slot++)
-	{
-		if((overTime[slot].total > 0 || overTime[slot].blocked > 0) &&
-		   overTime[slot].timestamp >= mintime)
-		{
-			from = slot;
-			found = true;
-			break;
-		}
-	}
-
-	// End with last non-empty overTime slot
-	for(int slot = 0; slot < OVERTIME_SLOTS; slot++)
-	{
-		if(overTime[slot].timestamp >= time(NULL))
-		{
-			until = slot;
-			break;
-		}
-	}
+	// Get most recently published statistics. They contain the intervals
+	// from the first non-empty one to the last non-empty one
+	statsSnapshot stats;
+	get_stats_snapshot(&stats);
 
 	// Check if there is any data to be sent
-	if(!found)
+	if(stats.overTime_num == 0)
 		return;
 
-	if(istelnet[*sock])
+	if(istelnet(*sock))
 	{
-		for(int slot = from; slot < until; slot++)
+		for(unsigned int slot = 0; slot < stats.overTime_num; slot++)
 		{
 			ssend(*sock,"%lli %i %i\n",
-			      (long long)overTime[slot].timestamp,
-			      overTime[slot].total,
-			      overTime[slot].blocked);
+			      (long long)stats.overTime[slot].timestamp,
+			      stats.overTime[slot].total,
+			      stats.overTime[slot].blocked);
 		}
 	}
 	else
@@ -188,17 +166,17 @@ void getOverTime(const int *sock)
 		// and map16 can hold up to (2^16)-1 = 65535 pairs
 
 		// Send domains over time
-		pack_map16_start(*sock, (uint16_t) (until - from));
-		for(int slot = from; slot < until; slot++) {
-			pack_int32(*sock, (int32_t)overTime[slot].timestamp);
-			pack_int32(*sock, overTime[slot].total);
+		pack_map16_start(*sock, (uint16_t) stats.overTime_num);
+		for(unsigned int slot = 0; slot < stats.overTime_num; slot++) {
+			pack_int32(*sock, stats.overTime[slot].timestamp);
+			pack_int32(*sock, stats.overTime[slot].total);
 		}
 
 		// Send ads over time
-		pack_map16_start(*sock, (uint16_t) (until - from));
-		for(int slot = from; slot < until; slot++) {
-			pack_int32(*sock, (int32_t)overTime[slot].timestamp);
-			pack_int32(*sock, overTime[slot].blocked);
+		pack_map16_start(*sock, (uint16_t) stats.overTime_num);
+		for(unsigned int slot = 0; slot < stats.overTime_num; slot++) {
+			pack_int32(*sock, stats.overTime[slot].timestamp);
+			pack_int32(*sock, stats.overTime[slot].blocked);
 		}
 	}
 }
@@ -214,7 +192,7 @@ void getTopDomains(const char *client_message, const int *sock)
 	get_privacy_level(NULL);
 	if(config.privacylevel >= PRIVACY_HIDE_DOMAINS) {
 		// Always send the total number of domains, but pretend it's 0
-		if(!istelnet[*sock])
+		if(!istelnet(*sock))
 			pack_int32(*sock, 0);
 
 		return;
@@ -287,7 +265,7 @@ void getTopDomains(const char *client_message, const int *sock)
 		}
 	}
 
-	if(!istelnet[*sock])
+	if(!istelnet(*sock))
 	{
 		// Send the data required to get the percentage each domain has been blocked / queried
 		if(blocked)
@@ -324,7 +302,7 @@ void getTopDomains(const char *client_message, const int *sock)
 
 		if(blocked && showblocked && domain->blockedcount > 0)
 		{
-			if(istelnet[*sock])
+			if(istelnet(*sock))
 				ssend(*sock, "%i %i %s\n", n, domain->blockedcount, getstr(domain->domainpos));
 			else {
 				if(!pack_str32(*sock, getstr(domain->domainpos)))
@@ -336,7 +314,7 @@ void getTopDomains(const char *client_message, const int *sock)
 		}
 		else if(!blocked && showpermitted && (domain->count - domain->blockedcount) > 0)
 		{
-			if(istelnet[*sock])
+			if(istelnet(*sock))
 				ssend(*sock,"%i %i %s\n",n,(domain->count - domain->blockedcount),getstr(domain->domainpos));
 			else
 			{
@@ -365,7 +343,7 @@ void getTopClients(const char *client_message, const int *sock)
 	get_privacy_level(NULL);
 	if(config.privacylevel >= PRIVACY_HIDE_DOMAINS_CLIENTS) {
 		// Always send the total number of clients, but pretend it's 0
-		if(!istelnet[*sock])
+		if(!istelnet(*sock))
 			pack_int32(*sock, 0);
 
 		return;
@@ -426,7 +404,7 @@ void getTopClients(const char *client_message, const int *sock)
 		getSetupVarsArray(excludeclients);
 	}
 
-	if(!istelnet[*sock])
+	if(!istelnet(*sock))
 	{
 		// Send the total queries so they can make percentages from this data
 		pack_int32(*sock, counters->queries);
@@ -468,7 +446,7 @@ void getTopClients(const char *client_message, const int *sock)
 		// - the client made at least one query within the most recent 24 hours
 		if(includezeroclients || ccount > 0)
 		{
-			if(istelnet[*sock])
+			if(istelnet(*sock))
 				ssend(*sock,"%i %i %s %s\n", n, ccount, client_ip, client_name);
 			else
 			{
@@ -492,36 +470,23 @@ void getTopClients(const char *client_message, const int *sock)
 void getUpstreamDestinations(const char *client_message, const int *sock)
 {
 	bool sort = true;
-	int temparray[counters->upstreams][2], totalqueries = 0;
 
 	if(command(client_message, "unsorted"))
 		sort = false;
 
-	for(int upstreamID = 0; upstreamID < counters->upstreams; upstreamID++)
-	{
-		// If we want to print a sorted output, we fill the temporary array with
-		// the values we will use for sorting afterwards
-		if(sort) {
-			// Get forward pointer
-			const upstreamsData* forward = getUpstream(upstreamID, true);
-			if(forward == NULL)
-				continue;
+	// Get most recently published statistics. They contain the upstream
+	// destinations with the most queries (sorted) as well as the first
+	// ones (unsorted)
+	statsSnapshot stats;
+	get_stats_snapshot(&stats);
+	const countersStruct *counts = &stats.counters;
+	const upstreamSnapshot *upstreams = sort ? stats.upstream_sorted : stats.upstream_unsorted;
+	const int num = sort ? (int)stats.upstreams_num : min(counts->upstreams, SNAPSHOT_UPSTREAMS);
 
-			temparray[upstreamID][0] = upstreamID;
-			temparray[upstreamID][1] = forward->count;
-		}
-	}
-
-	if(sort)
-	{
-		// Sort temporary array in descending order
-		qsort(temparray, counters->upstreams, sizeof(int[2]), cmpdesc);
-	}
-
-	totalqueries = counters->forwarded + counters->cached + counters->blocked;
+	const int totalqueries = counts->forwarded + counts->cached + counts->blocked;
 
 	// Loop over available forward destinations
-	for(int i = -2; i < min(counters->upstreams, 8); i++)
+	for(int i = -2; i < num; i++)
 	{
 		float percentage = 0.0f;
 		const char* ip, *name;
@@ -535,7 +500,7 @@ void getUpstreamDestinations(const char *client_message, const int *sock)
 
 			if(totalqueries > 0)
 				// Whats the percentage of locked queries on the total amount of queries?
-				percentage = 1e2f * counters->blocked / totalqueries;
+				percentage = 1e2f * counts->blocked / totalqueries;
 		}
 		else if(i == -1)
 		{
@@ -545,29 +510,18 @@ void getUpstreamDestinations(const char *client_message, const int *sock)
 
 			if(totalqueries > 0)
 				// Whats the percentage of cached queries on the total amount of queries?
-				percentage = 1e2f * counters->cached / totalqueries;
+				percentage = 1e2f * counts->cached / totalqueries;
 		}
 		else
 		{
 			// Regular upstream destination
-			// Get sorted indices
-			int upstreamID;
-			if(sort)
-				upstreamID = temparray[i][0];
-			else
-				upstreamID = i;
-
-			// Get upstream pointer
-			const upstreamsData* upstream = getUpstream(upstreamID, true);
-			if(upstream == NULL)
+			const upstreamSnapshot *upstream = &upstreams[i];
+			if(upstream->ip[0] == '\0')
 				continue;
 
-			// Get IP and host name of upstream destination if available
-			ip = getstr(upstream->ippos);
-			if(upstream->namepos != 0)
-				name = getstr(upstream->namepos);
-			else
-				name = getstr(upstream->ippos);
+			// Get IP and host name of upstream destination
+			ip = upstream->ip;
+			name = upstream->name;
 			upstream_port = upstream->port;
 
 			// Get percentage
@@ -580,7 +534,7 @@ void getUpstreamDestinations(const char *client_message, const int *sock)
 		// - only if percentage > 0.0 for all others (i > 0)
 		if(percentage > 0.0f || i < 0)
 		{
-			if(istelnet[*sock])
+			if(istelnet(*sock))
 				if(upstream_port != 0)
 					ssend(*sock, "%i %.2f %s#%u %s#%u\n", i, percentage,
 					      ip, upstream_port, name, upstream_port);
@@ -599,10 +553,15 @@ void getUpstreamDestinations(const char *client_message, const int *sock)
 
 void getQueryTypes(const int *sock)
 {
+	// Get most recently published statistics
+	statsSnapshot stats;
+	get_stats_snapshot(&stats);
+	const countersStruct *counts = &stats.counters;
+
 	int total = 0;
 	for(enum query_types type = TYPE_A; type < TYPE_MAX; type++)
 	{
-		total += counters->querytype[type - 1];
+		total += counts->querytype[type - 1];
 	}
 
 	float percentage[TYPE_MAX] = { 0.0 };
@@ -612,11 +571,11 @@ void getQueryTypes(const int *sock)
 	{
 		for(enum query_types type = TYPE_A; type < TYPE_MAX; type++)
 		{
-			percentage[type] = 1e2f*counters->querytype[type - 1]/total;
+			percentage[type] = 1e2f*counts->querytype[type - 1]/total;
 		}
 	}
 
-	if(istelnet[*sock]) {
+	if(istelnet(*sock)) {
 		ssend(*sock, "A (IPv4): %.2f\nAAAA (IPv6): %.2f\nANY: %.2f\nSRV: %.2f\n"
 		             "SOA: %.2f\nPTR: %.2f\nTXT: %.2f\nNAPTR: %.2f\n"
 		             "MX: %.2f\nDS: %.2f\nRRSIG: %.2f\nDNSKEY: %.2f\n"
@@ -662,6 +621,23 @@ void getQueryTypes(const int *sock)
 	}
 }
 
+// Yield the read lock during a scan over queries if the resolver is waiting
+// for it. Query IDs may have been rebased and queries may have been removed by
+// the garbage collection meanwhile, the current and the end ID of the scan are
+// moved accordingly
+static void yield_query_scan(int *queryID, int *end)
+{
+	const unsigned int shift = counters->query_id_shift;
+	if(!yield_shm_read())
+		return;
+
+	const int offset = (int)(counters->query_id_shift - shift);
+	*queryID -= offset;
+	*end -= offset;
+	if(*queryID < counters->oldest_query)
+		*queryID = counters->oldest_query;
+}
+
 void getAllQueries(const char *client_message, const int *sock)
 {
 	// Exit before processing any data if requested via config setting
@@ -849,6 +825,9 @@ void getAllQueries(const char *client_message, const int *sock)
 		if(ibeg < 0)
 			ibeg = 0;
 	}
+	// Translate into query IDs
+	ibeg += counters->oldest_query;
+	int iend = counters->oldest_query + counters->queries;
 
 	// Get potentially existing filtering flags
 	char * filter = read_setupVarsconf("API_QUERY_LOG_SHOW");
@@ -866,13 +845,23 @@ void getAllQueries(const char *client_message, const int *sock)
 	}
 	clearSetupVarsArray();
 
-	for(int queryID = ibeg; queryID < counters->queries; queryID++)
+	for(int queryID = ibeg; queryID < iend; queryID++)
 	{
+		// Let the resolver proceed if it is waiting for the lock
+		yield_query_scan(&queryID, &iend);
+		if(queryID >= iend)
+			break;
+
 		const queriesData* query = getQuery(queryID, true);
 		// Check if this query has been create while in maximum privacy mode
 		if(query == NULL || query->privacylevel >= PRIVACY_MAXIMUM)
 			continue;
 
+		// Get details of this query
+		const queriesColdData* cold = getQueryCold(query);
+		if(cold == NULL)
+			continue;
+
 		// Verify query type
 		if(query->type >= TYPE_MAX)
 			continue;
@@ -900,7 +889,7 @@ void getAllQueries(const char *client_message, const int *sock)
 			continue;
 
 		// Skip those entries which so not meet the requested timeframe
-		if((from > query->timestamp && from != 0) || (query->timestamp > until && until != 0))
+		if((from > (time_t)query->timestamp && from != 0) || ((time_t)query->timestamp > until && until != 0))
 			continue;
 
 		// Skip if domain is not identical with what the user wants to see
@@ -914,7 +903,7 @@ void getAllQueries(const char *client_message, const int *sock)
 			// If the domain of this query did not match, the CNAME
 			// domain may still match - we have to check it in
 			// addition if this query is of CNAME blocked type
-			else if(query->CNAME_domainID == domainid)
+			else if(cold->CNAME_domainID == domainid)
 			{
 				// Get this query
 			}
@@ -976,14 +965,12 @@ void getAllQueries(const char *client_message, const int *sock)
 		else
 			clientIPName = getClientIPString(query);
 
-		unsigned long delay = query->response;
-		// Check if received (delay should be smaller than 30min)
-		if(delay > 1.8e7)
-			delay = 0;
+		// No delay for queries which have not been answered so far
+		unsigned long delay = query->flags.response_pending ? 0 : cold->response;
 
 		// Get domain blocked during deep CNAME inspection, if applicable
 		const char *CNAME_domain = "N/A";
-		if(query->CNAME_domainID > -1)
+		if(cold->CNAME_domainID > -1)
 		{
 			CNAME_domain = getCNAMEDomainString(query);
 		}
@@ -993,8 +980,10 @@ void getAllQueries(const char *client_message, const int *sock)
 		if ((query->status == QUERY_REGEX || query->status == QUERY_REGEX_CNAME) &&
 		    config.privacylevel < PRIVACY_HIDE_DOMAINS)
 		{
-			unsigned int cacheID = findCacheID(query->domainID, query->clientID, query->type);
-			DNSCacheData *dns_cache = getDNSCache(cacheID, true);
+			// Only look up the cache entry, it must not be created while
+			// holding the read lock
+			const int cacheID = lookupCacheID(query->domainID, query->clientID, query->type);
+			const DNSCacheData *dns_cache = cacheID > -1 ? getDNSCache(cacheID, true) : NULL;
 			if(dns_cache != NULL)
 				regex_idx = dns_cache->black_regex_idx;
 		}
@@ -1018,7 +1007,7 @@ void getAllQueries(const char *client_message, const int *sock)
 			}
 		}
 
-		if(istelnet[*sock])
+		if(istelnet(*sock))
 		{
 			ssend(*sock,"%lli %s %s %s %i %i %i %lu %s %i %s",
 				(long long)query->timestamp,
@@ -1026,8 +1015,8 @@ void getAllQueries(const char *client_message, const int *sock)
 				domain,
 				clientIPName,
 				query->status,
-				query->dnssec,
-				query->reply,
+				cold->dnssec,
+				cold->reply,
 				delay,
 				CNAME_domain,
 				regex_idx,
@@ -1052,7 +1041,7 @@ void getAllQueries(const char *client_message, const int *sock)
 				return;
 
 			pack_uint8(*sock, query->status);
-			pack_uint8(*sock, query->dnssec);
+			pack_uint8(*sock, cold->dnssec);
 		}
 	}
 
@@ -1083,7 +1072,7 @@ void getRecentBlocked(const char *client_message, const int *sock)
 
 	// Find most recently blocked query
 	int found = 0;
-	for(int queryID = counters->queries - 1; queryID > 0 ; queryID--)
+	for(int queryID = counters->oldest_query + counters->queries - 1; queryID > counters->oldest_query; queryID--)
 	{
 		const queriesData* query = getQuery(queryID, true);
 		if(query == NULL)
@@ -1097,7 +1086,7 @@ void getRecentBlocked(const char *client_message, const int *sock)
 			if(domain == NULL)
 				continue;
 
-			if(istelnet[*sock])
+			if(istelnet(*sock))
 				ssend(*sock,"%s\n", domain);
 			else if(!pack_str32(*sock, domain))
 				return;
@@ -1113,7 +1102,7 @@ void getRecentBlocked(const char *client_message, const int *sock)
 
 void getClientID(const int *sock)
 {
-	if(istelnet[*sock])
+	if(istelnet(*sock))
 		ssend(*sock,"%i\n", *sock);
 	else
 		pack_int32(*sock, *sock);
@@ -1122,11 +1111,12 @@ void getClientID(const int *sock)
 void getQueryTypesOverTime(const int *sock)
 {
 	int from = -1, until = OVERTIME_SLOTS;
-	const time_t mintime = overTime[0].timestamp;
+	const time_t mintime = overTime[getOverTimeSlot(0)].timestamp;
 
 	for(int slot = 0; slot < OVERTIME_SLOTS; slot++)
 	{
-		if((overTime[slot].total > 0 || overTime[slot].blocked > 0) && overTime[slot].timestamp >= mintime)
+		const unsigned int idx = getOverTimeSlot(slot);
+		if((overTime[idx].total > 0 || overTime[idx].blocked > 0) && overTime[idx].timestamp >= mintime)
 		{
 			from = slot;
 			break;
@@ -1136,7 +1126,8 @@ void getQueryTypesOverTime(const int *sock)
 	// End with last non-empty overTime slot
 	for(int slot = 0; slot < OVERTIME_SLOTS; slot++)
 	{
-		if(overTime[slot].timestamp >= time(NULL))
+		const unsigned int idx = getOverTimeSlot(slot);
+		if(overTime[idx].timestamp >= time(NULL))
 		{
 			until = slot;
 			break;
@@ -1149,18 +1140,19 @@ void getQueryTypesOverTime(const int *sock)
 
 	for(int slot = from; slot < until; slot++)
 	{
+		const unsigned int idx = getOverTimeSlot(slot);
 		float percentageIPv4 = 0.0, percentageIPv6 = 0.0;
-		int sum = overTime[slot].querytypedata[0] + overTime[slot].querytypedata[1];
+		int sum = overTime[idx].querytypedata[0] + overTime[idx].querytypedata[1];
 
 		if(sum > 0) {
-			percentageIPv4 = (float) (1e2 * overTime[slot].querytypedata[0] / sum);
-			percentageIPv6 = (float) (1e2 * overTime[slot].querytypedata[1] / sum);
+			percentageIPv4 = (float) (1e2 * overTime[idx].querytypedata[0] / sum);
+			percentageIPv6 = (float) (1e2 * overTime[idx].querytypedata[1] / sum);
 		}
 
-		if(istelnet[*sock])
-			ssend(*sock, "%lli %.2f %.2f\n", (long long)overTime[slot].timestamp, percentageIPv4, percentageIPv6);
+		if(istelnet(*sock))
+			ssend(*sock, "%lli %.2f %.2f\n", (long long)overTime[idx].timestamp, percentageIPv4, percentageIPv6);
 		else {
-			pack_int32(*sock, overTime[slot].timestamp);
+			pack_int32(*sock, overTime[idx].timestamp);
 			pack_float(*sock, percentageIPv4);
 			pack_float(*sock, percentageIPv6);
 		}
@@ -1178,7 +1170,7 @@ void getVersion(const int *sock)
 	memcpy(hash, commit, 7); hash[7] = 0;
 
 	if(strlen(tag) > 1) {
-		if(istelnet[*sock])
+		if(istelnet(*sock))
 			ssend(
 					*sock,
 					"version %s\ntag %s\nbranch %s\nhash %s\ndate %s\n",
@@ -1194,7 +1186,7 @@ void getVersion(const int *sock)
 		}
 	}
 	else {
-		if(istelnet[*sock])
+		if(istelnet(*sock))
 			ssend(
 					*sock,
 					"version vDev-%s\ntag %s\nbranch %s\nhash %s\ndate %s\n",
@@ -1227,7 +1219,7 @@ void getDBstats(const int *sock)
 	double formated = 0.0;
 	format_memory_size(prefix, filesize, &formated);
 
-	if(istelnet[*sock])
+	if(istelnet(*sock))
 		ssend(*sock,"queries in database: %i\ndatabase filesize: %.2f %sB\nSQLite version: %s\n", get_number_of_queries_in_DB(), formated, prefix, get_sqlite3_version());
 	else {
 		pack_int32(*sock, get_number_of_queries_in_DB());
@@ -1238,6 +1230,46 @@ void getDBstats(const int *sock)
 	}
 }
 
+void getLockStats(const int *sock)
+{
+	// Statistics are read without obtaining the lock. They are only
+	// updated while holding it so values may be slightly inconsistent
+	for(unsigned int i = 0; i < LOCKSTATS_SITES; i++)
+	{
+		const lockSiteStats *site = &lockStats->site[i];
+		if(site->line == 0)
+			continue;
+
+		if(istelnet(*sock))
+		{
+			ssend(*sock, "%s %s:%i %u %llu %u %llu %u",
+			      site->func, site->file, site->line, site->count,
+			      (unsigned long long)site->wait_total, site->wait_max,
+			      (unsigned long long)site->hold_total, site->hold_max);
+			for(unsigned int j = 0; j < LOCKSTATS_BUCKETS; j++)
+				ssend(*sock, " %u", site->wait_hist[j]);
+			for(unsigned int j = 0; j < LOCKSTATS_BUCKETS; j++)
+				ssend(*sock, " %u", site->hold_hist[j]);
+			ssend(*sock, "\n");
+		}
+		else
+		{
+			if(!pack_str32(*sock, site->func) || !pack_str32(*sock, site->file))
+				return;
+			pack_int32(*sock, site->line);
+			pack_int32(*sock, site->count);
+			pack_uint64(*sock, site->wait_total);
+			pack_int32(*sock, site->wait_max);
+			pack_uint64(*sock, site->hold_total);
+			pack_int32(*sock, site->hold_max);
+			for(unsigned int j = 0; j < LOCKSTATS_BUCKETS; j++)
+				pack_int32(*sock, site->wait_hist[j]);
+			for(unsigned int j = 0; j < LOCKSTATS_BUCKETS; j++)
+				pack_int32(*sock, site->hold_hist[j]);
+		}
+	}
+}
+
 void getClientsOverTime(const int *sock)
 {
 	int sendit = -1, until = OVERTIME_SLOTS;
@@ -1250,8 +1282,9 @@ void getClientsOverTime(const int *sock)
 	// Find minimum ID to send
 	for(int slot = 0; slot < OVERTIME_SLOTS; slot++)
 	{
-		if((overTime[slot].total > 0 || overTime[slot].blocked > 0) &&
-		   overTime[slot].timestamp >= overTime[0].timestamp)
+		const unsigned int idx = getOverTimeSlot(slot);
+		if((overTime[idx].total > 0 || overTime[idx].blocked > 0) &&
+		   overTime[idx].timestamp >= overTime[getOverTimeSlot(0)].timestamp)
 		{
 			sendit = slot;
 			break;
@@ -1263,7 +1296,8 @@ void getClientsOverTime(const int *sock)
 	// Find minimum ID to send
 	for(int slot = 0; slot < OVERTIME_SLOTS; slot++)
 	{
-		if(overTime[slot].timestamp >= time(NULL))
+		const unsigned int idx = getOverTimeSlot(slot);
+		if(overTime[idx].timestamp >= time(NULL))
 		{
 			until = slot;
 			break;
@@ -1298,13 +1332,28 @@ void getClientsOverTime(const int *sock)
 		}
 	}
 
+	// Per-client counts of the current slot (at least one element as there
+	// may be no clients at all)
+	int *clientcount = calloc(counters->clients > 0 ? counters->clients : 1, sizeof(int));
+	if(clientcount == NULL)
+	{
+		logg("Memory allocation failed in getClientsOverTime()");
+		if(excludeclients != NULL)
+			clearSetupVarsArray();
+		return;
+	}
+
 	// Main return loop
 	for(int slot = sendit; slot < until; slot++)
 	{
-		if(istelnet[*sock])
-			ssend(*sock, "%lli", (long long)overTime[slot].timestamp);
+		const unsigned int idx = getOverTimeSlot(slot);
+		memset(clientcount, 0, counters->clients*sizeof(int));
+		get_client_overTime_slot(idx, clientcount, counters->clients);
+
+		if(istelnet(*sock))
+			ssend(*sock, "%lli", (long long)overTime[idx].timestamp);
 		else
-			pack_int32(*sock, (int32_t)overTime[slot].timestamp);
+			pack_int32(*sock, (int32_t)overTime[idx].timestamp);
 
 		// Loop over forward destinations to generate output to be sent to the client
 		for(int clientID = 0; clientID < counters->clients; clientID++)
@@ -1320,20 +1369,22 @@ void getClientsOverTime(const int *sock)
 			// Also skip clients with no active counts at all (may be old IPv6 addresses)
 			if(client->count == 0)
 				continue;
-			const int thisclient = client->overTime[slot];
+			const int thisclient = clientcount[clientID];
 
-			if(istelnet[*sock])
+			if(istelnet(*sock))
 				ssend(*sock, " %i", thisclient);
 			else
 				pack_int32(*sock, thisclient);
 		}
 
-		if(istelnet[*sock])
+		if(istelnet(*sock))
 			ssend(*sock, "\n");
 		else
 			pack_int32(*sock, -1);
 	}
 
+	free(clientcount);
+
 	if(excludeclients != NULL)
 		clearSetupVarsArray();
 }
@@ -1391,7 +1442,7 @@ void getClientNames(const int *sock)
 		const char *client_ip = getstr(client->ippos);
 		const char *client_name = getstr(client->namepos);
 
-		if(istelnet[*sock])
+		if(istelnet(*sock))
 			ssend(*sock, "%s %s\n", client_name, client_ip);
 		else {
 			pack_str32(*sock, client_name);
@@ -1410,8 +1461,14 @@ void getUnknownQueries(const int *sock)
 	if(config.privacylevel >= PRIVACY_HIDE_DOMAINS)
 		return;
 
-	for(int queryID = 0; queryID < counters->queries; queryID++)
+	int end = counters->oldest_query + counters->queries;
+	for(int queryID = counters->oldest_query; queryID < end; queryID++)
 	{
+		// Let the resolver proceed if it is waiting for the lock
+		yield_query_scan(&queryID, &end);
+		if(queryID >= end)
+			break;
+
 		const queriesData* query = getQuery(queryID, true);
 
 		if(query == NULL ||
@@ -1436,14 +1493,20 @@ void getUnknownQueries(const int *sock)
 		if(domain == NULL || client == NULL)
 			continue;
 
+		// Get details of this query
+		const queriesColdData* cold = getQueryCold(query);
+		if(cold == NULL)
+			continue;
+
 		// Get client IP string
 		const char *clientIP = getstr(client->ippos);
+		const int id = cold->id;
 
-		if(istelnet[*sock])
-			ssend(*sock, "%lli %i %i %s %s %s %i %s\n", (long long)query->timestamp, queryID, query->id, type, getstr(domain->domainpos), clientIP, query->status, query->flags.complete ? "true" : "false");
+		if(istelnet(*sock))
+			ssend(*sock, "%lli %i %i %s %s %s %i %s\n", (long long)query->timestamp, queryID, id, type, getstr(domain->domainpos), clientIP, query->status, query->flags.complete ? "true" : "false");
 		else {
 			pack_int32(*sock, (int32_t)query->timestamp);
-			pack_int32(*sock, query->id);
+			pack_int32(*sock, id);
 
 			// Use a fixstr because the length of qtype is always 4 (max is 31 for fixstr)
 			if(!pack_fixstr(*sock, type))
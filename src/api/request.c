@@ -17,6 +17,7 @@
 #include "../resolve.h"
 #include "../regex_r.h"
 #include "../database/network-table.h"
+#include "../database/gravity-db.h"
 #include "../log.h"
 // Eventqueue routines
 #include "../events.h"
@@ -35,65 +36,60 @@ void process_request(const char *client_message, int *sock)
 	if(command(client_message, ">stats"))
 	{
 		processed = true;
-		lock_shm();
+		// Served from the published statistics without locking
 		getStats(sock);
-		unlock_shm();
 	}
 	else if(command(client_message, ">overTime"))
 	{
 		processed = true;
-		lock_shm();
+		// Served from the published statistics without locking
 		getOverTime(sock);
-		unlock_shm();
 	}
 	else if(command(client_message, ">top-domains") || command(client_message, ">top-ads"))
 	{
 		processed = true;
-		lock_shm();
+		lock_shm_read();
 		getTopDomains(client_message, sock);
-		unlock_shm();
+		unlock_shm_read();
 	}
 	else if(command(client_message, ">top-clients"))
 	{
 		processed = true;
-		lock_shm();
+		lock_shm_read();
 		getTopClients(client_message, sock);
-		unlock_shm();
+		unlock_shm_read();
 	}
 	else if(command(client_message, ">forward-dest"))
 	{
 		processed = true;
-		lock_shm();
+		// Served from the published statistics without locking
 		getUpstreamDestinations(client_message, sock);
-		unlock_shm();
 	}
 	else if(command(client_message, ">forward-names"))
 	{
 		processed = true;
-		lock_shm();
+		// Served from the published statistics without locking
 		getUpstreamDestinations(">forward-dest unsorted", sock);
-		unlock_shm();
 	}
 	else if(command(client_message, ">querytypes"))
 	{
 		processed = true;
-		lock_shm();
+		// Served from the published statistics without locking
 		getQueryTypes(sock);
-		unlock_shm();
 	}
 	else if(command(client_message, ">getallqueries"))
 	{
 		processed = true;
-		lock_shm();
+		lock_shm_read();
 		getAllQueries(client_message, sock);
-		unlock_shm();
+		unlock_shm_read();
 	}
 	else if(command(client_message, ">recentBlocked"))
 	{
 		processed = true;
-		lock_shm();
+		lock_shm_read();
 		getRecentBlocked(client_message, sock);
-		unlock_shm();
+		unlock_shm_read();
 	}
 	else if(command(client_message, ">clientID"))
 	{
@@ -105,9 +101,9 @@ void process_request(const char *client_message, int *sock)
 	else if(command(client_message, ">QueryTypesoverTime"))
 	{
 		processed = true;
-		lock_shm();
+		lock_shm_read();
 		getQueryTypesOverTime(sock);
-		unlock_shm();
+		unlock_shm_read();
 	}
 	else if(command(client_message, ">version"))
 	{
@@ -125,23 +121,29 @@ void process_request(const char *client_message, int *sock)
 	else if(command(client_message, ">ClientsoverTime"))
 	{
 		processed = true;
-		lock_shm();
+		lock_shm_read();
 		getClientsOverTime(sock);
-		unlock_shm();
+		unlock_shm_read();
 	}
 	else if(command(client_message, ">client-names"))
 	{
 		processed = true;
-		lock_shm();
+		lock_shm_read();
 		getClientNames(sock);
-		unlock_shm();
+		unlock_shm_read();
 	}
 	else if(command(client_message, ">unknown"))
 	{
 		processed = true;
-		lock_shm();
+		lock_shm_read();
 		getUnknownQueries(sock);
-		unlock_shm();
+		unlock_shm_read();
+	}
+	else if(command(client_message, ">lockstats"))
+	{
+		processed = true;
+		// No lock required, we want to observe it
+		getLockStats(sock);
 	}
 	else if(command(client_message, ">cacheinfo"))
 	{
@@ -161,9 +163,11 @@ void process_request(const char *client_message, int *sock)
 		processed = true;
 		logg("Received API request to recompile regex");
 		lock_shm();
+		lock_lists_write();
 		// Reread regex.list
 		// Read and compile possible regex filters
 		read_regex_from_database();
+		unlock_lists();
 		unlock_shm();
 	}
 	else if(command(client_message, ">update-mac-vendor"))
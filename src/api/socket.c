@@ -16,6 +16,10 @@
 #include "../config.h"
 // global variable killed
 #include "../signals.h"
+// epoll_create1()
+#include <sys/epoll.h>
+// atomic_int
+#include <stdatomic.h>
 
 // The backlog argument defines the maximum length
 // to which the queue of pending connections for
@@ -25,13 +29,23 @@
 // the underlying protocol supports retransmission,
 // the request may be ignored so that a later
 // reattempt at connection succeeds.
-#define BACKLOG 5
+#define BACKLOG 64
 
 // File descriptors
 int socketfd = 0, telnetfd4 = 0, telnetfd6 = 0;
 bool dualstack = false;
 bool ipv4telnet = false, ipv6telnet = false, sock_avail = false;
-bool istelnet[MAXCONNS];
+
+// Per-connection state of API clients
+typedef struct apiConnection {
+	int fd;
+	bool telnet;
+	bool listening;
+	bool closing;
+	size_t len;
+	char buffer[SOCKETBUFFERLEN];
+	struct apiConnection *next;
+} apiConnection;
 
 void saveport(int port)
 {
@@ -211,7 +225,7 @@ static bool bind_to_unix_socket(int *socketdescriptor)
 
 void seom(const int sock)
 {
-	if(istelnet[sock])
+	if(istelnet(sock))
 		ssend(sock, "---EOM---\n\n");
 	else
 		pack_eom(sock);
@@ -226,56 +240,187 @@ void __attribute__ ((format (gnu_printf, 2, 3))) ssend(const int sock, const cha
 	va_end(args);
 	if(bytes > 0 && buffer != NULL)
 	{
-		write(sock, buffer, bytes);
+		swrite(sock, buffer, bytes);
 		free(buffer);
 	}
 }
 
-static inline int checkClientLimit(const int socket) {
-	if(socket < MAXCONNS)
+// Write to an API client. The send timeout of the socket (see
+// accept_connection()) expires when the client does not read its replies. The
+// socket is shut down then so further writes of this reply fail immediately
+// instead of waiting for the timeout again
+void swrite(const int sock, const void *buf, const size_t len)
+{
+	if(write(sock, buf, len) < (ssize_t)len)
+		shutdown(sock, SHUT_RDWR);
+}
+
+// Number of currently open client connections
+static atomic_int connections = 0;
+
+// epoll instance watching the listening sockets and all idle connections
+static int epollfd = -1;
+
+// Listening sockets
+static apiConnection listeners[3];
+
+// Queue of connections with a received request waiting for a worker
+static apiConnection *queue_head = NULL, *queue_tail = NULL;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+// Connection whose request is processed by this worker thread
+static _Thread_local apiConnection *current = NULL;
+
+bool __attribute__((pure)) istelnet(const int sock)
+{
+	return current != NULL && current->fd == sock && current->telnet;
+}
+
+// Watch connection (again) for incoming data. Connections are registered as
+// one-shot so that each connection is handled by at most one thread at a time:
+// it is not read again before the reply to the previous request has been sent
+// (backpressure on clients sending requests faster than they read replies)
+static void watch_connection(apiConnection *conn, const int op)
+{
+	struct epoll_event ev = { 0 };
+	ev.events = EPOLLIN | EPOLLRDHUP | (conn->listening ? 0 : EPOLLONESHOT);
+	ev.data.ptr = conn;
+	if(epoll_ctl(epollfd, op, conn->fd, &ev) != 0)
+		logg("WARNING: Cannot watch API connection %i: %s (%i)", conn->fd, strerror(errno), errno);
+}
+
+static void close_connection(apiConnection *conn)
+{
+	// Closing the socket also removes it from the epoll instance
+	if(conn->fd != 0)
+		close(conn->fd);
+	free(conn);
+	atomic_fetch_sub(&connections, 1);
+}
+
+static void accept_connection(apiConnection *listener)
+{
+	const int sock = accept(listener->fd, NULL, NULL);
+	if(sock < 0)
 	{
-		return socket;
+		logg("API %s error: %s (%i)", listener->telnet ? "telnet" : "socket", strerror(errno), errno);
+		return;
 	}
+
+	if(atomic_fetch_add(&connections, 1) >= MAXCONNS)
+	{
+		atomic_fetch_sub(&connections, 1);
+		logg("Client denied (at max capacity of %i): %i", MAXCONNS, sock);
+		close(sock);
+		return;
+	}
+
+	apiConnection *conn = calloc(1, sizeof(apiConnection));
+	if(conn == NULL)
+	{
+		atomic_fetch_sub(&connections, 1);
+		close(sock);
+		return;
+	}
+	conn->fd = sock;
+	conn->telnet = listener->telnet;
+
+	// Do not let clients which do not read their replies block a worker
+	// thread forever
+	struct timeval tv = { API_SEND_TIMEOUT, 0 };
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	watch_connection(conn, EPOLL_CTL_ADD);
+}
+
+static void queue_request(apiConnection *conn)
+{
+	pthread_mutex_lock(&queue_lock);
+	conn->next = NULL;
+	if(queue_tail != NULL)
+		queue_tail->next = conn;
 	else
+		queue_head = conn;
+	queue_tail = conn;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+// Read everything the client has sent so far. The request is complete when
+// there is no more data to read (or the buffer is full)
+static void read_request(apiConnection *conn)
+{
+	while(conn->len < sizeof(conn->buffer) - 1)
 	{
-		logg("Client denied (at max capacity of %i): %i", MAXCONNS, socket);
+		const ssize_t n = recv(conn->fd, conn->buffer + conn->len,
+		                       sizeof(conn->buffer) - 1 - conn->len, MSG_DONTWAIT);
+		if(n > 0)
+		{
+			conn->len += n;
+			continue;
+		}
 
-		close(socket);
-		return -1;
+		// Client disconnected or error other than "no more data"
+		if(n == 0 || errno != EAGAIN)
+			conn->closing = true;
+		break;
 	}
+
+	if(conn->len > 0)
+	{
+		// Hand request over to a worker thread
+		conn->buffer[conn->len] = '\0';
+		queue_request(conn);
+	}
+	else if(conn->closing)
+		close_connection(conn);
+	else
+		watch_connection(conn, EPOLL_CTL_MOD);
 }
 
-static int listener(const int sockfd, const char type)
+static void *api_worker_thread(void *val)
 {
-	struct sockaddr_un un_addr;
-	struct sockaddr_in in4_addr;
-	struct sockaddr_in6 in6_addr;
-	socklen_t socklen = 0;
-	int socket;
+	// Set thread name
+	char threadname[16];
+	snprintf(threadname, sizeof(threadname), "api-worker-%i", (int)(intptr_t)val);
+	prctl(PR_SET_NAME, threadname, 0, 0, 0);
 
-	switch(type)
+	while(!killed)
 	{
-		case 0: // Unix socket
-			memset(&un_addr, 0, sizeof(un_addr));
-			socklen = sizeof(un_addr);
-			return accept(sockfd, (struct sockaddr *) &un_addr, &socklen);
-
-		case 4: // Internet socket (IPv4)
-			memset(&in4_addr, 0, sizeof(in4_addr));
-			socklen = sizeof(un_addr);
-			socket = accept(sockfd, (struct sockaddr *) &in4_addr, &socklen);
-			return checkClientLimit(socket);
-
-		case 6: // Internet socket (IPv6)
-			memset(&in6_addr, 0, sizeof(in6_addr));
-			socklen = sizeof(un_addr);
-			socket = accept(sockfd, (struct sockaddr *) &in6_addr, &socklen);
-			return checkClientLimit(socket);
-
-		default: // Should not happen
-			logg("Cannot listen on type %i connection, code error!", type);
-			exit(EXIT_FAILURE);
+		// Wait for the next request
+		pthread_mutex_lock(&queue_lock);
+		while(queue_head == NULL)
+			pthread_cond_wait(&queue_cond, &queue_lock);
+		apiConnection *conn = queue_head;
+		queue_head = conn->next;
+		if(queue_head == NULL)
+			queue_tail = NULL;
+		pthread_mutex_unlock(&queue_lock);
+
+		// Process received message
+		current = conn;
+		process_request(conn->buffer, &conn->fd);
+		current = NULL;
+		conn->len = 0;
+
+		// Client disconnected by sending EOT or ">quit" (conn->fd is
+		// zero now) or closed its side of the connection
+		if(conn->fd == 0 || conn->closing)
+			close_connection(conn);
+		else
+			watch_connection(conn, EPOLL_CTL_MOD);
 	}
+
+	return NULL;
+}
+
+static void add_listener(apiConnection *listener, const int fd, const bool telnet)
+{
+	listener->fd = fd;
+	listener->telnet = telnet;
+	listener->listening = true;
+	watch_connection(listener, EPOLL_CTL_ADD);
 }
 
 void close_telnet_socket(void)
@@ -300,156 +445,40 @@ void close_unix_socket(bool unlink_file)
 		close(socketfd);
 }
 
-static void *telnet_connection_handler_thread(void *socket_desc)
-{
-	//Get the socket descriptor
-	int sock = *(int*)socket_desc;
-	// Set connection type to telnet
-	istelnet[sock] = true;
-
-	// Define buffer for client's message
-	char client_message[SOCKETBUFFERLEN] = "";
-
-	// Set thread name
-	char threadname[16];
-	sprintf(threadname,"telnet-%i",sock);
-	prctl(PR_SET_NAME,threadname,0,0,0);
-	//Receive from client
-	ssize_t n;
-	while((n = recv(sock,client_message,SOCKETBUFFERLEN-1, 0)))
-	{
-		if (n > 0)
-		{
-			char *message = strdup(client_message);
-			if(message == NULL) break;
-
-			// Clear client message receive buffer
-			memset(client_message, 0, sizeof client_message);
-
-			// Process received message
-			process_request(message, &sock);
-			free(message);
-
-			if(sock == 0)
-			{
-				// Client disconnected by sending EOT or ">quit"
-				break;
-			}
-		}
-		else if(n == -1)
-		{
-			break;
-		}
-	}
-
-	//Free the socket pointer
-	if(sock != 0)
-		close(sock);
-	free(socket_desc);
-
-	return false;
-}
-
-
-static void *socket_connection_handler_thread(void *socket_desc)
+void *api_thread(void *args)
 {
-	//Get the socket descriptor
-	int sock = *(int*)socket_desc;
-	// Set connection type to not telnet
-	istelnet[sock] = false;
-
-	// Define buffer for client's message
-	char client_message[SOCKETBUFFERLEN] = "";
-
 	// Set thread name
-	char threadname[16];
-	sprintf(threadname,"socket-%i",sock);
-	prctl(PR_SET_NAME,threadname,0,0,0);
+	prctl(PR_SET_NAME,"api",0,0,0);
 
-	// Receive from client
-	ssize_t n;
-	while((n = recv(sock,client_message,SOCKETBUFFERLEN-1, 0)))
+	epollfd = epoll_create1(0);
+	if(epollfd < 0)
 	{
-		if (n > 0)
-		{
-			char *message = strdup(client_message);
-			if(message == NULL) break;
-
-			// Clear client message receive buffer
-			memset(client_message, 0, sizeof client_message);
-
-			// Process received message
-			process_request(message, &sock);
-			free(message);
-
-			if(sock == 0)
-			{
-				// Socket connection interrupted by sending EOT or ">quit"
-				break;
-			}
-		}
-		else if(n == -1)
-		{
-			break;
-		}
+		logg("Error creating API epoll instance: %s (%i)", strerror(errno), errno);
+		return NULL;
 	}
 
-	//Free the socket pointer
-	if(sock != 0)
-		close(sock);
-	free(socket_desc);
-
-	return false;
-}
-
-void *telnet_listening_thread_IPv4(void *args)
-{
-	// We will use the attributes object later to start all threads in detached mode
-	pthread_attr_t attr;
-	// Initialize thread attributes object with default attribute values
-	pthread_attr_init(&attr);
-	// When a detached thread terminates, its resources are automatically released back to
-	// the system without the need for another thread to join with the terminated thread
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-
-	// Set thread name
-	prctl(PR_SET_NAME,"telnet-IPv4",0,0,0);
-
 	// Initialize IPv4 telnet socket
 	ipv4telnet = bind_to_telnet_port_IPv4(&telnetfd4);
-	if(!ipv4telnet)
-		return NULL;
+	if(ipv4telnet)
+		add_listener(&listeners[0], telnetfd4, true);
 
-	// Listen as long as FTL is not killed
-	while(!killed)
-	{
-		// Look for new clients that want to connect
-		const int csck = listener(telnetfd4, 4);
-		if(csck == -1)
-		{
-			logg("IPv4 telnet error: %s (%i)", strerror(errno), errno);
-			continue;
-		}
+	// Initialize IPv6 telnet socket but only if IPv6 interfaces are available
+	if(ipv6_available())
+		ipv6telnet = bind_to_telnet_port_IPv6(&telnetfd6);
+	if(ipv6telnet)
+		add_listener(&listeners[1], telnetfd6, true);
 
-		// Allocate memory used to transport client socket ID to client listening thread
-		int *newsock;
-		newsock = calloc(1,sizeof(int));
-		if(newsock == NULL) break;
-		*newsock = csck;
+	// Initialize Unix socket
+	sock_avail = bind_to_unix_socket(&socketfd);
+	if(sock_avail)
+		add_listener(&listeners[2], socketfd, false);
+	else
+		logg("INFO: Unix socket will not be available");
 
-		pthread_t telnet_connection_thread;
-		// Create a new thread
-		if(pthread_create( &telnet_connection_thread, &attr, telnet_connection_handler_thread, (void*) newsock ) != 0)
-		{
-			// Log the error code description
-			logg("WARNING: Unable to open telnet processing thread: %s", strerror(errno));
-		}
-	}
-	return false;
-}
+	// Return early to avoid CPU spinning if no socket is available
+	if(!ipv4telnet && !ipv6telnet && !sock_avail)
+		return NULL;
 
-void *telnet_listening_thread_IPv6(void *args)
-{
 	// We will use the attributes object later to start all threads in detached mode
 	pthread_attr_t attr;
 	// Initialize thread attributes object with default attribute values
@@ -458,89 +487,39 @@ void *telnet_listening_thread_IPv6(void *args)
 	// the system without the need for another thread to join with the terminated thread
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
-	// Set thread name
-	prctl(PR_SET_NAME,"telnet-IPv6",0,0,0);
-
-	// Initialize IPv6 telnet socket but only if IPv6 interfaces are available
-	if(!ipv6_available())
-		return NULL;
-
-	ipv6telnet = bind_to_telnet_port_IPv6(&telnetfd6);
-	if(!ipv6telnet)
-		return NULL;
-
-	// Listen as long as FTL is not killed
-	while(!killed)
+	// Start a fixed number of worker threads processing the requests
+	for(intptr_t i = 0; i < API_WORKERS; i++)
 	{
-		// Look for new clients that want to connect
-		const int csck = listener(telnetfd6, 6);
-		if(csck == -1)
-		{
-			logg("IPv6 telnet error: %s (%i)", strerror(errno), errno);
-			continue;
-		}
-
-		// Allocate memory used to transport client socket ID to client listening thread
-		int *newsock;
-		newsock = calloc(1,sizeof(int));
-		if(newsock == NULL) break;
-		*newsock = csck;
-
-		pthread_t telnet_connection_thread;
-		// Create a new thread
-		if(pthread_create( &telnet_connection_thread, &attr, telnet_connection_handler_thread, (void*) newsock ) != 0)
+		pthread_t worker;
+		if(pthread_create(&worker, &attr, api_worker_thread, (void*)i) != 0)
 		{
 			// Log the error code description
-			logg("WARNING: Unable to open telnet processing thread: %s", strerror(errno));
+			logg("WARNING: Unable to open API worker thread: %s", strerror(errno));
 		}
 	}
-	return false;
-}
-
-void *socket_listening_thread(void *args)
-{
-	// We will use the attributes object later to start all threads in detached mode
-	pthread_attr_t attr;
-	// Initialize thread attributes object with default attribute values
-	pthread_attr_init(&attr);
-	// When a detached thread terminates, its resources are automatically released back to
-	// the system without the need for another thread to join with the terminated thread
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-
-	// Set thread name
-	prctl(PR_SET_NAME,"socket listener",0,0,0);
-
-	// Return early to avoid CPU spinning if Unix socket is not available
-	sock_avail = bind_to_unix_socket(&socketfd);
-	if(!sock_avail)
-	{
-		logg("INFO: Unix socket will not be available");
-		return NULL;
-	}
 
 	// Listen as long as FTL is not killed
 	while(!killed)
 	{
-		// Look for new clients that want to connect
-		const int csck = listener(socketfd, 0);
-		if(csck < 0)
+		struct epoll_event events[16];
+		const int n = epoll_wait(epollfd, events, sizeof(events)/sizeof(events[0]), -1);
+		if(n < 0)
+		{
+			if(errno != EINTR)
+				logg("API epoll error: %s (%i)", strerror(errno), errno);
 			continue;
+		}
 
-		// Allocate memory used to transport client socket ID to client listening thread
-		int *newsock;
-		newsock = calloc(1,sizeof(int));
-		if(newsock == NULL) break;
-		*newsock = csck;
-
-		pthread_t socket_connection_thread;
-		// Create a new thread
-		if(pthread_create( &socket_connection_thread, &attr, socket_connection_handler_thread, (void*) newsock ) != 0)
+		for(int i = 0; i < n; i++)
 		{
-			// Log the error code description
-			logg("WARNING: Unable to open socket processing thread: %s", strerror(errno));
+			apiConnection *conn = events[i].data.ptr;
+			if(conn->listening)
+				accept_connection(conn);
+			else
+				read_request(conn);
 		}
 	}
-	return false;
+	return NULL;
 }
 
 bool ipv6_available(void)
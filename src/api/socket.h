@@ -15,13 +15,12 @@ void close_telnet_socket(void);
 void close_unix_socket(bool unlink_file);
 void seom(const int sock);
 void ssend(const int sock, const char *format, ...) __attribute__ ((format (gnu_printf, 2, 3)));
-void *telnet_listening_thread_IPv4(void *args);
-void *telnet_listening_thread_IPv6(void *args);
-void *socket_listening_thread(void *args);
+void swrite(const int sock, const void *buf, const size_t len);
+void *api_thread(void *args);
 bool ipv6_available(void);
 void bind_sockets(void);
 
 extern bool ipv4telnet, ipv6telnet;
-extern bool istelnet[MAXCONNS];
+bool istelnet(const int sock) __attribute__((pure));
 
 #endif //SOCKET_H
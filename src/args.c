@@ -28,6 +28,8 @@
 #include "lua/ftl_lua.h"
 // run_dhcp_discover()
 #include "dhcp-discover.h"
+// lockstats_cli()
+#include "lockstats.h"
 // defined in dnsmasq.c
 extern void print_dnsmasq_version(void);
 
@@ -283,6 +285,14 @@ void parse_args(int argc, char* argv[])
 			exit(run_dhcp_discover());
 		}
 
+		// Lock contention statistics of the running instance
+		if(strcmp(argv[i], "lockstats") == 0)
+		{
+			// Enable stdout printing
+			cli_mode = true;
+			exit(lockstats_cli());
+		}
+
 		// List of implemented arguments
 		if(strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "help") == 0 || strcmp(argv[i], "--help") == 0)
 		{
@@ -311,6 +321,8 @@ void parse_args(int argc, char* argv[])
 			printf("\tdhcp-discover       Discover DHCP servers in the local\n");
 			printf("\t                    network\n");
 			printf("\tsqlite3             FTL's SQLite3 shell\n");
+			printf("\tlockstats           Show lock contention statistics\n");
+			printf("\t                    of the running pihole-FTL\n");
 			printf("\n\nOnline help: https://github.com/pi-hole/FTL\n");
 			exit(EXIT_SUCCESS);
 		}
@@ -34,12 +34,14 @@ FTLFileNamesStruct FTLfiles = {
 	NULL,
 	NULL,
 	NULL,
+	NULL,
 	NULL
 };
 
-// Private global variables
-static char *conflinebuffer = NULL;
-static size_t size = 0;
+// Private global variables (per thread as API requests may read the config
+// file concurrently, e.g. in get_privacy_level())
+static _Thread_local char *conflinebuffer = NULL;
+static _Thread_local size_t size = 0;
 
 // Private prototypes
 static char *parse_FTLconf(FILE *fp, const char * key);
@@ -228,16 +230,18 @@ void read_FTLconf(void)
 			config.port = value;
 
 	// MAXLOGAGE
-	// Up to how many hours in the past should queries be imported from the database?
+	// Up to how many hours in the past should queries be kept in memory (and
+	// be imported from the database)? This also determines the number of
+	// overTime slots and cannot be changed without restarting FTL
 	// defaults to: 24.0 via MAXLOGAGE defined in FTL.h
 	config.maxlogage = MAXLOGAGE*3600;
 	buffer = parse_FTLconf(fp, "MAXLOGAGE");
 
 	fvalue = 0;
 	if(buffer != NULL && sscanf(buffer, "%f", &fvalue))
-		if(fvalue >= 0.0f && fvalue <= 1.0f*MAXLOGAGE)
+		if(fvalue >= 0.0f && fvalue <= 1.0f*MAXLOGAGE_LIMIT)
 			config.maxlogage = (int)(fvalue * 3600);
-	logg("   MAXLOGAGE: Importing up to %.1f hours of log data", (float)config.maxlogage/3600.0f);
+	logg("   MAXLOGAGE: Keeping up to %.1f hours of log data in memory", (float)config.maxlogage/3600.0f);
 
 	// PRIVACYLEVEL
 	// Specify if we want to anonymize the DNS queries somehow, available options are:
@@ -334,6 +338,9 @@ void read_FTLconf(void)
 	// GRAVITYDB
 	getpath(fp, "GRAVITYDB", "/etc/pihole/gravity.db", &FTLfiles.gravity_db);
 
+	// GRAVITYIMAGE
+	getpath(fp, "GRAVITYIMAGE", "/etc/pihole/gravity.img", &FTLfiles.gravity_image);
+
 	// PARSE_ARP_CACHE
 	// defaults to: true
 	buffer = parse_FTLconf(fp, "PARSE_ARP_CACHE");
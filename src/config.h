@@ -71,6 +71,7 @@ typedef struct {
 	char* socketfile;
 	char* FTL_db;
 	char* gravity_db;
+	char* gravity_image;
 	char* macvendor_db;
 	char* setupVars;
 	char* auditlist;
@@ -55,7 +55,7 @@ static void recompute_aliasclient(const int aliasclientID)
 	// Reset this alias-client
 	aliasclient->count = 0;
 	aliasclient->blockedcount = 0;
-	memset(aliasclient->overTime, 0, sizeof(aliasclient->overTime));
+	reset_client_overTime(aliasclientID);
 
 	// Loop over all existing clients to find which clients are associated to this one
 	for(int clientID = 0; clientID < counters->clients; clientID++)
@@ -88,7 +88,7 @@ static void recompute_aliasclient(const int aliasclientID)
 		aliasclient->count += client->count;
 		aliasclient->blockedcount += client->blockedcount;
 		for(int idx = 0; idx < OVERTIME_SLOTS; idx++)
-			aliasclient->overTime[idx] += client->overTime[idx];
+			change_client_overTime(aliasclientID, idx, get_client_overTime(clientID, idx));
 	}
 }
 
@@ -138,7 +138,9 @@ bool import_aliasclients(void)
 
 		// Store intended name
 		const char *name = (char*)sqlite3_column_text(stmt, 1);
-		client->namepos = addstr(name);
+		const size_t namepos = addstr(name);
+		freestr(client->namepos);
+		client->namepos = namepos;
 
 		// This is a aliasclient
 		client->flags.aliasclient = true;
@@ -294,7 +296,7 @@ void reimport_aliasclients(void)
 		// Reset this alias-client
 		client->count = 0;
 		client->blockedcount = 0;
-		memset(client->overTime, 0, sizeof(client->overTime));
+		reset_client_overTime(clientID);
 	}
 
 	// Import aliasclients from database table
@@ -20,6 +20,8 @@
 #include "../config.h"
 #include "../log.h"
 #include "../timers.h"
+// sched_run()
+#include "../scheduler.h"
 // global variable killed
 #include "../signals.h"
 // reimport_aliasclients()
@@ -27,54 +29,68 @@
 // Eventqueue routines
 #include "../events.h"
 
+// Interval for updating MAC vendor strings [seconds]
+#define MAC_VENDOR_INTERVAL 2592000L
+
+static void save_queries(const time_t now)
+{
+	// Save data to database (if enabled)
+	if(!FTL_DB_avail() || !config.DBexport)
+		return;
+
+	lock_shm();
+	DB_save_queries();
+	unlock_shm();
+
+	// Check if GC should be done on the database
+	if(DBdeleteoldqueries && config.maxDBdays != -1)
+	{
+		// No thread locks needed
+		delete_old_queries_in_DB();
+		DBdeleteoldqueries = false;
+	}
+}
+
+// Parse neighbor cache (fill network table) if enabled
+static void parse_neighbors(const time_t now)
+{
+	if(FTL_DB_avail() && config.parse_arp_cache)
+		parse_neighbor_cache();
+}
+
+// Update MAC vendor strings once a month (the MAC vendor database is not
+// updated very often)
+static void update_vendors(const time_t now)
+{
+	if(FTL_DB_avail())
+		updateMACVendorRecords();
+}
+
 void *DB_thread(void *val)
 {
 	// Set thread name
 	prctl(PR_SET_NAME,"database",0,0,0);
 
-	// Save timestamp as we do not want to store immediately
-	// to the database
-	time_t lastDBsave = time(NULL) - time(NULL)%config.DBinterval;
+	// Periodic jobs of this thread. The first database save happens after
+	// one interval, not immediately
+	scheduler sched;
+	schedJob save_job, neighbor_job, vendor_job;
+	sched_init(&sched, "database");
+	sched_add(&sched, &save_job, "database export", save_queries, config.DBinterval, 0, 0);
+	sched_add(&sched, &neighbor_job, "neighbor cache", parse_neighbors, config.DBinterval, 0, 0);
+	sched_add(&sched, &vendor_job, "MAC vendors", update_vendors, MAC_VENDOR_INTERVAL, 0, 0);
 
 	while(!killed)
 	{
-		if(FTL_DB_avail())
-		{
-			time_t now = time(NULL);
-			if(now - lastDBsave >= config.DBinterval)
-			{
-				// Update lastDBsave timer
-				lastDBsave = time(NULL) - time(NULL)%config.DBinterval;
-
-				// Save data to database (if enabled)
-				if(config.DBexport)
-				{
-					lock_shm();
-					DB_save_queries();
-					unlock_shm();
-
-					// Check if GC should be done on the database
-					if(DBdeleteoldqueries && config.maxDBdays != -1)
-					{
-						// No thread locks needed
-						delete_old_queries_in_DB();
-						DBdeleteoldqueries = false;
-					}
-				}
-
-				// Parse neighbor cache (fill network table) if enabled
-				if (config.parse_arp_cache)
-					set_event(PARSE_NEIGHBOR_CACHE);
-			}
-
-			// Update MAC vendor strings once a month (the MAC vendor
-			// database is not updated very often)
-			if(now % 2592000L == 0)
-				updateMACVendorRecords();
-
-			if(get_and_clear_event(PARSE_NEIGHBOR_CACHE))
-				parse_neighbor_cache();
-		}
+		// Get event sequence before processing events so that we do not
+		// miss events set while we are busy
+		const unsigned int seq = event_sequence();
+
+		// Run due jobs
+		const int timeout = sched_run(&sched);
+
+		if(FTL_DB_avail() && get_and_clear_event(PARSE_NEIGHBOR_CACHE))
+			parse_neighbor_cache();
 
 		// Process database related event queue elements
 		if(get_and_clear_event(RELOAD_GRAVITY))
@@ -92,8 +108,8 @@ void *DB_thread(void *val)
 			unlock_shm();
 		}
 
-		// Sleep 0.1 seconds
-		sleepms(100);
+		// Sleep until the next job is due or a new event is set
+		wait_for_event(seq, timeout);
 	}
 
 	return NULL;
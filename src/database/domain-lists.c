@@ -0,0 +1,783 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  In-memory domain lists
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "../FTL.h"
+#include "domain-lists.h"
+// logg()
+#include "../log.h"
+// hashStr(), hashData()
+#include "../shmem.h"
+// mmap()
+#include <sys/mman.h>
+// open()
+#include <fcntl.h>
+
+// The exact domain lists are kept in process-private open addressing hash
+// tables. Every domain carries the set of groups it is enabled for as a bit
+// mask. The bit of a group is the index of its ID in the sorted array of all
+// group IDs. Many domains share the same groups (all domains of an adlist do)
+// so the masks are stored only once and entries refer to them by index.
+//
+// Most domains are on none of the lists. Every table has a blocked Bloom filter
+// in front of it which answers most of these lookups with a single cache line
+// access instead of probing the (large) hash table. All bits of a domain are in
+// one 512 bit block of the filter.
+//
+// After building, the lists are written into a binary image file which is then
+// mapped read-only. The main process and all forks share the pages of this
+// image and a restart with an unchanged database maps the image instead of
+// reading all domains again. The image is bound to the database file it was
+// built from (device, inode, size and modification time).
+
+// Initial number of slots of a domain table (power of two)
+#define DOMAINLISTS_INITIAL 1024u
+
+// Bloom filter: bits per domain and bits set per domain. This gives a false
+// positive rate of about 1%
+#define BLOOM_BITS_PER_DOMAIN 10u
+#define BLOOM_HASHES 7u
+// Size of one block of the filter (one cache line) in 64 bit words
+#define BLOOM_BLOCK_WORDS 8u
+
+// Binary image: "FTLlist" + NUL, increase the version on any layout change
+#define IMAGE_MAGIC "FTLlist"
+#define IMAGE_VERSION 1u
+// Alignment of the sections of the image
+#define IMAGE_ALIGN 64u
+
+typedef struct {
+	uint32_t hash;
+	uint32_t domain; // Offset of the domain in strings, 0 = empty slot
+	uint32_t mask; // Index of the group mask
+} domainEntry;
+
+typedef struct {
+	domainEntry *entries;
+	uint32_t capacity; // Power of two
+	uint32_t count;
+	// Bloom filter, built by domainlists_finish()
+	uint64_t *bloom;
+	uint32_t bloom_blocks;
+} domainTable;
+
+struct domainLists {
+	// Sorted group IDs
+	int *groups;
+	unsigned int num_groups;
+	// Number of 64 bit words of a group mask
+	unsigned int mask_words;
+	// Distinct group masks and a hash table of them (index + 1, 0 = empty)
+	uint64_t *masks;
+	uint32_t num_masks;
+	uint32_t masks_capacity;
+	uint32_t *mask_index;
+	uint32_t mask_index_capacity;
+	// Scratch space for building a new mask
+	uint64_t *scratch;
+	// Domain strings
+	char *strings;
+	size_t strings_len;
+	size_t strings_capacity;
+	domainTable table[DOMAINLISTS_NUM];
+	// Mapped image, all pointers above point into it (read-only)
+	void *image;
+	size_t image_size;
+};
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_groups;
+	uint32_t mask_words;
+	uint32_t num_masks;
+	uint64_t strings_len;
+	uint64_t size;
+	// Database file the image was built from
+	uint64_t db_dev;
+	uint64_t db_ino;
+	uint64_t db_size;
+	int64_t db_mtime_sec;
+	int64_t db_mtime_nsec;
+	struct {
+		uint32_t capacity;
+		uint32_t count;
+		uint32_t bloom_blocks;
+		uint32_t unused;
+	} table[DOMAINLISTS_NUM];
+} imageHeader;
+
+// Offsets of the sections of an image
+typedef struct {
+	size_t groups;
+	size_t masks;
+	size_t entries[DOMAINLISTS_NUM];
+	size_t bloom[DOMAINLISTS_NUM];
+	size_t strings;
+	size_t size;
+} imageLayout;
+
+domainLists *new_domainlists(const int *groups, const unsigned int num_groups)
+{
+	domainLists *lists = calloc(1, sizeof(domainLists));
+	if(lists == NULL)
+		return NULL;
+
+	// Always have at least one word so masks are never empty
+	lists->num_groups = num_groups;
+	lists->mask_words = num_groups / 64u + 1u;
+	lists->groups = calloc(num_groups + 1u, sizeof(int));
+	lists->scratch = calloc(lists->mask_words, sizeof(uint64_t));
+
+	// Offset 0 marks empty slots, start with a dummy string
+	lists->strings_capacity = 4096u;
+	lists->strings = calloc(lists->strings_capacity, sizeof(char));
+	lists->strings_len = 1u;
+
+	if(lists->groups == NULL || lists->scratch == NULL || lists->strings == NULL)
+	{
+		free_domainlists(lists);
+		return NULL;
+	}
+
+	memcpy(lists->groups, groups, num_groups * sizeof(int));
+	return lists;
+}
+
+void free_domainlists(domainLists *lists)
+{
+	if(lists == NULL)
+		return;
+
+	if(lists->image != NULL)
+	{
+		munmap(lists->image, lists->image_size);
+		free(lists);
+		return;
+	}
+
+	for(unsigned int i = 0; i < DOMAINLISTS_NUM; i++)
+	{
+		if(lists->table[i].entries != NULL)
+			free(lists->table[i].entries);
+		if(lists->table[i].bloom != NULL)
+			free(lists->table[i].bloom);
+	}
+	if(lists->groups != NULL)
+		free(lists->groups);
+	if(lists->masks != NULL)
+		free(lists->masks);
+	if(lists->mask_index != NULL)
+		free(lists->mask_index);
+	if(lists->scratch != NULL)
+		free(lists->scratch);
+	if(lists->strings != NULL)
+		free(lists->strings);
+	free(lists);
+}
+
+// Get the bit of a group, -1 if the group is unknown
+static int __attribute__((pure)) group_bit(const domainLists *lists, const int group)
+{
+	int lo = 0, hi = (int)lists->num_groups - 1;
+	while(lo <= hi)
+	{
+		const int mid = lo + (hi - lo) / 2;
+		if(lists->groups[mid] == group)
+			return mid;
+		else if(lists->groups[mid] < group)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return -1;
+}
+
+static inline uint64_t *get_mask(const domainLists *lists, const uint32_t mask)
+{
+	return &lists->masks[(size_t)mask * lists->mask_words];
+}
+
+static bool resize_mask_index(domainLists *lists)
+{
+	const uint32_t capacity = lists->mask_index_capacity > 0 ? 2u * lists->mask_index_capacity : 64u;
+	uint32_t *index = calloc(capacity, sizeof(uint32_t));
+	if(index == NULL)
+		return false;
+
+	const size_t size = lists->mask_words * sizeof(uint64_t);
+	for(uint32_t mask = 0; mask < lists->num_masks; mask++)
+	{
+		uint32_t i = hashData(get_mask(lists, mask), size) & (capacity - 1);
+		while(index[i] != 0)
+			i = (i + 1) & (capacity - 1);
+		index[i] = mask + 1;
+	}
+
+	if(lists->mask_index != NULL)
+		free(lists->mask_index);
+	lists->mask_index = index;
+	lists->mask_index_capacity = capacity;
+	return true;
+}
+
+// Get the index of the mask in scratch, add it if it is not known so far.
+// Returns -1 if memory is exhausted
+static int64_t find_mask(domainLists *lists)
+{
+	const size_t size = lists->mask_words * sizeof(uint64_t);
+	if(2u * (lists->num_masks + 1u) > lists->mask_index_capacity && !resize_mask_index(lists))
+		return -1;
+
+	const uint32_t capacity = lists->mask_index_capacity;
+	uint32_t i = hashData(lists->scratch, size) & (capacity - 1);
+	while(lists->mask_index[i] != 0)
+	{
+		const uint32_t mask = lists->mask_index[i] - 1;
+		if(memcmp(get_mask(lists, mask), lists->scratch, size) == 0)
+			return mask;
+		i = (i + 1) & (capacity - 1);
+	}
+
+	// New mask
+	if(lists->num_masks == lists->masks_capacity)
+	{
+		const uint32_t masks_capacity = lists->masks_capacity > 0 ? 2u * lists->masks_capacity : 16u;
+		uint64_t *masks = realloc(lists->masks, masks_capacity * size);
+		if(masks == NULL)
+			return -1;
+		lists->masks = masks;
+		lists->masks_capacity = masks_capacity;
+	}
+	const uint32_t mask = lists->num_masks++;
+	memcpy(get_mask(lists, mask), lists->scratch, size);
+	lists->mask_index[i] = mask + 1;
+
+	return mask;
+}
+
+static bool resize_table(domainTable *table)
+{
+	const uint32_t capacity = table->capacity > 0 ? 2u * table->capacity : DOMAINLISTS_INITIAL;
+	domainEntry *entries = calloc(capacity, sizeof(domainEntry));
+	if(entries == NULL)
+		return false;
+
+	// Move entries using their stored hashes
+	for(uint32_t j = 0; j < table->capacity; j++)
+	{
+		const domainEntry *entry = &table->entries[j];
+		if(entry->domain == 0)
+			continue;
+
+		uint32_t i = entry->hash & (capacity - 1);
+		while(entries[i].domain != 0)
+			i = (i + 1) & (capacity - 1);
+		entries[i] = *entry;
+	}
+
+	if(table->entries != NULL)
+		free(table->entries);
+	table->entries = entries;
+	table->capacity = capacity;
+	return true;
+}
+
+// Find the slot of a domain. Returns an empty slot if the domain is not in
+// the table
+static domainEntry * __attribute__((pure)) find_entry(const domainLists *lists, const domainTable *table,
+                                                      const char *domain, const uint32_t hash)
+{
+	uint32_t i = hash & (table->capacity - 1);
+	while(table->entries[i].domain != 0)
+	{
+		const domainEntry *entry = &table->entries[i];
+		if(entry->hash == hash && strcmp(lists->strings + entry->domain, domain) == 0)
+			break;
+		i = (i + 1) & (table->capacity - 1);
+	}
+	return &table->entries[i];
+}
+
+static int64_t add_string(domainLists *lists, const char *domain)
+{
+	const size_t len = strlen(domain) + 1u;
+	if(lists->strings_len + len > UINT32_MAX)
+		return -1;
+
+	if(lists->strings_len + len > lists->strings_capacity)
+	{
+		size_t capacity = 2u * lists->strings_capacity;
+		while(lists->strings_len + len > capacity)
+			capacity *= 2u;
+		char *strings = realloc(lists->strings, capacity);
+		if(strings == NULL)
+			return -1;
+		lists->strings = strings;
+		lists->strings_capacity = capacity;
+	}
+
+	const size_t offset = lists->strings_len;
+	memcpy(lists->strings + offset, domain, len);
+	lists->strings_len += len;
+	return offset;
+}
+
+// Add a domain to a list for a group. Domains of unknown groups are ignored.
+// Mapped lists are read-only. Returns false if memory is exhausted
+bool domainlists_add(domainLists *lists, const unsigned int list, const char *domain, const int group)
+{
+	if(list >= DOMAINLISTS_NUM || domain == NULL)
+		return true;
+
+	if(lists->image != NULL)
+		return false;
+
+	const int bit = group_bit(lists, group);
+	if(bit < 0)
+		return true;
+
+	domainTable *table = &lists->table[list];
+	if(4u * (table->count + 1u) > 3u * table->capacity && !resize_table(table))
+		return false;
+
+	const uint32_t hash = hashStr(domain);
+	domainEntry *entry = find_entry(lists, table, domain, hash);
+
+	// Build the new group mask of this domain
+	if(entry->domain != 0)
+	{
+		memcpy(lists->scratch, get_mask(lists, entry->mask), lists->mask_words * sizeof(uint64_t));
+
+		// Nothing to do if the domain is already enabled for this group
+		// (e.g. it is on several adlists)
+		if(lists->scratch[bit / 64] & (1ull << (bit % 64)))
+			return true;
+	}
+	else
+		memset(lists->scratch, 0, lists->mask_words * sizeof(uint64_t));
+	lists->scratch[bit / 64] |= 1ull << (bit % 64);
+
+	const int64_t mask = find_mask(lists);
+	if(mask < 0)
+		return false;
+
+	if(entry->domain == 0)
+	{
+		const int64_t offset = add_string(lists, domain);
+		if(offset < 0)
+			return false;
+		entry->hash = hash;
+		entry->domain = offset;
+		table->count++;
+	}
+	entry->mask = mask;
+
+	return true;
+}
+
+// Mix the bits of a hash (splitmix64 finalizer)
+static inline uint64_t __attribute__((const)) mix64(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ull;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebull;
+	x ^= x >> 31;
+	return x;
+}
+
+// Get the block of the Bloom filter of a domain. The bits within the block are
+// taken from the remaining bits of the mixed hash
+static inline uint64_t *bloom_block(const domainTable *table, const uint32_t hash, uint64_t *bits)
+{
+	const uint64_t h = mix64(hash);
+	*bits = mix64(h);
+	const uint32_t block = ((h >> 32) * table->bloom_blocks) >> 32;
+	return &table->bloom[(size_t)block * BLOOM_BLOCK_WORDS];
+}
+
+static void bloom_add(domainTable *table, const uint32_t hash)
+{
+	uint64_t bits;
+	uint64_t *block = bloom_block(table, hash, &bits);
+	for(unsigned int i = 0; i < BLOOM_HASHES; i++, bits >>= 9)
+		block[(bits >> 6) & (BLOOM_BLOCK_WORDS - 1)] |= 1ull << (bits & 63);
+}
+
+static bool __attribute__((pure)) bloom_contains(const domainTable *table, const uint32_t hash)
+{
+	// Tables without filter (e.g. out of memory) are always probed
+	if(table->bloom == NULL)
+		return true;
+
+	uint64_t bits;
+	const uint64_t *block = bloom_block(table, hash, &bits);
+	for(unsigned int i = 0; i < BLOOM_HASHES; i++, bits >>= 9)
+		if(!(block[(bits >> 6) & (BLOOM_BLOCK_WORDS - 1)] & (1ull << (bits & 63))))
+			return false;
+	return true;
+}
+
+// Build the Bloom filters after all domains have been added. Returns the size
+// of the filters in bytes
+size_t domainlists_finish(domainLists *lists)
+{
+	size_t size = 0u;
+	for(unsigned int i = 0; i < DOMAINLISTS_NUM; i++)
+	{
+		domainTable *table = &lists->table[i];
+		if(table->bloom != NULL)
+			free(table->bloom);
+		table->bloom = NULL;
+		if(table->count == 0)
+			continue;
+
+		const uint64_t bits = (uint64_t)table->count * BLOOM_BITS_PER_DOMAIN;
+		table->bloom_blocks = (bits + 64u*BLOOM_BLOCK_WORDS - 1u) / (64u*BLOOM_BLOCK_WORDS);
+		table->bloom = aligned_alloc(64u, table->bloom_blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t));
+		if(table->bloom == NULL)
+		{
+			logg("WARN: Cannot allocate prefilter for list %u", i);
+			continue;
+		}
+		memset(table->bloom, 0, table->bloom_blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t));
+		size += table->bloom_blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t);
+
+		for(uint32_t j = 0; j < table->capacity; j++)
+			if(table->entries[j].domain != 0)
+				bloom_add(table, table->entries[j].hash);
+	}
+
+	return size;
+}
+
+static inline size_t __attribute__((const)) image_align(const size_t offset)
+{
+	return (offset + IMAGE_ALIGN - 1u) & ~(size_t)(IMAGE_ALIGN - 1u);
+}
+
+// Place a section of num elements of the given size at offset. Returns false
+// if it does not end before limit
+static bool image_section(size_t *offset, size_t *section, const uint64_t num, const size_t size,
+                          const size_t limit)
+{
+	*section = *offset;
+	if(*offset > limit || num > (limit - *offset) / size)
+		return false;
+	*offset = image_align(*offset + num * size);
+	return true;
+}
+
+// Compute the offsets of the sections of an image. Returns false if the image
+// would not fit into limit bytes
+static bool image_layout(const imageHeader *header, imageLayout *layout, const size_t limit)
+{
+	size_t offset = image_align(sizeof(imageHeader));
+	if(!image_section(&offset, &layout->groups, header->num_groups, sizeof(int), limit) ||
+	   !image_section(&offset, &layout->masks, (uint64_t)header->num_masks * header->mask_words,
+	                  sizeof(uint64_t), limit))
+		return false;
+	for(unsigned int i = 0; i < DOMAINLISTS_NUM; i++)
+		if(!image_section(&offset, &layout->entries[i], header->table[i].capacity, sizeof(domainEntry), limit))
+			return false;
+	for(unsigned int i = 0; i < DOMAINLISTS_NUM; i++)
+		if(!image_section(&offset, &layout->bloom[i], (uint64_t)header->table[i].bloom_blocks * BLOOM_BLOCK_WORDS,
+		                  sizeof(uint64_t), limit))
+			return false;
+
+	if(offset > limit || header->strings_len > limit - offset)
+		return false;
+	layout->strings = offset;
+	layout->size = offset + header->strings_len;
+	return true;
+}
+
+// Check the content of a mapped image before it is used. Lookups rely on
+// tables whose capacity is a power of two with at least one empty slot, on
+// string offsets and mask indices within the image and on terminated strings
+static bool __attribute__((pure)) valid_image(const domainLists *lists)
+{
+	if(lists->mask_words != lists->num_groups / 64u + 1u ||
+	   lists->strings_len == 0u || lists->strings[lists->strings_len - 1u] != '\0')
+		return false;
+
+	for(unsigned int i = 0; i < DOMAINLISTS_NUM; i++)
+	{
+		const domainTable *table = &lists->table[i];
+		if(table->capacity == 0u)
+		{
+			// Empty list, lookups return before probing the table
+			if(table->count != 0u)
+				return false;
+			continue;
+		}
+		if((table->capacity & (table->capacity - 1u)) != 0u)
+			return false;
+
+		uint32_t used = 0u;
+		for(uint32_t j = 0; j < table->capacity; j++)
+		{
+			const domainEntry *entry = &table->entries[j];
+			if(entry->domain == 0u)
+				continue;
+			if(entry->domain >= lists->strings_len || entry->mask >= lists->num_masks)
+				return false;
+			used++;
+		}
+		if(used != table->count || used == table->capacity)
+			return false;
+	}
+
+	return true;
+}
+
+static bool write_at(const int fd, const void *data, const size_t len, const size_t offset)
+{
+	size_t done = 0u;
+	while(done < len)
+	{
+		const ssize_t ret = pwrite(fd, (const char*)data + done, len - done, offset + done);
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret <= 0)
+			return false;
+		done += ret;
+	}
+	return true;
+}
+
+// Write the lists into an image file. The image is written into a temporary
+// file first and moved into place afterwards so that it is replaced atomically
+bool domainlists_save(const domainLists *lists, const char *path, const struct stat *db)
+{
+	if(lists == NULL || lists->image != NULL)
+		return false;
+
+	imageHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+	header.version = IMAGE_VERSION;
+	header.num_groups = lists->num_groups;
+	header.mask_words = lists->mask_words;
+	header.num_masks = lists->num_masks;
+	header.strings_len = lists->strings_len;
+	header.db_dev = db->st_dev;
+	header.db_ino = db->st_ino;
+	header.db_size = db->st_size;
+	header.db_mtime_sec = db->st_mtim.tv_sec;
+	header.db_mtime_nsec = db->st_mtim.tv_nsec;
+	for(unsigned int i = 0; i < DOMAINLISTS_NUM; i++)
+	{
+		header.table[i].capacity = lists->table[i].capacity;
+		header.table[i].count = lists->table[i].count;
+		header.table[i].bloom_blocks = lists->table[i].bloom != NULL ? lists->table[i].bloom_blocks : 0u;
+	}
+
+	imageLayout layout;
+	if(!image_layout(&header, &layout, SIZE_MAX - IMAGE_ALIGN))
+		return false;
+	header.size = layout.size;
+
+	char *tmp = NULL;
+	if(asprintf(&tmp, "%s.tmp", path) < 1)
+		return false;
+
+	// The file is extended to its final size first, the gaps between the
+	// sections are filled with zeros
+	const int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	bool okay = fd > -1 && ftruncate(fd, layout.size) == 0;
+	okay = okay && write_at(fd, &header, sizeof(header), 0u);
+	okay = okay && write_at(fd, lists->groups, lists->num_groups * sizeof(int), layout.groups);
+	okay = okay && write_at(fd, lists->masks, (size_t)lists->num_masks * lists->mask_words * sizeof(uint64_t), layout.masks);
+	for(unsigned int i = 0; okay && i < DOMAINLISTS_NUM; i++)
+	{
+		const domainTable *table = &lists->table[i];
+		okay = write_at(fd, table->entries, header.table[i].capacity * sizeof(domainEntry), layout.entries[i]) &&
+		       write_at(fd, table->bloom, (size_t)header.table[i].bloom_blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t), layout.bloom[i]);
+	}
+	okay = okay && write_at(fd, lists->strings, lists->strings_len, layout.strings);
+	// Make sure the content is on disk before the image is replaced
+	okay = okay && fsync(fd) == 0;
+	if(fd > -1)
+		close(fd);
+	okay = okay && rename(tmp, path) == 0;
+
+	if(!okay)
+	{
+		logg("WARN: Cannot write lists image %s: %s", path, strerror(errno));
+		unlink(tmp);
+	}
+	free(tmp);
+
+	return okay;
+}
+
+// Map an image file. Returns NULL if there is no valid image for the given
+// database file
+domainLists *domainlists_map(const char *path, const struct stat *db)
+{
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+	{
+		if(errno != ENOENT)
+			logg("WARN: Cannot open lists image %s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(imageHeader))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	void *image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(image == MAP_FAILED)
+	{
+		logg("WARN: Cannot map lists image %s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	// Images of other versions or of another database are silently ignored,
+	// they will be replaced by a new image
+	const imageHeader *header = image;
+	if(memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0 ||
+	   header->version != IMAGE_VERSION ||
+	   header->db_dev != (uint64_t)db->st_dev ||
+	   header->db_ino != (uint64_t)db->st_ino ||
+	   header->db_size != (uint64_t)db->st_size ||
+	   header->db_mtime_sec != db->st_mtim.tv_sec ||
+	   header->db_mtime_nsec != db->st_mtim.tv_nsec)
+	{
+		munmap(image, st.st_size);
+		return NULL;
+	}
+
+	// The sections have to fill the (possibly truncated) file exactly
+	imageLayout layout;
+	if(!image_layout(header, &layout, st.st_size) ||
+	   header->size != (uint64_t)st.st_size ||
+	   layout.size != (size_t)st.st_size)
+	{
+		logg("WARN: Lists image %s is truncated or corrupt, ignoring it", path);
+		munmap(image, st.st_size);
+		return NULL;
+	}
+
+	domainLists *lists = calloc(1, sizeof(domainLists));
+	if(lists == NULL)
+	{
+		munmap(image, st.st_size);
+		return NULL;
+	}
+
+	char *base = image;
+	lists->image = image;
+	lists->image_size = st.st_size;
+	lists->num_groups = header->num_groups;
+	lists->mask_words = header->mask_words;
+	lists->num_masks = header->num_masks;
+	lists->groups = (int*)(void*)(base + layout.groups);
+	lists->masks = (uint64_t*)(void*)(base + layout.masks);
+	lists->strings = base + layout.strings;
+	lists->strings_len = header->strings_len;
+	for(unsigned int i = 0; i < DOMAINLISTS_NUM; i++)
+	{
+		domainTable *table = &lists->table[i];
+		table->capacity = header->table[i].capacity;
+		table->count = header->table[i].count;
+		table->entries = (domainEntry*)(void*)(base + layout.entries[i]);
+		table->bloom_blocks = header->table[i].bloom_blocks;
+		table->bloom = table->bloom_blocks > 0 ? (uint64_t*)(void*)(base + layout.bloom[i]) : NULL;
+	}
+
+	if(!valid_image(lists))
+	{
+		logg("WARN: Lists image %s is corrupt, ignoring it", path);
+		free_domainlists(lists);
+		return NULL;
+	}
+
+	// Lookups are spread over the entire image, read it in now instead of
+	// faulting in single pages while answering queries
+	madvise(image, st.st_size, MADV_WILLNEED);
+
+	return lists;
+}
+
+unsigned int __attribute__((pure)) domainlists_count(const domainLists *lists, const unsigned int list)
+{
+	if(lists == NULL || list >= DOMAINLISTS_NUM)
+		return 0u;
+
+	return lists->table[list].count;
+}
+
+// Convert a comma-separated list of group IDs (as stored for every client) into
+// a group mask which can be passed to domainlists_contains()
+uint64_t * __attribute__((malloc)) domainlists_group_mask(const domainLists *lists, const char *groupids)
+{
+	if(lists == NULL || groupids == NULL)
+		return NULL;
+
+	uint64_t *mask = calloc(lists->mask_words, sizeof(uint64_t));
+	if(mask == NULL)
+		return NULL;
+
+	const char *p = groupids;
+	while(*p != '\0')
+	{
+		char *end = NULL;
+		const long group = strtol(p, &end, 10);
+		if(end == p)
+		{
+			// Skip unexpected character
+			p++;
+			continue;
+		}
+
+		const int bit = group_bit(lists, (int)group);
+		if(bit >= 0)
+			mask[bit / 64] |= 1ull << (bit % 64);
+		p = end;
+	}
+
+	return mask;
+}
+
+// Check if a domain is on a list for any of the given groups
+bool __attribute__((pure)) domainlists_contains(const domainLists *lists, const unsigned int list,
+                                                const char *domain, const uint64_t *groups)
+{
+	if(lists == NULL || groups == NULL || list >= DOMAINLISTS_NUM)
+		return false;
+
+	const domainTable *table = &lists->table[list];
+	if(table->count == 0)
+		return false;
+
+	// Most domains are not on the list, the prefilter tells us this
+	// without probing the table
+	const uint32_t hash = hashStr(domain);
+	if(!bloom_contains(table, hash))
+		return false;
+
+	const domainEntry *entry = find_entry(lists, table, domain, hash);
+	if(entry->domain == 0)
+		return false;
+
+	const uint64_t *mask = get_mask(lists, entry->mask);
+	for(unsigned int i = 0; i < lists->mask_words; i++)
+		if(mask[i] & groups[i])
+			return true;
+
+	return false;
+}
@@ -0,0 +1,37 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  In-memory domain lists prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef DOMAINLISTS_H
+#define DOMAINLISTS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+// size_t
+#include <stddef.h>
+// struct stat
+#include <sys/stat.h>
+
+// Number of lists held in memory (gravity, exact blacklist, exact whitelist).
+// They are indexed by the corresponding enum gravity_tables values
+#define DOMAINLISTS_NUM 3
+
+typedef struct domainLists domainLists;
+
+domainLists *new_domainlists(const int *groups, const unsigned int num_groups);
+void free_domainlists(domainLists *lists);
+bool domainlists_add(domainLists *lists, const unsigned int list, const char *domain, const int group);
+size_t domainlists_finish(domainLists *lists);
+bool domainlists_save(const domainLists *lists, const char *path, const struct stat *db);
+domainLists *domainlists_map(const char *path, const struct stat *db);
+unsigned int domainlists_count(const domainLists *lists, const unsigned int list) __attribute__((pure));
+uint64_t *domainlists_group_mask(const domainLists *lists, const char *groupids) __attribute__((malloc));
+bool domainlists_contains(const domainLists *lists, const unsigned int list, const char *domain,
+                          const uint64_t *groups) __attribute__((pure));
+
+#endif //DOMAINLISTS_H
@@ -19,8 +19,10 @@
 #include "../regex_r.h"
 // getstr()
 #include "../shmem.h"
-// SQLite3 prepared statement vectors
-#include "../vector.h"
+// new_domainlists()
+#include "domain-lists.h"
+// timer_start()
+#include "../timers.h"
 // log_subnet_warning()
 #include "message-table.h"
 // getMACfromIP()
@@ -36,18 +38,32 @@
 // Prefix of interface names in the client table
 #define INTERFACE_SEP ":"
 
-// Process-private prepared statements are used to support multiple forks (might
-// be TCP workers) to use the database simultaneously without corrupting the
-// gravity database
-sqlite3_stmt_vec *whitelist_stmt = NULL;
-sqlite3_stmt_vec *gravity_stmt = NULL;
-sqlite3_stmt_vec *blacklist_stmt = NULL;
+// In-memory copy of the exact domain lists (gravity, exact black- and
+// whitelist). It is built from the database on every reload and mapped from
+// the lists image shared with all forks
+static domainLists *domainlists = NULL;
 
 // Private variables
 static sqlite3 *gravity_db = NULL;
 static sqlite3_stmt* table_stmt = NULL;
 static sqlite3_stmt* auditlist_stmt = NULL;
 bool gravityDB_opened = false;
+// Forks do not need the database connection for most queries, it is opened
+// on first use
+static bool open_on_demand = false;
+
+// The list lookups of the DNS path run without holding the shared memory lock.
+// This process-private lock protects the in-memory lists and compiled regex
+// they use against being replaced concurrently by another thread of this
+// process (e.g. when the lists are reloaded by the database thread). The
+// generation counter is increased by every writer so that lookup results
+// obtained with an outdated snapshot of the lists can be detected
+static pthread_rwlock_t lists_lock = PTHREAD_RWLOCK_INITIALIZER;
+static unsigned int lists_generation = 0u;
+
+// The audit list statement is also used by API threads holding only the read
+// lock (see getTopDomains()), they must not step it concurrently
+static pthread_mutex_t auditlist_lock = PTHREAD_MUTEX_INITIALIZER;
 
 // Table names corresponding to the enum defined in gravity-db.h
 static const char* tablename[] = { "vw_gravity", "vw_blacklist", "vw_whitelist", "vw_regex_blacklist", "vw_regex_whitelist" , "" };
@@ -59,13 +75,35 @@ void rehash(int size);
 void gravityDB_forked(void)
 {
 	// Pretend that we did not open the database so far so it needs to be
-	// re-opened, also pretend we have not yet prepared the list statements
+	// re-opened
 	gravityDB_opened = false;
 	gravity_db = NULL;
-	whitelist_stmt = NULL;
-	blacklist_stmt = NULL;
-	gravity_stmt = NULL;
-	gravityDB_open();
+
+	// The lock may have been held by another thread of the parent at the
+	// time of forking. This thread does not exist in the fork
+	pthread_rwlock_init(&lists_lock, NULL);
+	pthread_mutex_init(&auditlist_lock, NULL);
+
+	// The exact lists are inherited (and shared through the lists image),
+	// the database is only needed for the audit list and group lookups
+	auditlist_stmt = NULL;
+	open_on_demand = true;
+}
+
+void lock_lists_read(void)
+{
+	pthread_rwlock_rdlock(&lists_lock);
+}
+
+void lock_lists_write(void)
+{
+	pthread_rwlock_wrlock(&lists_lock);
+	lists_generation++;
+}
+
+void unlock_lists(void)
+{
+	pthread_rwlock_unlock(&lists_lock);
 }
 
 void gravityDB_reopen(void)
@@ -157,14 +195,6 @@ bool gravityDB_open(void)
 		logg("gravityDB_open(): Setting busy timeout to %d", DATABASE_BUSY_TIMEOUT);
 	sqlite3_busy_timeout(gravity_db, DATABASE_BUSY_TIMEOUT);
 
-	// Prepare private vector of statements for this process (might be a TCP fork!)
-	if(whitelist_stmt == NULL)
-		whitelist_stmt = new_sqlite3_stmt_vec(counters->clients);
-	if(blacklist_stmt == NULL)
-		blacklist_stmt = new_sqlite3_stmt_vec(counters->clients);
-	if(gravity_stmt == NULL)
-		gravity_stmt = new_sqlite3_stmt_vec(counters->clients);
-
 	// Explicitly set busy handler to zero milliseconds
 	if(config.debug & DEBUG_DATABASE)
 		logg("gravityDB_open(): Setting busy timeout to zero");
@@ -179,22 +209,6 @@ bool gravityDB_open(void)
 	return true;
 }
 
-static char* get_client_querystr(const char* table, const char* groups)
-{
-	// Build query string with group filtering
-	char *querystr = NULL;
-	if(asprintf(&querystr, "SELECT EXISTS(SELECT domain from %s WHERE domain = ? AND group_id IN (%s));", table, groups) < 1)
-	{
-		logg("get_client_querystr(%s, %s) - asprintf() error", table, groups);
-		return NULL;
-	}
-
-	if(config.debug & DEBUG_DATABASE)
-		logg("get_client_querystr: %s", querystr);
-
-	return querystr;
-}
-
 // Determine whether to show IP or hardware address
 static inline const char *show_client_string(const char *hwaddr, const char *hostname,
                                              const char *ip)
@@ -220,6 +234,7 @@ static bool get_client_groupids(clientsData* client)
 {
 	const char *ip = getstr(client->ippos);
 	client->flags.found_group = false;
+	freestr(client->groupspos);
 	client->groupspos = 0u;
 
 	// Do not proceed when database is not available
@@ -791,107 +806,6 @@ char* __attribute__ ((malloc)) get_client_names_from_ids(const char *group_ids)
 	return result;
 }
 
-// Prepare statements for scanning white- and blacklist as well as gravit for one client
-bool gravityDB_prepare_client_statements(clientsData *client)
-{
-	// Return early if gravity database is not available
-	if(!gravityDB_opened && !gravityDB_open())
-		return false;
-
-	const char *clientip = getstr(client->ippos);
-
-	if(config.debug & DEBUG_DATABASE)
-		logg("Initializing gravity statements for %s", clientip);
-
-	// Get associated groups for this client (if defined)
-	char *querystr = NULL;
-	if(!client->flags.found_group && !get_client_groupids(client))
-		return false;
-
-	// Prepare whitelist statement
-	// We use SELECT EXISTS() as this is known to efficiently use the index
-	// We are only interested in whether the domain exists or not in the
-	// list but don't case about duplicates or similar. SELECT EXISTS(...)
-	// returns true as soon as it sees the first row from the query inside
-	// of EXISTS().
-	if(config.debug & DEBUG_DATABASE)
-		logg("gravityDB_open(): Preparing vw_whitelist statement for client %s", clientip);
-	querystr = get_client_querystr("vw_whitelist", getstr(client->groupspos));
-	sqlite3_stmt* stmt = NULL;
-	int rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &stmt, NULL);
-	if( rc != SQLITE_OK )
-	{
-		logg("gravityDB_open(\"SELECT EXISTS(... vw_whitelist ...)\") - SQL error prepare: %s", sqlite3_errstr(rc));
-		gravityDB_close();
-		return false;
-	}
-	whitelist_stmt->set(whitelist_stmt, client->id, stmt);
-	free(querystr);
-
-	// Prepare gravity statement
-	if(config.debug & DEBUG_DATABASE)
-		logg("gravityDB_open(): Preparing vw_gravity statement for client %s", clientip);
-	querystr = get_client_querystr("vw_gravity", getstr(client->groupspos));
-	rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &stmt, NULL);
-	if( rc != SQLITE_OK )
-	{
-		logg("gravityDB_open(\"SELECT EXISTS(... vw_gravity ...)\") - SQL error prepare: %s", sqlite3_errstr(rc));
-		gravityDB_close();
-		return false;
-	}
-	gravity_stmt->set(gravity_stmt, client->id, stmt);
-	free(querystr);
-
-	// Prepare blacklist statement
-	if(config.debug & DEBUG_DATABASE)
-		logg("gravityDB_open(): Preparing vw_blacklist statement for client %s", clientip);
-	querystr = get_client_querystr("vw_blacklist", getstr(client->groupspos));
-	rc = sqlite3_prepare_v2(gravity_db, querystr, -1, &stmt, NULL);
-	if( rc != SQLITE_OK )
-	{
-		logg("gravityDB_open(\"SELECT EXISTS(... vw_blacklist ...)\") - SQL error prepare: %s", sqlite3_errstr(rc));
-		gravityDB_close();
-		return false;
-	}
-	blacklist_stmt->set(blacklist_stmt, client->id, stmt);
-	free(querystr);
-
-	return true;
-}
-
-// Finalize non-NULL prepared statements and set them to NULL for a given client
-static inline void gravityDB_finalize_client_statements(clientsData *client)
-{
-	if(config.debug & DEBUG_DATABASE)
-		logg("Finalizing gravity statements for %s", getstr(client->ippos));
-
-	if(whitelist_stmt != NULL &&
-	   whitelist_stmt->get(whitelist_stmt, client->id) != NULL)
-	{
-		sqlite3_finalize(whitelist_stmt->get(whitelist_stmt, client->id));
-		whitelist_stmt->set(whitelist_stmt, client->id, NULL);
-	}
-	if(blacklist_stmt != NULL &&
-	   blacklist_stmt->get(blacklist_stmt, client->id) != NULL)
-	{
-		sqlite3_finalize(blacklist_stmt->get(blacklist_stmt, client->id));
-		blacklist_stmt->set(blacklist_stmt, client->id, NULL);
-	}
-	if(gravity_stmt != NULL &&
-	   gravity_stmt->get(gravity_stmt, client->id) != NULL)
-	{
-		sqlite3_finalize(gravity_stmt->get(gravity_stmt, client->id));
-		gravity_stmt->set(gravity_stmt, client->id, NULL);
-	}
-
-	// Unset group found property to trigger a check next time the
-	// client sends a query
-	if(client != NULL)
-	{
-		client->flags.found_group = false;
-	}
-}
-
 // Close gravity database connection
 void gravityDB_close(void)
 {
@@ -899,21 +813,15 @@ void gravityDB_close(void)
 	if(!gravityDB_opened)
 		return;
 
-	// Finalize prepared list statements for all clients
+	// Unset group found property for all clients to trigger a check next
+	// time they send a query (groups may have changed in the meantime)
 	for(int clientID = 0; clientID < counters->clients; clientID++)
 	{
 		clientsData *client = getClient(clientID, true);
-		gravityDB_finalize_client_statements(client);
+		if(client != NULL)
+			client->flags.found_group = false;
 	}
 
-	// Free allocated memory for vectors of prepared client statements
-	free_sqlite3_stmt_vec(whitelist_stmt);
-	whitelist_stmt = NULL;
-	free_sqlite3_stmt_vec(blacklist_stmt);
-	blacklist_stmt = NULL;
-	free_sqlite3_stmt_vec(gravity_stmt);
-	gravity_stmt = NULL;
-
 	// Finalize audit list statement
 	sqlite3_finalize(auditlist_stmt);
 	auditlist_stmt = NULL;
@@ -1171,9 +1079,8 @@ static bool domain_in_list(const char *domain, sqlite3_stmt* stmt, const char* l
 
 void gravityDB_reload_groups(clientsData* client)
 {
-	// Rebuild client table statements (possibly from a different group set)
-	gravityDB_finalize_client_statements(client);
-	gravityDB_prepare_client_statements(client);
+	// Get associated groups for this client (possibly a different group set)
+	get_client_groupids(client);
 
 	// Reload regex for this client (possibly from a different group set)
 	reload_per_client_regex(client);
@@ -1196,112 +1103,250 @@ static void gravityDB_client_check_again(clientsData* client)
 	}
 }
 
-bool in_whitelist(const char *domain, const DNSCacheData *dns_cache, clientsData* client)
+// Prepare everything needed to check domains against the lists of this client
+// and copy it into a process-private snapshot. This has to be called while
+// holding the shared memory lock. The snapshot can afterwards be used by the
+// in_*() functions below without holding the shared memory lock (but with
+// lock_lists_read() held). Returns false if memory is exhausted
+bool gravityDB_client_snapshot(clientsData *client, listsClient *snapshot)
 {
-	// If list statement is not ready and cannot be initialized (e.g. no
-	// access to the database), we return false to prevent an FTL crash
-	if(whitelist_stmt == NULL)
-		return false;
+	// Check if we need to recompile regex because they were changed in
+	// another fork. If this is the case, reload everything (regex
+	// themselves as well as per-client enabled/disabled state)
+	if(regex_change != counters->regex_change)
+	{
+		logg("Reloading externally changed regular expressions");
+		lock_lists_write();
+		read_regex_from_database();
+		unlock_lists();
+	}
 
 	// Check if this client needs a rechecking of group membership
 	gravityDB_client_check_again(client);
 
-	// Get whitelist statement from vector of prepared statements if available
-	sqlite3_stmt *stmt = whitelist_stmt->get(whitelist_stmt, client->id);
+	// Get associated groups for this client if not done so far. If this
+	// fails (e.g. no access to the database), the client is not member of
+	// any group and no domain is found on the lists
+	if(!client->flags.found_group)
+		get_client_groupids(client);
+
+	snapshot->id = client->id;
+	snapshot->generation = lists_generation;
+	snapshot->regex = copy_per_client_regex(client->id);
+	snapshot->groups = domainlists_group_mask(domainlists, getstr(client->groupspos));
+
+	return snapshot->regex != NULL && (domainlists == NULL || snapshot->groups != NULL);
+}
+
+// Check if the lists have been changed since the snapshot was taken. This has
+// to be called while holding either the shared memory lock or the lists lock
+bool __attribute__((pure)) gravityDB_snapshot_valid(const listsClient *snapshot)
+{
+	return snapshot->generation == lists_generation;
+}
+
+void gravityDB_free_snapshot(listsClient *snapshot)
+{
+	if(snapshot->regex != NULL)
+		free(snapshot->regex);
+	snapshot->regex = NULL;
+	if(snapshot->groups != NULL)
+		free(snapshot->groups);
+	snapshot->groups = NULL;
+}
 
-	// If client statement is not ready and cannot be initialized (e.g. no access to
-	// the database), we return false (not in whitelist) to prevent an FTL crash
-	if(stmt == NULL && !gravityDB_prepare_client_statements(client))
+// Read the domains of one list into memory
+static bool load_list(sqlite3 *db, domainLists *lists, const enum gravity_tables list)
+{
+	char *querystr = NULL;
+	if(asprintf(&querystr, "SELECT domain, group_id FROM %s WHERE group_id IS NOT NULL;", tablename[list]) < 1)
 	{
-		logg("ERROR: Gravity database not available, assuming domain is not whitelisted");
+		logg("load_list(%s) - asprintf() error", tablename[list]);
 		return false;
 	}
 
-	// Update statement if has just been initialized
-	if(stmt == NULL)
+	sqlite3_stmt *stmt = NULL;
+	int rc = sqlite3_prepare_v2(db, querystr, -1, &stmt, NULL);
+	free(querystr);
+	if(rc != SQLITE_OK)
 	{
-		stmt = whitelist_stmt->get(whitelist_stmt, client->id);
+		logg("load_list(%s) - SQL error prepare: %s", tablename[list], sqlite3_errstr(rc));
+		return false;
 	}
 
-	// We have to check both the exact whitelist (using a prepared database statement)
-	// as well the compiled regex whitelist filters to check if the current domain is
-	// whitelisted. Due to short-circuit-evaluation in C, the regex evaluations is executed
-	// only if the exact whitelist lookup does not deliver a positive match. This is an
-	// optimization as the database lookup will most likely hit (a) more domains and (b)
-	// will be faster (given a sufficiently large number of regex whitelisting filters).
-	return domain_in_list(domain, stmt, "whitelist") ||
-	       match_regex(domain, dns_cache, client->id, REGEX_WHITELIST, false) != -1;
-}
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		const char *domain = (const char*)sqlite3_column_text(stmt, 0);
+		const int group = sqlite3_column_int(stmt, 1);
+		if(!domainlists_add(lists, list, domain, group))
+		{
+			logg("load_list(%s) - Memory allocation failed", tablename[list]);
+			sqlite3_finalize(stmt);
+			return false;
+		}
+	}
+	sqlite3_finalize(stmt);
 
-bool in_gravity(const char *domain, clientsData* client)
-{
-	// If list statement is not ready and cannot be initialized (e.g. no
-	// access to the database), we return false to prevent an FTL crash
-	if(gravity_stmt == NULL)
+	if(rc != SQLITE_DONE)
+	{
+		logg("load_list(%s) - SQL error step: %s", tablename[list], sqlite3_errstr(rc));
 		return false;
+	}
 
-	// Check if this client needs a rechecking of group membership
-	gravityDB_client_check_again(client);
+	return true;
+}
 
-	// Get whitelist statement from vector of prepared statements
-	sqlite3_stmt *stmt = gravity_stmt->get(gravity_stmt, client->id);
+// Read gravity, exact blacklist and exact whitelist into memory. The lists
+// image is used if it was built from the current database. Otherwise, the
+// lists are read from the database (this uses its own database connection and
+// can take a while for large lists) and a new image is written. This does not
+// need any locks. Returns NULL on error
+domainLists *gravityDB_load_lists(void)
+{
+	timer_start(LISTS_TIMER);
 
-	// If client statement is not ready and cannot be initialized (e.g. no access to
-	// the database), we return false (not in gravity list) to prevent an FTL crash
-	if(stmt == NULL && !gravityDB_prepare_client_statements(client))
+	// Get the database file the lists are built from before reading it. A
+	// modification while we read it will let the next reload read it again
+	struct stat db_stat;
+	if(stat(FTLfiles.gravity_db, &db_stat) != 0)
 	{
-		logg("ERROR: Gravity database not available, assuming domain is not gravity blocked");
-		return false;
+		logg("gravityDB_load_lists(): Cannot stat %s: %s", FTLfiles.gravity_db, strerror(errno));
+		return NULL;
 	}
 
-	// Update statement if has just been initialized
-	if(stmt == NULL)
+	domainLists *lists = domainlists_map(FTLfiles.gravity_image, &db_stat);
+	if(lists != NULL)
 	{
-		stmt = gravity_stmt->get(gravity_stmt, client->id);
+		logg("Mapped %u gravity, %u blacklist and %u whitelist domains from %s in %.3f msec",
+		     domainlists_count(lists, GRAVITY_TABLE),
+		     domainlists_count(lists, EXACT_BLACKLIST_TABLE),
+		     domainlists_count(lists, EXACT_WHITELIST_TABLE),
+		     FTLfiles.gravity_image, timer_elapsed_msec(LISTS_TIMER));
+		return lists;
 	}
 
-	return domain_in_list(domain, stmt, "gravity");
-}
-
-inline bool in_blacklist(const char *domain, clientsData* client)
-{
-	// If list statement is not ready and cannot be initialized (e.g. no
-	// access to the database), we return false to prevent an FTL crash
-	if(blacklist_stmt == NULL)
-		return false;
+	sqlite3 *db = NULL;
+	int rc = sqlite3_open_v2(FTLfiles.gravity_db, &db, SQLITE_OPEN_READONLY, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("gravityDB_load_lists() - SQL error: %s", sqlite3_errstr(rc));
+		sqlite3_close(db);
+		return NULL;
+	}
+	sqlite3_busy_timeout(db, DATABASE_BUSY_TIMEOUT);
 
-	// Check if this client needs a rechecking of group membership
-	gravityDB_client_check_again(client);
+	// Get all group IDs, their position in this array is their bit in the
+	// group masks of the domains
+	int *groups = NULL;
+	unsigned int num_groups = 0u;
+	sqlite3_stmt *stmt = NULL;
+	rc = sqlite3_prepare_v2(db, "SELECT id FROM \"group\" ORDER BY id;", -1, &stmt, NULL);
+	if(rc != SQLITE_OK)
+	{
+		logg("gravityDB_load_lists(\"SELECT id FROM group\") - SQL error prepare: %s", sqlite3_errstr(rc));
+		sqlite3_close(db);
+		return NULL;
+	}
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		int *new_groups = realloc(groups, (num_groups + 1u) * sizeof(int));
+		if(new_groups == NULL)
+			break;
+		groups = new_groups;
+		groups[num_groups++] = sqlite3_column_int(stmt, 0);
+	}
+	sqlite3_finalize(stmt);
 
-	// Get whitelist statement from vector of prepared statements
-	sqlite3_stmt *stmt = blacklist_stmt->get(blacklist_stmt, client->id);
+	if(rc == SQLITE_DONE)
+		lists = new_domainlists(groups, num_groups);
+	else
+		logg("gravityDB_load_lists(\"SELECT id FROM group\") - SQL error step: %s", sqlite3_errstr(rc));
+	if(groups != NULL)
+		free(groups);
 
-	// If client statement is not ready and cannot be initialized (e.g. no access to
-	// the database), we return false (not in blacklist) to prevent an FTL crash
-	if(stmt == NULL && !gravityDB_prepare_client_statements(client))
+	if(lists != NULL &&
+	   (!load_list(db, lists, GRAVITY_TABLE) ||
+	    !load_list(db, lists, EXACT_BLACKLIST_TABLE) ||
+	    !load_list(db, lists, EXACT_WHITELIST_TABLE)))
 	{
-		logg("ERROR: Gravity database not available, assuming domain is not blacklisted");
-		return false;
+		free_domainlists(lists);
+		lists = NULL;
 	}
+	sqlite3_close(db);
 
-	// Update statement if has just been initialized
-	if(stmt == NULL)
+	if(lists != NULL)
 	{
-		stmt = blacklist_stmt->get(blacklist_stmt, client->id);
+		// Build prefilters answering lookups of unlisted domains quickly
+		const size_t prefilter = domainlists_finish(lists);
+		logg("Loaded %u gravity, %u blacklist and %u whitelist domains into memory in %.3f msec (prefilter: %zu KiB)",
+		     domainlists_count(lists, GRAVITY_TABLE),
+		     domainlists_count(lists, EXACT_BLACKLIST_TABLE),
+		     domainlists_count(lists, EXACT_WHITELIST_TABLE),
+		     timer_elapsed_msec(LISTS_TIMER), prefilter / 1024u);
+
+		// Use the image from now on so the memory is shared with all forks
+		if(domainlists_save(lists, FTLfiles.gravity_image, &db_stat))
+		{
+			domainLists *mapped = domainlists_map(FTLfiles.gravity_image, &db_stat);
+			if(mapped != NULL)
+			{
+				free_domainlists(lists);
+				lists = mapped;
+			}
+		}
 	}
+	else
+		logg("ERROR: Cannot load lists, no domains are blocked or whitelisted exactly");
 
-	return domain_in_list(domain, stmt, "blacklist");
+	return lists;
+}
+
+// Replace the in-memory lists. This has to be called while holding the lists
+// lock for writing. Returns the previous lists which should be freed after
+// releasing the lock
+domainLists *gravityDB_replace_lists(domainLists *lists)
+{
+	domainLists *old = domainlists;
+	domainlists = lists;
+	return old;
+}
+
+bool in_whitelist(const char *domain, const DNSCacheData *dns_cache, const listsClient *client)
+{
+	// We have to check both the exact whitelist as well the compiled regex
+	// whitelist filters to check if the current domain is whitelisted. Due
+	// to short-circuit-evaluation in C, the regex evaluations is executed
+	// only if the exact whitelist lookup does not deliver a positive match.
+	return domainlists_contains(domainlists, EXACT_WHITELIST_TABLE, domain, client->groups) ||
+	       match_regex(domain, dns_cache, client->regex, REGEX_WHITELIST, false) != -1;
+}
+
+bool __attribute__((pure)) in_gravity(const char *domain, const listsClient *client)
+{
+	return domainlists_contains(domainlists, GRAVITY_TABLE, domain, client->groups);
+}
+
+inline bool in_blacklist(const char *domain, const listsClient *client)
+{
+	return domainlists_contains(domainlists, EXACT_BLACKLIST_TABLE, domain, client->groups);
 }
 
 bool in_auditlist(const char *domain)
 {
-	// If audit list statement is not ready and cannot be initialized (e.g. no access
-	// to the database), we return false (not in audit list) to prevent an FTL crash
-	if(auditlist_stmt == NULL)
-		return false;
+	pthread_mutex_lock(&auditlist_lock);
+	if(open_on_demand)
+	{
+		open_on_demand = false;
+		gravityDB_open();
+	}
 
-	// We check the domain_audit table for the given domain
-	return domain_in_list(domain, auditlist_stmt, "auditlist");
+	// We check the domain_audit table for the given domain. If audit list
+	// statement is not ready and cannot be initialized (e.g. no access to the
+	// database), we return false (not in audit list) to prevent an FTL crash
+	const bool found = auditlist_stmt != NULL && domain_in_list(domain, auditlist_stmt, "auditlist");
+	pthread_mutex_unlock(&auditlist_lock);
+
+	return found;
 }
 
 bool gravityDB_get_regex_client_groups(clientsData* client, const unsigned int numregex, const regexData *regex,
@@ -1310,6 +1355,9 @@ bool gravityDB_get_regex_client_groups(clientsData* client, const unsigned int n
 	if(config.debug & DEBUG_REGEX)
 		logg("Getting regex client groups for client with ID %i", client->id);
 
+	if(!gravityDB_opened && !gravityDB_open())
+		return false;
+
 	char *querystr = NULL;
 	if(!client->flags.found_group && !get_client_groupids(client))
 		return false;
@@ -14,6 +14,8 @@
 #include "../datastructure.h"
 // regexData
 #include "../regex_r.h"
+// domainLists
+#include "domain-lists.h"
 
 // Table indices
 enum gravity_tables { GRAVITY_TABLE, EXACT_BLACKLIST_TABLE, EXACT_WHITELIST_TABLE, REGEX_BLACKLIST_TABLE, REGEX_WHITELIST_TABLE, UNKNOWN_TABLE } __attribute__ ((packed));
@@ -22,7 +24,8 @@ void gravityDB_forked(void);
 void gravityDB_reopen(void);
 bool gravityDB_open(void);
 void gravityDB_reload_groups(clientsData* client);
-bool gravityDB_prepare_client_statements(clientsData* client);
+domainLists *gravityDB_load_lists(void);
+domainLists *gravityDB_replace_lists(domainLists *lists);
 void gravityDB_close(void);
 bool gravityDB_getTable(unsigned char list);
 const char* gravityDB_getDomain(int *rowid);
@@ -31,9 +34,26 @@ void gravityDB_finalizeTable(void);
 int gravityDB_count(const enum gravity_tables list);
 bool in_auditlist(const char *domain);
 
-bool in_gravity(const char *domain, clientsData* client);
-bool in_blacklist(const char *domain, clientsData* client);
-bool in_whitelist(const char *domain, const DNSCacheData *dns_cache, clientsData* client);
+// Process-local copy of everything needed to check domains against the lists
+// of a client. It allows the (slow) list lookups to run without holding the
+// shared memory lock, see gravityDB_client_snapshot()
+typedef struct {
+	int id;
+	unsigned int generation;
+	bool *regex;
+	uint64_t *groups;
+} listsClient;
+
+void lock_lists_read(void);
+void lock_lists_write(void);
+void unlock_lists(void);
+bool gravityDB_client_snapshot(clientsData *client, listsClient *snapshot);
+bool gravityDB_snapshot_valid(const listsClient *snapshot) __attribute__((pure));
+void gravityDB_free_snapshot(listsClient *snapshot);
+
+bool in_gravity(const char *domain, const listsClient *client) __attribute__((pure));
+bool in_blacklist(const char *domain, const listsClient *client);
+bool in_whitelist(const char *domain, const DNSCacheData *dns_cache, const listsClient *client);
 
 bool gravityDB_get_regex_client_groups(clientsData* client, const unsigned int numregex, const regexData *regex,
                                        const unsigned char type, const char* table);
@@ -98,16 +98,28 @@ void DB_save_queries(void)
 	time_t currenttimestamp = time(NULL);
 	time_t newlasttimestamp = 0;
 	long int queryID;
-	for(queryID = MAX(0, lastdbindex); queryID < counters->queries; queryID++)
+	const int end = counters->oldest_query + counters->queries;
+	for(queryID = MAX(counters->oldest_query, lastdbindex); queryID < end; queryID++)
 	{
 		queriesData* query = getQuery(queryID, true);
-		if(query->db != 0)
+		if(query == NULL)
+		{
+			// Memory error
+			continue;
+		}
+		queriesColdData* cold = getQueryCold(query);
+		if(cold == NULL)
+		{
+			// Memory error
+			continue;
+		}
+		if(cold->db != 0)
 		{
 			// Skip, already saved in database
 			continue;
 		}
 
-		if(!query->flags.complete && query->timestamp > currenttimestamp-2)
+		if(!query->flags.complete && (time_t)query->timestamp > currenttimestamp-2)
 		{
 			// Break if a brand new query (age < 2 seconds) is not yet completed
 			// giving it a chance to be stored next time
@@ -205,7 +217,7 @@ void DB_save_queries(void)
 
 		saved++;
 		// Mark this query as saved in the database by setting the corresponding ID
-		query->db = ++lastID;
+		cold->db = ++lastID;
 
 		// Total counter information (delta computation)
 		total++;
@@ -213,7 +225,7 @@ void DB_save_queries(void)
 			blocked++;
 
 		// Update lasttimestamp variable with timestamp of the latest stored query
-		if(query->timestamp > newlasttimestamp)
+		if((time_t)query->timestamp > newlasttimestamp)
 			newlasttimestamp = query->timestamp;
 	}
 
@@ -414,12 +426,18 @@ void DB_read_queries(void)
 		memory_check(QUERIES);
 
 		// Set index for this query
-		const int queryIndex = counters->queries;
+		const int queryIndex = counters->oldest_query + counters->queries;
 
 		// Store this query in memory
 		queriesData* query = getQuery(queryIndex, false);
+		queriesColdData* cold = getQueryCold(query);
+		if(query == NULL || cold == NULL)
+		{
+			// Memory error
+			continue;
+		}
 		query->magic = MAGICBYTE;
-		query->timestamp = queryTimeStamp;
+		query->timestamp = (uint32_t)queryTimeStamp;
 		if(type < 100)
 		{
 			// Mapped query type
@@ -437,16 +455,17 @@ void DB_read_queries(void)
 		query->clientID = clientID;
 		query->upstreamID = upstreamID;
 		query->timeidx = timeidx;
-		query->db = dbid;
-		query->id = 0;
-		query->response = 0;
-		query->dnssec = DNSSEC_UNSPECIFIED;
-		query->reply = REPLY_UNKNOWN;
-		query->CNAME_domainID = -1;
+		cold->db = dbid;
+		cold->id = 0;
+		cold->response = 0;
+		cold->dnssec = DNSSEC_UNSPECIFIED;
+		cold->reply = REPLY_UNKNOWN;
+		cold->CNAME_domainID = -1;
 		// Initialize flags
 		query->flags.complete = true; // Mark as all information is available
 		query->flags.blocked = false;
 		query->flags.whitelisted = false;
+		query->flags.response_pending = false;
 
 		// Set lastQuery timer for network table
 		clientsData* client = getClient(clientID, true);
@@ -480,7 +499,7 @@ void DB_read_queries(void)
 				// domain in the middle of a CNAME trajectory does not mean
 				// it was queried intentionally.
 				const int CNAMEdomainID = findDomainID(CNAMEdomain, false);
-				query->CNAME_domainID = CNAMEdomainID;
+				cold->CNAME_domainID = CNAMEdomainID;
 			}
 		}
 		else if(status == QUERY_REGEX)
@@ -555,7 +574,7 @@ void DB_read_queries(void)
 
 	// Update lastdbindex so that the next call to DB_save_queries()
 	// skips the queries that we just imported from the database
-	lastdbindex = counters->queries;
+	lastdbindex = counters->oldest_query + counters->queries;
 
 	if( rc != SQLITE_DONE ){
 		logg("DB_read_queries() - SQL error step: %s", sqlite3_errstr(rc));
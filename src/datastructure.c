@@ -40,33 +40,83 @@ void strtolower(char *str)
 	while(str[i]){ str[i] = tolower(str[i]); i++; }
 }
 
+// Compare a dnsmasq ID against the ID of the query with a given index
+static bool query_matches(const int queryID, const void *id)
+{
+	// Get query pointer
+	const queriesData* query = getQuery(queryID, true);
+
+	// Check if the returned pointer is valid before trying to access it
+	if(query == NULL)
+		return false;
+	const queriesColdData* cold = getQueryCold(query);
+	if(cold == NULL)
+		return false;
+
+	return cold->id == *(const int*)id;
+}
+
 int findQueryID(const int id)
 {
-	// Loop over all queries - we loop in reverse order (start from the most recent query and
-	// continuously walk older queries while trying to find a match. Ideally, we should always
-	// find the correct query with zero iterations, but it may happen that queries are processed
-	// asynchronously, e.g. for slow upstream relies to a huge amount of requests.
-	// We iterate from the most recent query down to at most MAXITER queries in the past to avoid
-	// iterating through the entire array of queries
-	// MAX(0, a) is used to return 0 in case a is negative (negative array indices are harmful)
-	const int until = MAX(0, counters->queries-MAXITER);
-	const int start = MAX(0, counters->queries-1);
-
-	// Check UUIDs of queries
-	for(int i = start; i >= until; i--)
-	{
-		const queriesData* query = getQuery(i, true);
+	// Look the dnsmasq ID up in the shared hash index. This finds any
+	// query still in memory, regardless of how many queries arrived
+	// since it was received
+	return hash_lookup(QUERIES_HASH, hashData(&id, sizeof(id)), query_matches, &id);
+}
 
-		// Check if the returned pointer is valid before trying to access it
+// Add a query to the dnsmasq ID index. dnsmasq's IDs may wrap around, in this
+// case, the more recent query replaces the older one with the same ID
+void index_query(const int queryID)
+{
+	const queriesData* query = getQuery(queryID, true);
+	if(query == NULL)
+		return;
+	const queriesColdData* cold = getQueryCold(query);
+	if(cold == NULL)
+		return;
+
+	const int id = cold->id;
+	const uint32_t hash = hashData(&id, sizeof(id));
+	const int oldID = hash_lookup(QUERIES_HASH, hash, query_matches, &id);
+	if(oldID > -1)
+		hash_remove(QUERIES_HASH, hash, oldID);
+	hash_insert(QUERIES_HASH, hash, queryID);
+}
+
+// Remove an expiring query from the dnsmasq ID index
+void unindex_query(const int queryID)
+{
+	const queriesData* query = getQuery(queryID, true);
+	if(query == NULL)
+		return;
+	const queriesColdData* cold = getQueryCold(query);
+	if(cold == NULL)
+		return;
+	const int id = cold->id;
+	if(id == 0)
+		return;
+
+	// Only remove the entry if it was not already replaced by a more
+	// recent query with the same dnsmasq ID
+	if(findQueryID(id) == queryID)
+		hash_remove(QUERIES_HASH, hashData(&id, sizeof(id)), queryID);
+}
+
+// Rebuild the dnsmasq ID index after query IDs have changed
+void reindex_queries(void)
+{
+	hash_clear(QUERIES_HASH);
+	const int end = counters->oldest_query + counters->queries;
+	for(int queryID = counters->oldest_query; queryID < end; queryID++)
+	{
+		const queriesData* query = getQuery(queryID, true);
 		if(query == NULL)
 			continue;
-
-		if(query->id == id)
-			return i;
+		const queriesColdData* cold = getQueryCold(query);
+		// Queries imported from the database have no dnsmasq ID
+		if(cold != NULL && cold->id != 0)
+			index_query(queryID);
 	}
-
-	// If not found
-	return -1;
 }
 
 int findUpstreamID(const char * upstreamString, const in_port_t port)
@@ -124,33 +174,34 @@ int findUpstreamID(const char * upstreamString, const in_port_t port)
 	return upstreamID;
 }
 
-int findDomainID(const char *domainString, const bool count)
+// Compare a domain name against the domain stored for a given ID
+static bool domain_matches(const int domainID, const void *domainString)
 {
-	for(int domainID = 0; domainID < counters->domains; domainID++)
-	{
-		// Get domain pointer
-		domainsData* domain = getDomain(domainID, true);
+	// Get domain pointer
+	const domainsData* domain = getDomain(domainID, true);
 
-		// Check if the returned pointer is valid before trying to access it
-		if(domain == NULL)
-			continue;
+	// Check if the returned pointer is valid before trying to access it
+	if(domain == NULL)
+		return false;
 
-		// Quick test: Does the domain start with the same character?
-		if(getstr(domain->domainpos)[0] != domainString[0])
-			continue;
+	return strcmp(getstr(domain->domainpos), domainString) == 0;
+}
 
-		// If so, compare the full domain using strcmp
-		if(strcmp(getstr(domain->domainpos), domainString) == 0)
-		{
-			if(count)
-				domain->count++;
-			return domainID;
-		}
+int findDomainID(const char *domainString, const bool count)
+{
+	// Look the domain up in the shared hash index
+	const uint32_t hash = hashStr(domainString);
+	int domainID = hash_lookup(DOMAINS_HASH, hash, domain_matches, domainString);
+	if(domainID > -1)
+	{
+		if(count)
+			getDomain(domainID, true)->count++;
+		return domainID;
 	}
 
 	// If we did not return until here, then this domain is not known
 	// Store ID
-	const int domainID = counters->domains;
+	domainID = counters->domains;
 
 	// Check struct size
 	memory_check(DOMAINS);
@@ -172,35 +223,67 @@ int findDomainID(const char *domainString, const bool count)
 	domain->blockedcount = 0;
 	// Store domain name - no need to check for NULL here as it doesn't harm
 	domain->domainpos = addstr(domainString);
+	// Add domain to the hash index
+	hash_insert(DOMAINS_HASH, hash, domainID);
 	// Increase counter by one
 	counters->domains++;
 
 	return domainID;
 }
 
-int findClientID(const char *clientIP, const bool count, const bool aliasclient)
+// Store an IPv4 address as IPv4-mapped IPv6 address (::ffff:a.b.c.d)
+void mapIPv4(struct in6_addr *addr6, const struct in_addr *addr4)
 {
-	// Compare content of client against known client IP addresses
-	for(int clientID=0; clientID < counters->clients; clientID++)
-	{
-		// Get client pointer
-		clientsData* client = getClient(clientID, true);
+	memset(addr6, 0, sizeof(*addr6));
+	addr6->s6_addr[10] = 0xff;
+	addr6->s6_addr[11] = 0xff;
+	memcpy(&addr6->s6_addr[12], &addr4->s_addr, sizeof(addr4->s_addr));
+}
 
-		// Check if the returned pointer is valid before trying to access it
-		if(client == NULL)
-			continue;
+// Compare a binary address against the address of the client with a given ID
+static bool client_addr_matches(const int clientID, const void *addr)
+{
+	// Get client pointer
+	const clientsData* client = getClient(clientID, true);
 
-		// Quick test: Does the clients IP start with the same character?
-		if(getstr(client->ippos)[0] != clientIP[0])
-			continue;
+	// Check if the returned pointer is valid before trying to access it
+	if(client == NULL)
+		return false;
 
-		// If so, compare the full IP using strcmp
-		if(strcmp(getstr(client->ippos), clientIP) == 0)
-		{
-			// Add one if count == true (do not add one, e.g., during ARP table processing)
-			if(count && !aliasclient) change_clientcount(client, 1, 0, -1, 0);
-			return clientID;
-		}
+	// Alias-clients are indexed by their name, not by an address
+	return !client->flags.aliasclient &&
+	       memcmp(&client->addr, addr, sizeof(client->addr)) == 0;
+}
+
+// Compare a string against the IP string of the client with a given ID
+static bool client_str_matches(const int clientID, const void *clientIP)
+{
+	// Get client pointer
+	const clientsData* client = getClient(clientID, true);
+
+	// Check if the returned pointer is valid before trying to access it
+	if(client == NULL)
+		return false;
+
+	return strcmp(getstr(client->ippos), clientIP) == 0;
+}
+
+// Look up (and possibly create) a client. Clients with a valid address are
+// indexed by their binary address, alias-clients (and anything else we cannot
+// parse as address) by their name. The textual representation of an address
+// is only generated when a new client is created
+static int _findClientID(const struct in6_addr *addr, const char *clientIP,
+                         const bool count, const bool aliasclient)
+{
+	const uint32_t hash = addr != NULL ? hashData(addr, sizeof(*addr)) : hashStr(clientIP);
+	const int foundID = addr != NULL ?
+		hash_lookup(CLIENTS_HASH, hash, client_addr_matches, addr) :
+		hash_lookup(CLIENTS_HASH, hash, client_str_matches, clientIP);
+	if(foundID > -1)
+	{
+		// Add one if count == true (do not add one, e.g., during ARP table processing)
+		if(count && !aliasclient) change_clientcount(getClient(foundID, true), 1, 0, -1, 0);
+		return foundID;
 	}
 
 	// Return -1 (= not found) if count is false because we do not want to create a new client here
@@ -230,7 +313,21 @@ int findClientID(const char *clientIP, const bool count, const bool aliasclient)
 	// Initialize blocked count to zero
 	client->blockedcount = 0;
 	// Store client IP - no need to check for NULL here as it doesn't harm
-	client->ippos = addstr(clientIP);
+	if(addr != NULL)
+	{
+		char ipstr[INET6_ADDRSTRLEN] = { 0 };
+		if(IN6_IS_ADDR_V4MAPPED(addr))
+			inet_ntop(AF_INET, &addr->s6_addr[12], ipstr, sizeof(ipstr));
+		else
+			inet_ntop(AF_INET6, addr, ipstr, sizeof(ipstr));
+		client->ippos = addstr(ipstr);
+		client->addr = *addr;
+	}
+	else
+	{
+		client->ippos = addstr(clientIP);
+		memset(&client->addr, 0, sizeof(client->addr));
+	}
 	// Initialize client hostname
 	// Due to the nature of us being the resolver,
 	// the actual resolving of the host name has
@@ -258,12 +355,12 @@ int findClientID(const char *clientIP, const bool count, const bool aliasclient)
 	client->flags.aliasclient = aliasclient;
 	client->aliasclient_id = -1;
 
-	// Initialize client-specific overTime data
-	memset(client->overTime, 0, sizeof(client->overTime));
-
 	// Store client ID
 	client->id = clientID;
 
+	// Add client to the hash index
+	hash_insert(CLIENTS_HASH, hash, clientID);
+
 	// Increase counter by one
 	counters->clients++;
 
@@ -285,12 +382,34 @@ int findClientID(const char *clientIP, const bool count, const bool aliasclient)
 	return clientID;
 }
 
+int findClientID(const char *clientIP, const bool count, const bool aliasclient)
+{
+	// Alias-clients are looked up by their name
+	if(aliasclient)
+		return _findClientID(NULL, clientIP, count, aliasclient);
+
+	// Convert textual address into its binary representation
+	struct in6_addr addr;
+	struct in_addr addr4;
+	if(inet_pton(AF_INET, clientIP, &addr4) == 1)
+		mapIPv4(&addr, &addr4);
+	else if(inet_pton(AF_INET6, clientIP, &addr) != 1)
+		return _findClientID(NULL, clientIP, count, aliasclient);
+
+	return _findClientID(&addr, NULL, count, aliasclient);
+}
+
+int findClientIDbyAddr(const struct in6_addr *addr, const bool count)
+{
+	return _findClientID(addr, NULL, count, false);
+}
+
 void change_clientcount(clientsData *client, int total, int blocked, int overTimeIdx, int overTimeMod)
 {
 		client->count += total;
 		client->blockedcount += blocked;
 		if(overTimeIdx > -1 && overTimeIdx < OVERTIME_SLOTS)
-			client->overTime[overTimeIdx] += overTimeMod;
+			change_client_overTime(client->id, overTimeIdx, overTimeMod);
 
 		// Also add counts to the conencted alias-client (if any)
 		if(client->flags.aliasclient)
@@ -305,29 +424,49 @@ void change_clientcount(clientsData *client, int total, int blocked, int overTim
 			aliasclient->count += total;
 			aliasclient->blockedcount += blocked;
 			if(overTimeIdx > -1 && overTimeIdx < OVERTIME_SLOTS)
-				aliasclient->overTime[overTimeIdx] += overTimeMod;
+				change_client_overTime(client->aliasclient_id, overTimeIdx, overTimeMod);
 		}
 }
 
-int findCacheID(int domainID, int clientID, enum query_types query_type)
+// Key of the per-client DNS cache hash index
+typedef struct {
+	int domainID;
+	int clientID;
+	int query_type;
+} cacheKey;
+
+// Compare a (domain, client, type) triple against the cache entry with a given ID
+static bool cache_matches(const int cacheID, const void *key)
 {
-	// Compare content of client against known client IP addresses
-	for(int cacheID = 0; cacheID < counters->dns_cache_size; cacheID++)
-	{
-		// Get cache pointer
-		DNSCacheData* dns_cache = getDNSCache(cacheID, true);
+	// Get cache pointer
+	const DNSCacheData* dns_cache = getDNSCache(cacheID, true);
 
-		// Check if the returned pointer is valid before trying to access it
-		if(dns_cache == NULL)
-			continue;
+	// Check if the returned pointer is valid before trying to access it
+	if(dns_cache == NULL)
+		return false;
 
-		if(dns_cache->domainID == domainID &&
-		   dns_cache->clientID == clientID &&
-		   dns_cache->query_type == query_type)
-		{
-			return cacheID;
-		}
-	}
+	const cacheKey *k = key;
+	return dns_cache->domainID == k->domainID &&
+	       dns_cache->clientID == k->clientID &&
+	       dns_cache->query_type == k->query_type;
+}
+
+// Look up a DNS cache entry without creating it. Returns -1 if there is none.
+// Unlike findCacheID(), this can be used while holding only the read lock
+int lookupCacheID(const int domainID, const int clientID, const enum query_types query_type)
+{
+	const cacheKey key = { domainID, clientID, query_type };
+	return hash_lookup(DNS_CACHE_HASH, hashData(&key, sizeof(key)), cache_matches, &key);
+}
+
+int findCacheID(int domainID, int clientID, enum query_types query_type)
+{
+	// Look the triple up in the shared hash index
+	const cacheKey key = { domainID, clientID, query_type };
+	const uint32_t hash = hashData(&key, sizeof(key));
+	const int foundID = hash_lookup(DNS_CACHE_HASH, hash, cache_matches, &key);
+	if(foundID > -1)
+		return foundID;
 
 	// Get ID of new cache entry
 	const int cacheID = counters->dns_cache_size;
@@ -352,6 +491,9 @@ int findCacheID(int domainID, int clientID, enum query_types query_type)
 	dns_cache->query_type = query_type;
 	dns_cache->force_reply = 0u;
 
+	// Add cache entry to the hash index
+	hash_insert(DNS_CACHE_HASH, hash, cacheID);
+
 	// Increase counter by one
 	counters->dns_cache_size++;
 
@@ -400,8 +542,13 @@ const char *getCNAMEDomainString(const queriesData* query)
 
 	if(query->privacylevel < PRIVACY_HIDE_DOMAINS)
 	{
+		// Get query details
+		const queriesColdData* cold = getQueryCold(query);
+		if(cold == NULL)
+			return "";
+
 		// Get domain pointer
-		const domainsData* domain = getDomain(query->CNAME_domainID, true);
+		const domainsData* domain = getDomain(cold->CNAME_domainID, true);
 
 		// Return string
 		return getstr(domain->domainpos);
@@ -468,7 +615,14 @@ void FTL_reset_per_client_domain_data(void)
 
 void FTL_reload_all_domainlists(void)
 {
+	// Read the lists into memory before locking, this may take a while for
+	// large lists and queries can still be answered using the old lists
+	domainLists *lists = gravityDB_load_lists();
+
 	lock_shm();
+	// Query lookups running concurrently without the shared memory lock
+	// must not see the lists while they are being replaced
+	lock_lists_write();
 
 	// (Re-)open FTL database connection
 	piholeFTLDB_reopen();
@@ -479,6 +633,14 @@ void FTL_reload_all_domainlists(void)
 	// (Re-)open gravity database connection
 	gravityDB_reopen();
 
+	// Use the new lists from now on. Keep the previous ones if the new
+	// lists could not be loaded (e.g. the database is locked while it is
+	// being updated), the next reload will try again
+	if(lists != NULL)
+		lists = gravityDB_replace_lists(lists);
+	else
+		logg("WARN: Loading domain lists failed, keeping the previous lists");
+
 	// Reset number of blocked domains
 	counters->gravity = gravityDB_count(GRAVITY_TABLE);
 
@@ -490,5 +652,9 @@ void FTL_reload_all_domainlists(void)
 	// has already been validated for a specific user
 	FTL_reset_per_client_domain_data();
 
+	unlock_lists();
 	unlock_shm();
+
+	// Free the old lists, nobody can use them any more
+	free_domainlists(lists);
 }
@@ -20,23 +20,12 @@
 
 extern const char *querytypes[TYPE_MAX];
 
+// Query records are split into a hot part holding everything needed to
+// filter and aggregate queries and a cold part with details that are only
+// read for individual queries. Both are stored in separate shared memory
+// arrays at the same slot so full scans only touch the hot array
 typedef struct {
 	unsigned char magic;
-	enum query_status status;
-	enum query_types type;
-	enum privacy_level privacylevel;
-	enum reply_type reply;
-	enum dnssec_status dnssec;
-	uint16_t qtype;
-	int domainID;
-	int clientID;
-	int upstreamID;
-	int id; // the ID is a (signed) int in dnsmasq, so no need for a long int here
-	int CNAME_domainID; // only valid if query has a CNAME blocking status
-	unsigned int timeidx;
-	unsigned long response; // saved in units of 1/10 milliseconds (1 = 0.1ms, 2 = 0.2ms, 2500 = 250.0ms, etc.)
-	time_t timestamp;
-	int64_t db;
 	// Adjacent bit field members in the struct flags may be packed to share
 	// and straddle the individual bytes. It is useful to pack the memory as
 	// tightly as possible as there may be dozens of thousands of these
@@ -47,11 +36,31 @@ typedef struct {
 		bool whitelisted :1;
 		bool complete :1;
 		bool blocked :1;
+		bool response_pending :1; // cold->response is the start offset, not the response time
 	} flags;
+	uint16_t qtype;
+	enum query_status status;
+	enum query_types type;
+	enum privacy_level privacylevel;
+	int domainID;
+	int clientID;
+	int upstreamID;
+	unsigned int timeidx;
+	uint32_t timestamp; // unsigned 32 bit seconds suffice until 2106
 } queriesData;
+ASSERT_SIZEOF(queriesData, 28, 28, 28);
 
-// ARM needs extra padding at the end
-ASSERT_SIZEOF(queriesData, 64, 52, 56);
+typedef struct {
+	enum reply_type reply;
+	enum dnssec_status dnssec;
+	int id; // the ID is a (signed) int in dnsmasq, so no need for a long int here
+	int CNAME_domainID; // only valid if query has a CNAME blocking status
+	uint32_t response; // saved in units of 1/10 milliseconds (1 = 0.1ms, 2 = 0.2ms, 2500 = 250.0ms, etc.)
+	                   // while the response is pending, this is the time the query was received
+	                   // relative to the full second in query->timestamp
+	int64_t db;
+} queriesColdData;
+ASSERT_SIZEOF(queriesColdData, 24, 24, 24);
 
 typedef struct {
 	unsigned char magic;
@@ -74,6 +83,8 @@ typedef struct {
 		bool new:1;
 		bool found_group:1;
 		bool aliasclient:1;
+		bool mac_pending:1;
+		unsigned char mac_checks:4;
 	} flags;
 	int count;
 	int blockedcount;
@@ -81,7 +92,7 @@ typedef struct {
 	unsigned int id;
 	unsigned int rate_limit;
 	unsigned int numQueriesARP;
-	int overTime[OVERTIME_SLOTS];
+	struct in6_addr addr; // IPv4 clients are stored as IPv4-mapped addresses
 	size_t groupspos;
 	size_t ippos;
 	size_t namepos;
@@ -89,7 +100,7 @@ typedef struct {
 	time_t lastQuery;
 	time_t firstSeen;
 } clientsData;
-ASSERT_SIZEOF(clientsData, 696, 668, 668);
+ASSERT_SIZEOF(clientsData, 112, 84, 84);
 
 typedef struct {
 	unsigned char magic;
@@ -112,10 +123,16 @@ ASSERT_SIZEOF(DNSCacheData, 16, 16, 16);
 
 void strtolower(char *str);
 int findQueryID(const int id);
+void index_query(const int queryID);
+void unindex_query(const int queryID);
+void reindex_queries(void);
 int findUpstreamID(const char * upstream, const in_port_t port);
 int findDomainID(const char *domain, const bool count);
 int findClientID(const char *client, const bool count, const bool aliasclient);
+int findClientIDbyAddr(const struct in6_addr *addr, const bool count);
+void mapIPv4(struct in6_addr *addr6, const struct in_addr *addr4);
 int findCacheID(int domainID, int clientID, enum query_types query_type);
+int lookupCacheID(const int domainID, const int clientID, const enum query_types query_type);
 bool isValidIPv4(const char *addr);
 bool isValidIPv6(const char *addr);
 
@@ -132,6 +149,8 @@ void change_clientcount(clientsData *client, int total, int blocked, int overTim
 // Pointer getter functions
 #define getQuery(queryID, checkMagic) _getQuery(queryID, checkMagic, __LINE__, __FUNCTION__, __FILE__)
 queriesData* _getQuery(int queryID, bool checkMagic, int line, const char * function, const char * file);
+#define getQueryCold(query) _getQueryCold(query, __LINE__, __FUNCTION__, __FILE__)
+queriesColdData* _getQueryCold(const queriesData *query, int line, const char * function, const char * file);
 #define getClient(clientID, checkMagic) _getClient(clientID, checkMagic, __LINE__, __FUNCTION__, __FILE__)
 clientsData* _getClient(int clientID, bool checkMagic, int line, const char * function, const char * file);
 #define getDomain(domainID, checkMagic) _getDomain(domainID, checkMagic, __LINE__, __FUNCTION__, __FILE__)
@@ -24,6 +24,8 @@
 #include "daemon.h"
 #include "timers.h"
 #include "gc.h"
+// queue_neighbor_lookup()
+#include "neighbor.h"
 #include "api/socket.h"
 #include "regex_r.h"
 #include "config.h"
@@ -45,7 +47,7 @@
 static void print_flags(const unsigned int flags);
 static void save_reply_type(const unsigned int flags, const union all_addr *addr,
                             queriesData* query, const struct timeval response);
-static unsigned long converttimeval(const struct timeval time) __attribute__((const));
+static uint32_t response_offset(const queriesData *query, const struct timeval time) __attribute__((pure));
 static void detect_blocked_IP(const unsigned short flags, const union all_addr *addr, const int queryID);
 static void query_externally_blocked(const int queryID, const unsigned char status);
 static void prepare_blocking_metadata(void);
@@ -83,54 +85,70 @@ void FTL_next_iface(const char *newiface)
 	}
 }
 
-static bool check_domain_blocked(const char *domain, const int clientID,
-                                 clientsData *client, queriesData *query, DNSCacheData *dns_cache,
-                                 const char **blockingreason, unsigned char *new_status)
+// Result of checking a domain against the lists of a client
+typedef struct {
+	bool whitelisted;
+	bool blocked;
+	bool esni;
+	unsigned char new_status;
+	enum domain_client_status blocking_status;
+	int black_regex_idx;
+	const char *blockingreason;
+} blockingResult;
+
+// Everything needed to check a query against the lists without holding the
+// shared memory lock and to apply the result afterwards
+typedef struct {
+	int queryID;
+	int domainID;
+	int clientID;
+	bool stale;
+	char *domain;
+	listsClient lists;
+	DNSCacheData dns_cache;
+	blockingResult result;
+} blockingCheck;
+
+static bool check_domain_blocked(const char *domain, const listsClient *lists,
+                                 const DNSCacheData *dns_cache, blockingResult *result)
 {
 	// Check domains against exact blacklist
-	// Skipped when the domain is whitelisted
-	bool blockDomain = false;
-	if(in_blacklist(domain, client))
+	if(in_blacklist(domain, lists))
 	{
 		// We block this domain
-		blockDomain = true;
-		*new_status = QUERY_BLACKLIST;
-		*blockingreason = "exactly blacklisted";
+		result->new_status = QUERY_BLACKLIST;
+		result->blockingreason = "exactly blacklisted";
 
 		// Mark domain as exactly blacklisted for this client
-		dns_cache->blocking_status = BLACKLIST_BLOCKED;
+		result->blocking_status = BLACKLIST_BLOCKED;
 		return true;
 	}
 
 	// Check domains against gravity domains
-	// Skipped when the domain is whitelisted or blocked by exact blacklist
-	if(!query->flags.whitelisted && !blockDomain &&
-	   in_gravity(domain, client))
+	// Skipped when the domain is blocked by exact blacklist
+	if(in_gravity(domain, lists))
 	{
 		// We block this domain
-		blockDomain = true;
-		*new_status = QUERY_GRAVITY;
-		*blockingreason = "gravity blocked";
+		result->new_status = QUERY_GRAVITY;
+		result->blockingreason = "gravity blocked";
 
 		// Mark domain as gravity blocked for this client
-		dns_cache->blocking_status = GRAVITY_BLOCKED;
+		result->blocking_status = GRAVITY_BLOCKED;
 		return true;
 	}
 
 	// Check domain against blacklist regex filters
-	// Skipped when the domain is whitelisted or blocked by exact blacklist or gravity
+	// Skipped when the domain is blocked by exact blacklist or gravity
 	int regex_idx = 0;
-	if(!query->flags.whitelisted && !blockDomain &&
-	   (regex_idx = match_regex(domain, dns_cache, client->id, REGEX_BLACKLIST, false)) > -1)
+	if((regex_idx = match_regex(domain, dns_cache, lists->regex, REGEX_BLACKLIST, false)) > -1)
 	{
 		// We block this domain
-		blockDomain = true;
-		*new_status = QUERY_REGEX;
-		*blockingreason = "regex blacklisted";
+		result->new_status = QUERY_REGEX;
+		result->blockingreason = "regex blacklisted";
 
 		// Mark domain as regex matched for this client
-		dns_cache->blocking_status = REGEX_BLOCKED;
-		dns_cache->black_regex_idx = regex_idx;
+		result->blocking_status = REGEX_BLOCKED;
+		result->black_regex_idx = regex_idx;
 		return true;
 	}
 
@@ -138,32 +156,18 @@ static bool check_domain_blocked(const char *domain, const int clientID,
 	return false;
 }
 
-static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const char **blockingreason,
-                                const char* file, const int line)
+// Check if we already know the answer for this particular domain/client
+// combination. Returns true if the decision has been made (stored in
+// *blockDomain) and false if the lists have to be checked
+static bool check_blocking_cached(queriesData *query, domainsData *domain, clientsData *client,
+                                  const DNSCacheData *dns_cache, const char **blockingreason,
+                                  bool *blockDomain)
 {
-	// Only check blocking conditions when global blocking is enabled
-	if(blockingstatus == BLOCKING_DISABLED)
-	{
-		return false;
-	}
-
-	// Get query, domain and client pointers
-	queriesData* query  = getQuery(queryID,   true);
-	domainsData* domain = getDomain(domainID, true);
-	clientsData* client = getClient(clientID, true);
-	unsigned int cacheID = findCacheID(domainID, clientID, query->type);
-	DNSCacheData *dns_cache = getDNSCache(cacheID, true);
-	if(query == NULL || domain == NULL || client == NULL || dns_cache == NULL)
-	{
-		// Encountered memory error, skip query
-		logg("WARN: No memory available, skipping query analysis");
-		return false;
-	}
-
 	// Skip the entire chain of tests if we already know the answer for this
 	// particular client
 	unsigned char blockingStatus = dns_cache->blocking_status;
-	char *domainstr = (char*)getstr(domain->domainpos);
+	const char *domainstr = getstr(domain->domainpos);
+	*blockDomain = false;
 	switch(blockingStatus)
 	{
 		case UNKNOWN_BLOCKED:
@@ -192,6 +196,7 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 			{
 				force_next_DNS_reply = dns_cache->force_reply;
 				query_blocked(query, domain, client, QUERY_BLACKLIST);
+				*blockDomain = true;
 				return true;
 			}
 			break;
@@ -212,6 +217,7 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 			{
 				force_next_DNS_reply = dns_cache->force_reply;
 				query_blocked(query, domain, client, QUERY_GRAVITY);
+				*blockDomain = true;
 				return true;
 			}
 			break;
@@ -232,6 +238,7 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 			if(!query->flags.whitelisted)
 			{
 				query_blocked(query, domain, client, QUERY_REGEX);
+				*blockDomain = true;
 				return true;
 			}
 			break;
@@ -247,7 +254,7 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 
 			query->flags.whitelisted = true;
 
-			return false;
+			return true;
 			break;
 
 		case NOT_BLOCKED:
@@ -259,7 +266,7 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 				logg("%s is known as not to be blocked", domainstr);
 			}
 
-			return false;
+			return true;
 			break;
 	}
 
@@ -270,51 +277,197 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 		{
 			logg("Query is permitted as at least one whitelist entry matched");
 		}
+		return true;
+	}
+
+	// The lists have to be checked
+	return false;
+}
+
+// Check if the blocking status of a query is already known. If not, prepare
+// everything needed to check the domain against the lists without holding the
+// shared memory lock. This has to be called while holding the shared memory
+// lock. Returns true if blocking_lookup() and blocking_apply() have to follow
+static bool blocking_prepare(blockingCheck *check, const char **blockingreason, bool *blockDomain)
+{
+	*blockDomain = false;
+
+	// Only check blocking conditions when global blocking is enabled
+	if(blockingstatus == BLOCKING_DISABLED)
+	{
+		return false;
+	}
+
+	// Get query, domain and client pointers
+	queriesData* query  = getQuery(check->queryID,   true);
+	domainsData* domain = getDomain(check->domainID, true);
+	clientsData* client = getClient(check->clientID, true);
+	if(query == NULL || domain == NULL || client == NULL)
+	{
+		// Encountered memory error, skip query
+		logg("WARN: No memory available, skipping query analysis");
+		return false;
+	}
+	unsigned int cacheID = findCacheID(check->domainID, check->clientID, query->type);
+	DNSCacheData *dns_cache = getDNSCache(cacheID, true);
+	if(dns_cache == NULL)
+	{
+		// Encountered memory error, skip query
+		logg("WARN: No memory available, skipping query analysis");
 		return false;
 	}
 
-	// Make a local copy of the domain string. The  string memory may get
-	// reorganized in the following. We cannot expect domainstr to remain
-	// valid for all time.
-	domainstr = strdup(domainstr);
-	const char *blockedDomain = domainstr;
+	if(check_blocking_cached(query, domain, client, dns_cache, blockingreason, blockDomain))
+		return false;
 
-	// Check whitelist (exact + regex) for match
-	query->flags.whitelisted = in_whitelist(domainstr, dns_cache, client);
+	// Make a local copy of the domain string and the DNS cache entry. The
+	// shared memory may get reorganized while the lists are checked. We
+	// cannot expect pointers into it to remain valid for all time.
+	check->domain = strdup(getstr(domain->domainpos));
+	check->dns_cache = *dns_cache;
+	if(check->domain == NULL || !gravityDB_client_snapshot(client, &check->lists))
+	{
+		logg("WARN: No memory available, skipping query analysis");
+		free(check->domain);
+		check->domain = NULL;
+		gravityDB_free_snapshot(&check->lists);
+		return false;
+	}
 
-	bool blockDomain = false;
-	unsigned char new_status = QUERY_UNKNOWN;
+	return true;
+}
+
+// Check a domain against the lists of a client. This does not access shared
+// memory and can be called without holding the shared memory lock
+static void blocking_lookup(blockingCheck *check)
+{
+	blockingResult *result = &check->result;
+	memset(result, 0, sizeof(*result));
+
+	lock_lists_read();
+
+	// Skip the lookup if the lists have been reloaded in the meantime,
+	// blocking_apply() will check the query again
+	check->stale = !gravityDB_snapshot_valid(&check->lists);
+	if(check->stale)
+	{
+		unlock_lists();
+		return;
+	}
+
+	// Check whitelist (exact + regex) for match
+	result->whitelisted = in_whitelist(check->domain, &check->dns_cache, &check->lists);
 
 	// Check blacklist (exact + regex) and gravity for queried domain
-	if(!query->flags.whitelisted)
+	if(!result->whitelisted)
 	{
-		blockDomain = check_domain_blocked(domainstr, clientID, client, query, dns_cache, blockingreason, &new_status);
+		result->blocked = check_domain_blocked(check->domain, &check->lists, &check->dns_cache, result);
 	}
 
 	// Check blacklist (exact + regex) and gravity for _esni.domain if enabled (defaulting to true)
-	if(config.block_esni && !query->flags.whitelisted && !blockDomain && strncasecmp(domainstr, "_esni.", 6u) == 0)
+	if(config.block_esni && !result->whitelisted && !result->blocked && strncasecmp(check->domain, "_esni.", 6u) == 0)
 	{
-		blockDomain = check_domain_blocked(domainstr + 6u, clientID, client, query, dns_cache, blockingreason, &new_status);
+		result->blocked = check_domain_blocked(check->domain + 6u, &check->lists, &check->dns_cache, result);
+
+		// Truncate "_esni." from queried domain if the parenting
+		// domain was the reason for blocking this query
+		result->esni = result->blocked;
+	}
 
-		if(blockDomain)
+	unlock_lists();
+}
+
+static void blocking_free(blockingCheck *check)
+{
+	free(check->domain);
+	check->domain = NULL;
+	gravityDB_free_snapshot(&check->lists);
+}
+
+// Apply the result of blocking_lookup() to the query. This has to be called
+// while holding the shared memory lock. Everything may have changed since
+// blocking_prepare() so we have to revalidate before using the result
+static bool blocking_apply(blockingCheck *check, const char **blockingreason)
+{
+	bool blockDomain = false;
+
+	// Get query, domain and client pointers (again)
+	queriesData* query  = getQuery(check->queryID,   true);
+	domainsData* domain = getDomain(check->domainID, true);
+	clientsData* client = getClient(check->clientID, true);
+	if(query == NULL || domain == NULL || client == NULL ||
+	   query->domainID != check->domainID || query->clientID != check->clientID)
+	{
+		// The query is gone (or has been replaced) in the meantime
+		logg("WARN: Query vanished while checking blocking status, skipping query analysis");
+		blocking_free(check);
+		return false;
+	}
+	unsigned int cacheID = findCacheID(check->domainID, check->clientID, query->type);
+	DNSCacheData *dns_cache = getDNSCache(cacheID, true);
+	if(dns_cache == NULL)
+	{
+		// Encountered memory error, skip query
+		logg("WARN: No memory available, skipping query analysis");
+		blocking_free(check);
+		return false;
+	}
+
+	// Another process may have found the answer in the meantime
+	if(dns_cache->blocking_status != UNKNOWN_BLOCKED &&
+	   check_blocking_cached(query, domain, client, dns_cache, blockingreason, &blockDomain))
+	{
+		blocking_free(check);
+		return blockDomain;
+	}
+
+	// The lists have been reloaded after the snapshot was taken, check the
+	// domain again. This time while holding the shared memory lock so the
+	// lists cannot change underneath us
+	if(check->stale || !gravityDB_snapshot_valid(&check->lists))
+	{
+		if(config.debug & DEBUG_QUERIES)
+			logg("Lists changed while checking %s, checking again", check->domain);
+
+		gravityDB_free_snapshot(&check->lists);
+		if(!gravityDB_client_snapshot(client, &check->lists))
 		{
-			// Truncate "_esni." from queried domain if the parenting domain was the reason for blocking this query
-			blockedDomain = domainstr + 6u;
-			// Force next DNS reply to be NXDOMAIN for _esni.* queries
-			force_next_DNS_reply = NXDOMAIN;
-			dns_cache->force_reply = NXDOMAIN;
+			logg("WARN: No memory available, skipping query analysis");
+			blocking_free(check);
+			return false;
 		}
+		check->dns_cache = *dns_cache;
+		blocking_lookup(check);
 	}
 
+	const blockingResult *result = &check->result;
+	query->flags.whitelisted = result->whitelisted;
+
 	// Common actions regardless what the possible blocking reason is
-	if(blockDomain)
+	if(result->blocked)
 	{
+		blockDomain = true;
+		*blockingreason = result->blockingreason;
+
+		// Remember blocking reason for this client
+		dns_cache->blocking_status = result->blocking_status;
+		if(result->blocking_status == REGEX_BLOCKED)
+			dns_cache->black_regex_idx = result->black_regex_idx;
+
+		// Force next DNS reply to be NXDOMAIN for _esni.* queries
+		if(result->esni)
+		{
+			force_next_DNS_reply = NXDOMAIN;
+			dns_cache->force_reply = NXDOMAIN;
+		}
+
 		// Adjust counters
-		query_blocked(query, domain, client, new_status);
+		query_blocked(query, domain, client, result->new_status);
 
 		// Debug output
 		if(config.debug & DEBUG_QUERIES)
-			logg("Blocking %s as %s is %s", domainstr, blockedDomain, *blockingreason);
+			logg("Blocking %s as %s is %s", check->domain,
+			     result->esni ? check->domain + 6u : check->domain, *blockingreason);
 	}
 	else
 	{
@@ -325,10 +478,23 @@ static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const c
 		dns_cache->blocking_status = query->flags.whitelisted ? WHITELISTED : NOT_BLOCKED;
 	}
 
-	free(domainstr);
+	blocking_free(check);
 	return blockDomain;
 }
 
+// Check blocking status of a query while holding the shared memory lock
+static bool _FTL_check_blocking(int queryID, int domainID, int clientID, const char **blockingreason,
+                                const char* file, const int line)
+{
+	bool blockDomain = false;
+	blockingCheck check = { .queryID = queryID, .domainID = domainID, .clientID = clientID };
+	if(!blocking_prepare(&check, blockingreason, &blockDomain))
+		return blockDomain;
+
+	blocking_lookup(&check);
+	return blocking_apply(&check, blockingreason);
+}
+
 
 bool _FTL_CNAME(const char *domain, const struct crec *cpp, const int id, const char* file, const int line)
 {
@@ -406,7 +572,9 @@ bool _FTL_CNAME(const char *domain, const struct crec *cpp, const int id, const
 		save_reply_type(F_CNAME, NULL, query, response);
 
 		// Store domain that was the reason for blocking the entire chain
-		query->CNAME_domainID = child_domainID;
+		queriesColdData* cold = getQueryCold(query);
+		if(cold != NULL)
+			cold->CNAME_domainID = child_domainID;
 
 		// Change blocking reason into CNAME-caused blocking
 		if(query->status == QUERY_GRAVITY)
@@ -546,22 +714,28 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	// 127.0.0.1 to avoid queries originating from localhost of the
 	// *distant* machine as queries coming from the *local* machine
 	const sa_family_t family = (flags & F_IPV4) ? AF_INET : AF_INET6;
-	char clientIP[ADDRSTRLEN+1] = { 0 };
+	struct in6_addr clientAddr;
 	if(config.edns0_ecs && edns->client_set)
 	{
 		// Use ECS provided client
-		strncpy(clientIP, edns->client, ADDRSTRLEN);
-		clientIP[ADDRSTRLEN] = '\0';
+		clientAddr = edns->client_addr;
+	}
+	else if(family == AF_INET)
+	{
+		// Use original requestor
+		mapIPv4(&clientAddr, &addr->addr4);
 	}
 	else
 	{
 		// Use original requestor
-		inet_ntop(family, addr, clientIP, ADDRSTRLEN);
+		clientAddr = addr->addr6;
 	}
 
 	// Check if user wants to skip queries coming from localhost
 	if(config.ignore_localhost &&
-	   (strcmp(clientIP, "127.0.0.1") == 0 || strcmp(clientIP, "::1") == 0))
+	   (IN6_IS_ADDR_LOOPBACK(&clientAddr) ||
+	    (IN6_IS_ADDR_V4MAPPED(&clientAddr) &&
+	     memcmp(&clientAddr.s6_addr[12], "\x7f\x00\x00\x01", 4) == 0)))
 	{
 		free(domainString);
 		return false;
@@ -570,8 +744,8 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	// Lock shared memory
 	lock_shm();
 
-	// Find client IP
-	const int clientID = findClientID(clientIP, true, false);
+	// Find client by its address
+	const int clientID = findClientIDbyAddr(&clientAddr, true);
 
 	// Get client pointer
 	clientsData* client = getClient(clientID, true);
@@ -585,6 +759,9 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 		return false;
 	}
 
+	// Textual client address (used for logging only)
+	const char *clientIP = getstr(client->ippos);
+
 	// Check rate-limit for this client
 	if(config.rate_limit.count > 0 &&
 	   ++client->rate_limit > config.rate_limit.count)
@@ -606,7 +783,7 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 
 	// Ensure we have enough space in the queries struct
 	memory_check(QUERIES);
-	const int queryID = counters->queries;
+	const int queryID = counters->oldest_query + counters->queries;
 
 	// Log new query if in debug mode
 	if(config.debug & DEBUG_QUERIES)
@@ -650,8 +827,17 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 		return false;
 	}
 
+	queriesColdData* cold = getQueryCold(query);
+	if(cold == NULL)
+	{
+		// Encountered memory error, skip query
+		free(domainString);
+		// Release thread lock
+		unlock_shm();
+		return false;
+	}
 	query->magic = MAGICBYTE;
-	query->timestamp = querytimestamp;
+	query->timestamp = (uint32_t)querytimestamp;
 	query->type = querytype;
 	query->qtype = qtype;
 	query->status = QUERY_UNKNOWN;
@@ -659,15 +845,16 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	query->clientID = clientID;
 	query->timeidx = timeidx;
 	// Initialize database rowID with zero, will be set when the query is stored in the long-term DB
-	query->db = 0;
-	query->id = id;
+	cold->db = 0;
+	cold->id = id;
 	query->flags.complete = false;
-	query->response = converttimeval(request);
+	query->flags.response_pending = true;
+	cold->response = response_offset(query, request);
 	// Initialize reply type
-	query->reply = REPLY_UNKNOWN;
+	cold->reply = REPLY_UNKNOWN;
 	// Store DNSSEC result for this domain
-	query->dnssec = DNSSEC_UNSPECIFIED;
-	query->CNAME_domainID = -1;
+	cold->dnssec = DNSSEC_UNSPECIFIED;
+	cold->CNAME_domainID = -1;
 	// This query is not yet known ad forwarded or blocked
 	query->flags.blocked = false;
 	query->flags.whitelisted = false;
@@ -680,6 +867,9 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 	// generated) is stored in the queries structure
 	query->privacylevel = config.privacylevel;
 
+	// Make this query findable by its dnsmasq ID
+	index_query(queryID);
+
 	// Increase DNS queries counter
 	counters->queries++;
 	// Count this query as unknown as long as no reply has
@@ -731,37 +921,41 @@ bool _FTL_new_query(const unsigned int flags, const char *name,
 		client->hwlen = 6;
 	}
 
-	// Try to obtain MAC address from dnsmasq's cache (also asks the kernel)
+	// Obtain MAC address from the kernel's neighbor cache. This is done
+	// asynchronously by the neighbor thread so the query path never
+	// blocks on MAC address discovery
 	if(client->hwlen < 1)
+		queue_neighbor_lookup(client);
+
+	// Check if the blocking status of this domain is already known for this
+	// client. If not, everything needed to check the lists is copied so that
+	// the lookups below can run without holding the lock
+	bool blockDomain = false;
+	blockingCheck check = { .queryID = queryID, .domainID = domainID, .clientID = clientID };
+	if(!blocking_prepare(&check, blockingreason, &blockDomain))
 	{
-		union mysockaddr hwaddr = {{ 0 }};
-		hwaddr.sa.sa_family = family;
-		if(family == AF_INET)
-		{
-			hwaddr.sa.sa_family = AF_INET;
-			hwaddr.in.sin_addr.s_addr = addr->addr4.s_addr;
-		}
-		else // AF_INET6
-		{
-			hwaddr.sa.sa_family = AF_INET6;
-			memcpy(&hwaddr.in6.sin6_addr, &addr->addr6, sizeof(addr->addr6));
-			hwaddr.in.sin_addr.s_addr = addr->addr4.s_addr;
-		}
-		client->hwlen = find_mac(&hwaddr, client->hwaddr, 1, time(NULL));
-		if(config.debug & DEBUG_ARP)
-		{
-			if(client->hwlen == 6)
-				logg("find_mac(\"%s\") returned hardware address "
-				     "%02X:%02X:%02X:%02X:%02X:%02X", clientIP,
-				     client->hwaddr[0], client->hwaddr[1], client->hwaddr[2],
-				     client->hwaddr[3], client->hwaddr[4], client->hwaddr[5]);
-			else
-				logg("find_mac(\"%s\") returned %i bytes of data",
-				     clientIP, client->hwlen);
-		}
+		// Free allocated memory
+		free(domainString);
+
+		// Release thread lock
+		unlock_shm();
+
+		return blockDomain;
 	}
 
-	bool blockDomain = FTL_check_blocking(queryID, domainID, clientID, blockingreason);
+	// Release thread lock. Checking the domain against the gravity
+	// database and regex filters can be slow. All other threads and
+	// forks would be stalled if we held the lock meanwhile
+	unlock_shm();
+
+	// Check domain against the lists of this client
+	blocking_lookup(&check);
+
+	// Lock shared memory again to store the result
+	lock_shm();
+
+	// Apply result of checking the lists
+	blockDomain = blocking_apply(&check, blockingreason);
 
 	// Free allocated memory
 	free(domainString);
@@ -932,7 +1126,13 @@ void _FTL_forwarded(const unsigned int flags, const char *name, const struct ser
 		gettimeofday(&response, 0);
 		// Reset timer, shift slightly into the past to acknowledge the time
 		// FTLDNS needed to look up the CNAME in its cache
-		query->response = converttimeval(response) - query->response;
+		queriesColdData* cold = getQueryCold(query);
+		if(cold != NULL && !query->flags.response_pending)
+		{
+			const uint32_t now = response_offset(query, response);
+			cold->response = now > cold->response ? now - cold->response : 0u;
+			query->flags.response_pending = true;
+		}
 	}
 	else
 	{
@@ -1068,7 +1268,8 @@ void _FTL_reply(const unsigned int flags, const char *name, const union all_addr
 	// Check if reply time is still unknown
 	// We only process the first reply in here
 	// Use short-circuit evaluation to check if query is NULL
-	if(query == NULL || query->reply != REPLY_UNKNOWN)
+	const queriesColdData* cold = query != NULL ? getQueryCold(query) : NULL;
+	if(cold == NULL || cold->reply != REPLY_UNKNOWN)
 	{
 		// Nothing to be done here
 		unlock_shm();
@@ -1507,13 +1708,21 @@ void _FTL_dnssec(const int status, const int id, const char* file, const int lin
 		}
 	}
 
+	queriesColdData* cold = getQueryCold(query);
+	if(cold == NULL)
+	{
+		// Memory error, skip this DNSSEC details
+		unlock_shm();
+		return;
+	}
+
 	// Iterate through possible values
 	if(status == STAT_SECURE)
-		query->dnssec = DNSSEC_SECURE;
+		cold->dnssec = DNSSEC_SECURE;
 	else if(status == STAT_INSECURE)
-		query->dnssec = DNSSEC_INSECURE;
+		cold->dnssec = DNSSEC_INSECURE;
 	else
-		query->dnssec = DNSSEC_BOGUS;
+		cold->dnssec = DNSSEC_BOGUS;
 
 	// Unlock shared memory
 	unlock_shm();
@@ -1546,25 +1755,33 @@ void _FTL_upstream_error(const unsigned int rcode, const int id, const char* fil
 		return;
 	}
 
+	queriesColdData* cold = getQueryCold(query);
+	if(cold == NULL)
+	{
+		// Memory error, skip this query
+		unlock_shm();
+		return;
+	}
+
 	// Translate dnsmasq's rcode into something we can use
 	const char *rcodestr = NULL;
 	switch(rcode)
 	{
 		case SERVFAIL:
 			rcodestr = "SERVFAIL";
-			query->reply = REPLY_SERVFAIL;
+			cold->reply = REPLY_SERVFAIL;
 			break;
 		case REFUSED:
 			rcodestr = "REFUSED";
-			query->reply = REPLY_REFUSED;
+			cold->reply = REPLY_REFUSED;
 			break;
 		case NOTIMP:
 			rcodestr = "NOT IMPLEMENTED";
-			query->reply = REPLY_NOTIMP;
+			cold->reply = REPLY_NOTIMP;
 			break;
 		default:
 			rcodestr = "UNKNOWN";
-			query->reply = REPLY_OTHER;
+			cold->reply = REPLY_OTHER;
 			break;
 	}
 
@@ -1583,7 +1800,7 @@ void _FTL_upstream_error(const unsigned int rcode, const int id, const char* fil
 
 		logg("**** got error report for %s: %s (ID %i, %s:%i)", domainname, rcodestr, id, file, line);
 
-		if(query->reply == REPLY_OTHER)
+		if(cold->reply == REPLY_OTHER)
 		{
 			logg("Unknown rcode = %i", rcode);
 		}
@@ -1681,38 +1898,43 @@ void print_flags(const unsigned int flags)
 static void save_reply_type(const unsigned int flags, const union all_addr *addr,
                             queriesData* query, const struct timeval response)
 {
+	// Reply type and response time are stored in the cold part of the query
+	queriesColdData* cold = getQueryCold(query);
+	if(cold == NULL)
+		return;
+
 	// Iterate through possible values
 	if(flags & F_NEG || force_next_DNS_reply == NXDOMAIN)
 	{
 		if(flags & F_NXDOMAIN)
 		{
 			// NXDOMAIN
-			query->reply = REPLY_NXDOMAIN;
+			cold->reply = REPLY_NXDOMAIN;
 			counters->reply_NXDOMAIN++;
 		}
 		else
 		{
 			// NODATA(-IPv6)
-			query->reply = REPLY_NODATA;
+			cold->reply = REPLY_NODATA;
 			counters->reply_NODATA++;
 		}
 	}
 	else if(flags & F_CNAME)
 	{
 		// <CNAME>
-		query->reply = REPLY_CNAME;
+		cold->reply = REPLY_CNAME;
 		counters->reply_CNAME++;
 	}
 	else if(flags & F_REVERSE)
 	{
 		// reserve lookup
-		query->reply = REPLY_DOMAIN;
+		cold->reply = REPLY_DOMAIN;
 		counters->reply_domain++;
 	}
 	else if(flags & F_RRNAME)
 	{
 		// TXT query
-		query->reply = REPLY_RRNAME;
+		cold->reply = REPLY_RRNAME;
 	}
 	else if((flags & F_RCODE && addr != NULL) || force_next_DNS_reply == REFUSED)
 	{
@@ -1720,32 +1942,35 @@ static void save_reply_type(const unsigned int flags, const union all_addr *addr
 		   || force_next_DNS_reply == REFUSED )
 		{
 			// REFUSED query
-			query->reply = REPLY_REFUSED;
+			cold->reply = REPLY_REFUSED;
 		}
 		else if(addr != NULL && addr->log.rcode == SERVFAIL)
 		{
 			// SERVFAIL query
-			query->reply = REPLY_SERVFAIL;
+			cold->reply = REPLY_SERVFAIL;
 		}
 	}
 	else
 	{
 		// Valid IP
-		query->reply = REPLY_IP;
+		cold->reply = REPLY_IP;
 		counters->reply_IP++;
 	}
 
 	// Save response time (relative time)
-	query->response = converttimeval(response) -
-	                            query->response;
+	if(query->flags.response_pending)
+	{
+		const uint32_t now = response_offset(query, response);
+		cold->response = now > cold->response ? now - cold->response : 0u;
+		query->flags.response_pending = false;
+	}
 }
 
-pthread_t telnet_listenthreadv4;
-pthread_t telnet_listenthreadv6;
-pthread_t socket_listenthread;
+pthread_t api_listenthread;
 pthread_t DBthread;
 pthread_t GCthread;
 pthread_t DNSclientthread;
+pthread_t neighborthread;
 
 void FTL_fork_and_bind_sockets(struct passwd *ent_pw)
 {
@@ -1773,24 +1998,10 @@ void FTL_fork_and_bind_sockets(struct passwd *ent_pw)
 	// join with the terminated thread
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
 
-	// Start TELNET IPv4 thread
-	if(pthread_create( &telnet_listenthreadv4, &attr, telnet_listening_thread_IPv4, NULL ) != 0)
-	{
-		logg("Unable to open IPv4 telnet listening thread. Exiting...");
-		exit(EXIT_FAILURE);
-	}
-
-	// Start TELNET IPv6 thread
-	if(pthread_create( &telnet_listenthreadv6, &attr, telnet_listening_thread_IPv6, NULL ) != 0)
-	{
-		logg("Unable to open IPv6 telnet listening thread. Exiting...");
-		exit(EXIT_FAILURE);
-	}
-
-	// Start SOCKET thread
-	if(pthread_create( &socket_listenthread, &attr, socket_listening_thread, NULL ) != 0)
+	// Start API thread (telnet and Unix socket)
+	if(pthread_create( &api_listenthread, &attr, api_thread, NULL ) != 0)
 	{
-		logg("Unable to open Unix socket listening thread. Exiting...");
+		logg("Unable to open API listening thread. Exiting...");
 		exit(EXIT_FAILURE);
 	}
 
@@ -1817,6 +2028,14 @@ void FTL_fork_and_bind_sockets(struct passwd *ent_pw)
 		exit(EXIT_FAILURE);
 	}
 
+	// Start thread that will stay in the background until MAC addresses
+	// of new clients need to be found
+	if(pthread_create( &neighborthread, &attr, neighbor_thread, NULL ) != 0)
+	{
+		logg("Unable to open neighbor thread. Exiting...");
+		exit(EXIT_FAILURE);
+	}
+
 	// Chown files if FTL started as user root but a dnsmasq config
 	// option states to run as a different user/group (e.g. "nobody")
 	if(getuid() == 0)
@@ -1955,11 +2174,15 @@ void FTL_forwarding_retried(const struct server *serv, const int oldID, const in
 	return;
 }
 
-static unsigned long __attribute__((const)) converttimeval(const struct timeval time)
+static uint32_t __attribute__((pure)) response_offset(const queriesData *query, const struct timeval time)
 {
-	// Convert time from struct timeval into units
-	// of 10*milliseconds
-	return time.tv_sec*10000 + time.tv_usec/100;
+	// Convert time from struct timeval into units of 1/10 milliseconds
+	// relative to the full second the query was received in. This keeps
+	// the values small enough for 32 bits
+	if(time.tv_sec < (time_t)query->timestamp)
+		return 0u;
+	const uint64_t offset = (uint64_t)(time.tv_sec - query->timestamp)*10000u + time.tv_usec/100;
+	return offset < UINT32_MAX ? (uint32_t)offset : UINT32_MAX;
 }
 
 // This subroutine prepares IPv4 and IPv6 addresses for blocking queries depending on the configured blocking mode
@@ -2154,6 +2377,9 @@ void FTL_TCP_worker_created(const int confd, const char *iface_name)
 	// handle isn't valid here
 	gravityDB_forked();
 
+	// Release regex automata possibly locked by other threads of the parent
+	regex_forked();
+
 	// Children inherit file descriptors from their parents
 	// We don't need them in the forks, so we clean them up
 	close_telnet_socket();
@@ -2294,15 +2520,23 @@ void FTL_duplicate_reply(const int id, int *firstID)
 	}
 
 	// Copy relevant information over
-	duplicated_query->reply = source_query->reply;
-	duplicated_query->dnssec = source_query->dnssec;
+	queriesColdData* duplicated_cold = getQueryCold(duplicated_query);
+	const queriesColdData* source_cold = getQueryCold(source_query);
+	if(duplicated_cold == NULL || source_cold == NULL)
+	{
+		// Memory error, skip this duplicate
+		unlock_shm();
+		return;
+	}
+	duplicated_cold->reply = source_cold->reply;
+	duplicated_cold->dnssec = source_cold->dnssec;
 	duplicated_query->flags.complete = true;
 
 	// The original query may have been blocked during CNAME inspection,
 	// correct status in this case
 	if(source_query->status != QUERY_FORWARDED)
 		duplicated_query->status = source_query->status;
-	duplicated_query->CNAME_domainID = source_query->CNAME_domainID;
+	duplicated_cold->CNAME_domainID = source_cold->CNAME_domainID;
 
 	// Unlock shared memory
 	unlock_shm();
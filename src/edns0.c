@@ -221,6 +221,10 @@ void FTL_parse_pseudoheaders(struct dns_header *header, size_t n, union mysockad
 			// Copy data to edns struct
 			strncpy(edns->client, ipaddr, ADDRSTRLEN);
 			edns->client[ADDRSTRLEN-1] = '\0';
+			if(family == 1)
+				mapIPv4(&edns->client_addr, &addr.addr4);
+			else
+				edns->client_addr = addr.addr6;
 
 			// Only set the address as useful when it is not the
 			// loopback address of the distant machine (127.0.0.0/8 or ::1)
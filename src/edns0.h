@@ -19,8 +19,9 @@ typedef struct {
 	char client[ADDRSTRLEN];
 	char mac_byte[6];
 	char mac_text[18];
+	struct in6_addr client_addr;
 } ednsData;
-ASSERT_SIZEOF(ednsData, 72, 72, 72);
+ASSERT_SIZEOF(ednsData, 88, 88, 88);
 
 void FTL_parse_pseudoheaders(struct dns_header *header, size_t n, union mysockaddr *peer, ednsData *edns);
 
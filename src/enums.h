@@ -153,9 +153,22 @@ enum events {
 	RERESOLVE_HOSTNAMES_FORCE,
 	REIMPORT_ALIASCLIENTS,
 	PARSE_NEIGHBOR_CACHE,
+	RESOLVE_NEIGHBORS,
 	EVENTS_MAX
 } __attribute__ ((packed));
 
+// Shared-memory hash indices used for fast lookups of otherwise linearly
+// scanned shared memory structs
+enum hash_table {
+	DOMAINS_HASH,
+	CLIENTS_HASH,
+	DNS_CACHE_HASH,
+	QUERIES_HASH,
+	STRINGS_HASH,
+	CLIENT_OVERTIME_HASH,
+	HASH_TABLES
+} __attribute__ ((packed));
+
 enum refresh_hostnames {
 	REFRESH_ALL,
 	REFRESH_IPV4_ONLY,
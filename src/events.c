@@ -18,6 +18,11 @@
 #include "config.h"
 // logg()
 #include "log.h"
+// SYS_futex
+#include <sys/syscall.h>
+#include <linux/futex.h>
+// INT_MAX
+#include <limits.h>
 
 // Private prototypes
 static const char *eventtext(const enum events event);
@@ -25,6 +30,12 @@ static const char *eventtext(const enum events event);
 // Queue containing all possible events
 static volatile atomic_flag eventqueue[EVENTS_MAX] = { ATOMIC_FLAG_INIT };
 
+// Sequence number which is increased whenever a new event is set. Threads
+// waiting for events sleep on this value (futex) so they are woken up
+// immediately instead of having to poll the queue periodically
+static atomic_uint event_seq = 0u;
+_Static_assert(sizeof(event_seq) == sizeof(uint32_t), "futex word has to be 32 bit");
+
 // Set/Request event
 // We set the events atomically to ensure no race collisons can happen. If an
 // event has already been requested, this has no consequences as event cannot be
@@ -36,6 +47,14 @@ void _set_event(const enum events event, int line, const char *function, const c
 	if(atomic_flag_test_and_set(&eventqueue[event]))
 		is_set = true;
 
+	// Wake up all waiting threads if this is a new event. The futex syscall
+	// is async-signal-safe so this can be used from signal handlers
+	if(!is_set)
+	{
+		atomic_fetch_add(&event_seq, 1u);
+		syscall(SYS_futex, (void*)&event_seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+	}
+
 	// Possible debug logging
 	if(config.debug & DEBUG_EVENTS)
 	{
@@ -81,6 +100,31 @@ bool _get_and_clear_event(const enum events event, int line, const char *functio
 	return is_set;
 }
 
+// Get the current event sequence number. This has to be obtained before
+// processing events and passed to wait_for_event() afterwards so that no event
+// set in between is missed
+unsigned int event_sequence(void)
+{
+	return atomic_load(&event_seq);
+}
+
+// Sleep until an event is set or the timeout expires, whichever comes first.
+// Returns immediately if an event has been set since seq was obtained
+void wait_for_event(const unsigned int seq, const int timeout_ms)
+{
+	if(timeout_ms <= 0)
+		return;
+
+	struct timespec timeout;
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+	// The kernel compares the futex word atomically with seq before
+	// sleeping. Spurious wake-ups (e.g., caused by signals) are harmless as
+	// callers check their events and deadlines before waiting again
+	syscall(SYS_futex, (void*)&event_seq, FUTEX_WAIT_PRIVATE, seq, &timeout, NULL, 0);
+}
+
 // Output human-readable version event text representation
 static const char *eventtext(const enum events event)
 {
@@ -100,6 +144,8 @@ static const char *eventtext(const enum events event)
 			return "PARSE_NEIGHBOR_CACHE";
 		case RESOLVE_NEW_HOSTNAMES:
 			return "RESOLVE_NEW_HOSTNAMES";
+		case RESOLVE_NEIGHBORS:
+			return "RESOLVE_NEIGHBORS";
 		case EVENTS_MAX: // fall through
 		default:
 			return "UNKNOWN";
@@ -18,5 +18,7 @@
 void _set_event(const enum events event, int line, const char *function, const char *file);
 #define get_and_clear_event(event) _get_and_clear_event(event, __LINE__, __FUNCTION__, __FILE__)
 bool _get_and_clear_event(const enum events event, int line, const char *function, const char *file);
+unsigned int event_sequence(void);
+void wait_for_event(const unsigned int seq, const int timeout_ms);
 
 #endif // EVENTS_H
\ No newline at end of file
@@ -20,222 +20,298 @@
 #include "signals.h"
 // data getter functions
 #include "datastructure.h"
+// publish_stats_snapshot()
+#include "snapshot.h"
+// sched_run()
+#include "scheduler.h"
+// lockstats_now()
+#include "lockstats.h"
+// INT_MAX
+#include <limits.h>
 
 bool doGC = false;
 
-static void reset_rate_limiting(void)
+static void reset_rate_limiting(const time_t now)
 {
+	lock_shm();
 	for(int clientID = 0; clientID < counters->clients; clientID++)
 	{
 		clientsData *client = getClient(clientID, true);
 		if(client != NULL)
 			client->rate_limit = 0;
 	}
+	unlock_shm();
 }
 
-void *GC_thread(void *val)
+// Query IDs increase monotonically. Shift them so that the oldest query in
+// memory has ID zero again. Query slots in the ring buffer are not affected
+static void rebase_query_ids(void)
 {
-	// Set thread name
-	prctl(PR_SET_NAME,"housekeeper",0,0,0);
+	const int offset = counters->oldest_query;
+	if(config.debug & DEBUG_GC)
+		logg("Rebasing query IDs by %i", offset);
+
+	counters->oldest_query = 0;
+	counters->query_id_shift += (unsigned int)offset;
+	lastdbindex -= offset;
+	reindex_queries();
+}
 
-	// Remember when we last ran the actions
-	time_t lastGCrun = time(NULL) - time(NULL)%GCinterval;
-	time_t lastRateLimitCleaner = time(NULL);
-	while(!killed)
+// Publish statistics for lock-free API reads
+static void publish_stats(const time_t now)
+{
+	lock_shm_read();
+	publish_stats_snapshot();
+	unlock_shm_read();
+}
+
+// Expire queries older than mintime until the deadline of this slice is
+// reached. This has to be called while holding the shared memory lock. done is
+// set to true when all expired queries have been removed
+static int expire_queries(const time_t mintime, const uint64_t deadline, bool *done)
+{
+	// Process queries, starting at the oldest one
+	int removed = 0;
+	*done = true;
+	for(int queryID = counters->oldest_query; removed < counters->queries; queryID++, removed++)
 	{
-		const time_t now = time(NULL);
-		if((unsigned int)(now - lastRateLimitCleaner) >= config.rate_limit.interval)
+		// Stop when the time of this slice is used up. Checking the
+		// clock for every query would be too expensive
+		if(removed % 64 == 63 && lockstats_now() > deadline)
 		{
-			lastRateLimitCleaner = now;
-			lock_shm();
-			reset_rate_limiting();
-			unlock_shm();
+			*done = false;
+			break;
 		}
-		if(now - GCdelay - lastGCrun >= GCinterval || doGC)
-		{
-			doGC = false;
-			// Update lastGCrun timer
-			lastGCrun = now - GCdelay - (now - GCdelay)%GCinterval;
-
-			// Lock FTL's data structure, since it is likely that it will be changed here
-			// Requests should not be processed/answered when data is about to change
-			lock_shm();
-
-			// Get minimum time stamp to keep
-			time_t mintime = (now - GCdelay) - MAXLOGAGE*3600;
-
-			// Align to the start of the next hour. This will also align with
-			// the oldest overTime interval after GC is done.
-			mintime -= mintime % 3600;
-			mintime += 3600;
-
-			if(config.debug & DEBUG_GC)
-			{
-				timer_start(GC_TIMER);
-				char timestring[84] = "";
-				get_timestr(timestring, mintime, false);
-				logg("GC starting, mintime: %s (%llu)", timestring, (long long)mintime);
-			}
-
-			// Process all queries
-			int removed = 0;
-			for(long int i=0; i < counters->queries; i++)
-			{
-				queriesData* query = getQuery(i, true);
-				if(query == NULL)
-					continue;
-
-				// Test if this query is too new
-				if(query->timestamp > mintime)
-					break;
-
-				// Adjust client counter (total and overTime)
-				clientsData* client = getClient(query->clientID, true);
-				const int timeidx = query->timeidx;
-				overTime[timeidx].total--;
-				if(client != NULL)
-					change_clientcount(client, -1, 0, timeidx, -1);
 
-				// Adjust domain counter (no overTime information)
-				domainsData* domain = getDomain(query->domainID, true);
-				if(domain != NULL)
-					domain->count--;
+		queriesData* query = getQuery(queryID, true);
+		if(query == NULL)
+			continue;
 
-				// Get upstream pointer
+		// Test if this query is too new
+		if((time_t)query->timestamp > mintime)
+			break;
 
-				// Change other counters according to status of this query
-				switch(query->status)
-				{
-					case QUERY_UNKNOWN:
-						// Unknown (?)
-						counters->unknown--;
-						break;
-					case QUERY_FORWARDED: // (fall through)
-					case QUERY_RETRIED: // (fall through)
-					case QUERY_RETRIED_DNSSEC:
-						// Forwarded to an upstream DNS server
-						// Adjust counters
-						counters->forwarded--;
-						if(query->upstreamID > -1)
-						{
-							upstreamsData* upstream = getUpstream(query->upstreamID, true);
-							if(upstream != NULL)
-								upstream->count--;
-						}
-						overTime[timeidx].forwarded--;
-						break;
-					case QUERY_CACHE:
-						// Answered from local cache _or_ local config
-						counters->cached--;
-						overTime[timeidx].cached--;
-						break;
-					case QUERY_GRAVITY: // Blocked by Pi-hole's blocking lists (fall through)
-					case QUERY_BLACKLIST: // Exact blocked (fall through)
-					case QUERY_REGEX: // Regex blocked (fall through)
-					case QUERY_EXTERNAL_BLOCKED_IP: // Blocked by upstream provider (fall through)
-					case QUERY_EXTERNAL_BLOCKED_NXRA: // Blocked by upstream provider (fall through)
-					case QUERY_EXTERNAL_BLOCKED_NULL: // Blocked by upstream provider (fall through)
-					case QUERY_GRAVITY_CNAME: // Gravity domain in CNAME chain (fall through)
-					case QUERY_BLACKLIST_CNAME: // Exactly blacklisted domain in CNAME chain (fall through)
-					case QUERY_REGEX_CNAME: // Regex blacklisted domain in CNAME chain (fall through)
-						counters->blocked--;
-						overTime[timeidx].blocked--;
-						if(domain != NULL)
-							domain->blockedcount--;
-						if(client != NULL)
-							change_clientcount(client, 0, -1, -1, 0);
-						break;
-					case QUERY_IN_PROGRESS:
-						// Nothing to be done here, this was a duplicated query. It
-						// wasn't forwarded on its own to save some traffic (and
-						// reduce the attack surface for cache spoofing)
-						break;
-					case QUERY_STATUS_MAX: // fall through
-					default:
-						/* That cannot happen */
-						break;
-				}
+		// Adjust client counter (total and overTime)
+		clientsData* client = getClient(query->clientID, true);
+		const int timeidx = query->timeidx;
+		overTime[timeidx].total--;
+		if(client != NULL)
+			change_clientcount(client, -1, 0, timeidx, -1);
 
-				// Update reply counters
-				switch(query->reply)
-				{
-					case REPLY_NODATA: // NODATA(-IPv6)
-						counters->reply_NODATA--;
-						break;
-
-					case REPLY_NXDOMAIN: // NXDOMAIN
-						counters->reply_NXDOMAIN--;
-						break;
-
-					case REPLY_CNAME: // <CNAME>
-						counters->reply_CNAME--;
-						break;
-
-					case REPLY_IP: // valid IP
-						counters->reply_IP--;
-						break;
-
-					case REPLY_DOMAIN: // reverse lookup
-						counters->reply_domain--;
-						break;
-
-					case REPLY_RRNAME: // fall through
-					case REPLY_SERVFAIL: // fall through
-					case REPLY_REFUSED: // fall through
-					case REPLY_NOTIMP: // fall through
-					case REPLY_OTHER: // fall through
-					case REPLY_UNKNOWN: // fall through
-					default:
-						break;
-				}
+		// Adjust domain counter (no overTime information)
+		domainsData* domain = getDomain(query->domainID, true);
+		if(domain != NULL)
+			domain->count--;
+
+		// Get upstream pointer
 
-				// Update type counters
-				if(query->type >= TYPE_A && query->type < TYPE_MAX)
+		// Change other counters according to status of this query
+		switch(query->status)
+		{
+			case QUERY_UNKNOWN:
+				// Unknown (?)
+				counters->unknown--;
+				break;
+			case QUERY_FORWARDED: // (fall through)
+			case QUERY_RETRIED: // (fall through)
+			case QUERY_RETRIED_DNSSEC:
+				// Forwarded to an upstream DNS server
+				// Adjust counters
+				counters->forwarded--;
+				if(query->upstreamID > -1)
 				{
-					counters->querytype[query->type-1]--;
-					overTime[timeidx].querytypedata[query->type-1]--;
+					upstreamsData* upstream = getUpstream(query->upstreamID, true);
+					if(upstream != NULL)
+						upstream->count--;
 				}
+				overTime[timeidx].forwarded--;
+				break;
+			case QUERY_CACHE:
+				// Answered from local cache _or_ local config
+				counters->cached--;
+				overTime[timeidx].cached--;
+				break;
+			case QUERY_GRAVITY: // Blocked by Pi-hole's blocking lists (fall through)
+			case QUERY_BLACKLIST: // Exact blocked (fall through)
+			case QUERY_REGEX: // Regex blocked (fall through)
+			case QUERY_EXTERNAL_BLOCKED_IP: // Blocked by upstream provider (fall through)
+			case QUERY_EXTERNAL_BLOCKED_NXRA: // Blocked by upstream provider (fall through)
+			case QUERY_EXTERNAL_BLOCKED_NULL: // Blocked by upstream provider (fall through)
+			case QUERY_GRAVITY_CNAME: // Gravity domain in CNAME chain (fall through)
+			case QUERY_BLACKLIST_CNAME: // Exactly blacklisted domain in CNAME chain (fall through)
+			case QUERY_REGEX_CNAME: // Regex blacklisted domain in CNAME chain (fall through)
+				counters->blocked--;
+				overTime[timeidx].blocked--;
+				if(domain != NULL)
+					domain->blockedcount--;
+				if(client != NULL)
+					change_clientcount(client, 0, -1, -1, 0);
+				break;
+			case QUERY_IN_PROGRESS:
+				// Nothing to be done here, this was a duplicated query. It
+				// wasn't forwarded on its own to save some traffic (and
+				// reduce the attack surface for cache spoofing)
+				break;
+			case QUERY_STATUS_MAX: // fall through
+			default:
+				/* That cannot happen */
+				break;
+		}
 
-				// Count removed queries
-				removed++;
+		// Update reply counters (there is nothing to update if the
+		// details of this query are not available)
+		const queriesColdData* cold = getQueryCold(query);
+		switch(cold != NULL ? cold->reply : REPLY_UNKNOWN)
+		{
+			case REPLY_NODATA: // NODATA(-IPv6)
+				counters->reply_NODATA--;
+				break;
+
+			case REPLY_NXDOMAIN: // NXDOMAIN
+				counters->reply_NXDOMAIN--;
+				break;
+
+			case REPLY_CNAME: // <CNAME>
+				counters->reply_CNAME--;
+				break;
+
+			case REPLY_IP: // valid IP
+				counters->reply_IP--;
+				break;
+
+			case REPLY_DOMAIN: // reverse lookup
+				counters->reply_domain--;
+				break;
+
+			case REPLY_RRNAME: // fall through
+			case REPLY_SERVFAIL: // fall through
+			case REPLY_REFUSED: // fall through
+			case REPLY_NOTIMP: // fall through
+			case REPLY_OTHER: // fall through
+			case REPLY_UNKNOWN: // fall through
+			default:
+				break;
+		}
 
-			}
+		// Update type counters
+		if(query->type >= TYPE_A && query->type < TYPE_MAX)
+		{
+			counters->querytype[query->type-1]--;
+			overTime[timeidx].querytypedata[query->type-1]--;
+		}
 
-			// Only perform memory operations when we actually removed queries
-			if(removed > 0)
-			{
-				// Move memory forward to keep only what we want
-				// Note: for overlapping memory blocks, memmove() is a safer approach than memcpy()
-				// Example: (I = now invalid, X = still valid queries, F = free space)
-				//   Before: IIIIIIXXXXFF
-				//   After:  XXXXFFFFFFFF
-				memmove(getQuery(0, true), getQuery(removed, true), (counters->queries - removed)*sizeof(queriesData));
+		// Remove query from the dnsmasq ID index
+		unindex_query(queryID);
+	}
 
-				// Update queries counter
-				counters->queries -= removed;
-				// Update DB index as total number of queries reduced
-				lastdbindex -= removed;
+	// Expire removed queries by advancing the head of the ring buffer.
+	// Queries are never moved in memory, we only zero their slots
+	if(removed > 0)
+	{
+		for(int i = 0; i < removed; i++)
+			memset(getQuery(counters->oldest_query + i, false), 0, sizeof(queriesData));
 
-				// ensure remaining memory is zeroed out (marked as "F" in the above example)
-				memset(getQuery(counters->queries, true), 0, (counters->queries_MAX - counters->queries)*sizeof(queriesData));
-			}
+		counters->oldest_query += removed;
+		counters->oldest_query_slot = (counters->oldest_query_slot + removed) % counters->queries_MAX;
+		counters->queries -= removed;
+	}
+
+	// Shift query IDs down before they can overflow
+	if(counters->oldest_query > INT_MAX/2)
+		rebase_query_ids();
+
+	return removed;
+}
+
+static void run_gc(const time_t now)
+{
+	// Get minimum time stamp to keep
+	time_t mintime = (now - GCdelay) - config.maxlogage;
+
+	// Align to the start of the next hour. This will also align with
+	// the oldest overTime interval after GC is done.
+	mintime -= mintime % 3600;
+	mintime += 3600;
+
+	if(config.debug & DEBUG_GC)
+	{
+		timer_start(GC_TIMER);
+		char timestring[84] = "";
+		get_timestr(timestring, mintime, false);
+		logg("GC starting, mintime: %s (%llu)", timestring, (long long)mintime);
+	}
+
+	// Expire queries in short slices so that the lock is never held for
+	// long and DNS queries and API requests can be processed in between
+	int removed = 0;
+	unsigned int slices = 0;
+	uint64_t slice_max = 0u, slice_total = 0u;
+	bool done = false;
+	while(!done && !killed)
+	{
+		// Lock FTL's data structure, since it is likely that it will be changed here
+		// Requests should not be processed/answered when data is about to change
+		lock_shm();
+		const uint64_t start = lockstats_now();
+		removed += expire_queries(mintime, start + GC_SLICE_USEC, &done);
+		const uint64_t took = lockstats_now() - start;
+		unlock_shm();
+
+		slices++;
+		slice_total += took;
+		if(took > slice_max)
+			slice_max = took;
+
+		if(!done)
+			sleepms(GC_SLICE_PAUSE);
+	}
+
+	// Advance overTime window, this only re-initializes the slots of
+	// intervals which dropped out of the window
+	lock_shm();
+	advanceOverTime(mintime);
+	unlock_shm();
 
-			// Determine if overTime memory needs to get moved
-			moveOverTimeMemory(mintime);
+	// Reclaim memory of strings which are no longer referenced
+	lock_shm();
+	compact_strings();
+	unlock_shm();
 
-			if(config.debug & DEBUG_GC)
-				logg("Notice: GC removed %i queries (took %.2f ms)", removed, timer_elapsed_msec(GC_TIMER));
+	if(config.debug & DEBUG_GC)
+	{
+		logg("Notice: GC removed %i queries in %u slices (took %.2f ms, locked %.2f ms, longest slice %.2f ms)",
+		     removed, slices, timer_elapsed_msec(GC_TIMER), 1e-3*slice_total, 1e-3*slice_max);
+	}
+
+	// After storing data in the database for the next time,
+	// we should scan for old entries, which will then be deleted
+	// to free up pages in the database and prevent it from growing
+	// ever larger and larger
+	DBdeleteoldqueries = true;
+}
+
+void *GC_thread(void *val)
+{
+	// Set thread name
+	prctl(PR_SET_NAME,"housekeeper",0,0,0);
 
-			// Release thread lock
-			unlock_shm();
+	scheduler sched;
+	schedJob stats_job, rate_limit_job, gc_job;
+	sched_init(&sched, "housekeeper");
+	sched_add(&sched, &stats_job, "statistics", publish_stats, 1, 0, 0);
+	sched_add(&sched, &rate_limit_job, "rate-limit", reset_rate_limiting, config.rate_limit.interval, 0, 0);
+	sched_add(&sched, &gc_job, "GC", run_gc, GCinterval, GCdelay, 0);
 
-			// After storing data in the database for the next time,
-			// we should scan for old entries, which will then be deleted
-			// to free up pages in the database and prevent it from growing
-			// ever larger and larger
-			DBdeleteoldqueries = true;
+	while(!killed)
+	{
+		if(doGC)
+		{
+			doGC = false;
+			run_gc(time(NULL));
 		}
-		sleepms(100);
+
+		// Run due jobs and sleep until the next one is due
+		sleepms(sched_run(&sched));
 	}
 
 	return NULL;
@@ -0,0 +1,143 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Lock contention statistics
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "lockstats.h"
+// create_shm(), hashStr()
+#include "shmem.h"
+
+// Statistics are stored in shared memory so that all forks and threads
+// contribute to them. The object is created in init_shmem()
+lockStatsData *lockStats = NULL;
+
+// Monotonic time in microseconds
+uint64_t lockstats_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000;
+}
+
+// Get the histogram bucket for a given duration
+static unsigned int __attribute__((const)) bucket(uint64_t usec)
+{
+	unsigned int i = 0;
+	while(usec > 0 && i < LOCKSTATS_BUCKETS - 1)
+	{
+		usec >>= 1;
+		i++;
+	}
+	return i;
+}
+
+// Find (or add) the statistics record of a call site. This has to be called
+// while holding the shared memory mutex. Returns -1 if the table is full
+int lockstats_site(const char *func, const char *file, const int line)
+{
+	if(lockStats == NULL)
+		return -1;
+
+	// Strip the directory from the file name
+	const char *base = strrchr(file, '/');
+	base = base != NULL ? base + 1 : file;
+
+	// Open addressing with linear probing
+	unsigned int i = (hashStr(base) ^ (uint32_t)line * 2654435761u) & (LOCKSTATS_SITES - 1);
+	for(unsigned int probe = 0; probe < LOCKSTATS_SITES; probe++, i = (i + 1) & (LOCKSTATS_SITES - 1))
+	{
+		lockSiteStats *site = &lockStats->site[i];
+		if(site->line == line && strncmp(site->file, base, sizeof(site->file) - 1) == 0)
+			return i;
+
+		if(site->line == 0)
+		{
+			// Empty record, claim it for this call site
+			strncpy(site->func, func, sizeof(site->func) - 1);
+			strncpy(site->file, base, sizeof(site->file) - 1);
+			site->line = line;
+			lockStats->sites++;
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+// Record time spent waiting for the lock at a call site. Returns the current
+// time which is where holding the lock starts
+uint64_t lockstats_wait(const int site, const uint64_t start)
+{
+	const uint64_t now = lockstats_now();
+	if(lockStats == NULL || site < 0)
+		return now;
+
+	const uint64_t usec = now - start;
+	lockSiteStats *stats = &lockStats->site[site];
+	stats->count++;
+	stats->wait_total += usec;
+	if(usec > stats->wait_max)
+		stats->wait_max = usec;
+	stats->wait_hist[bucket(usec)]++;
+
+	return now;
+}
+
+// Record time the lock was held after being obtained at a call site
+void lockstats_hold(const int site, const uint64_t start)
+{
+	if(lockStats == NULL || site < 0)
+		return;
+
+	const uint64_t usec = lockstats_now() - start;
+	lockSiteStats *stats = &lockStats->site[site];
+	stats->hold_total += usec;
+	if(usec > stats->hold_max)
+		stats->hold_max = usec;
+	stats->hold_hist[bucket(usec)]++;
+}
+
+// Print statistics of a running FTL instance
+int lockstats_cli(void)
+{
+	SharedMemory shm = create_shm(SHARED_LOCKSTATS_NAME, sizeof(lockStatsData), false);
+	if(shm.ptr == NULL)
+	{
+		printf("Cannot access lock statistics, is pihole-FTL running?\n");
+		return EXIT_FAILURE;
+	}
+	const lockStatsData *stats = shm.ptr;
+
+	printf("%-31s %-31s %8s %10s %10s %10s %10s\n",
+	       "Function", "Location", "Count", "Wait [us]", "Max [us]", "Hold [us]", "Max [us]");
+	for(unsigned int i = 0; i < LOCKSTATS_SITES; i++)
+	{
+		const lockSiteStats *site = &stats->site[i];
+		if(site->line == 0)
+			continue;
+
+		char location[48];
+		snprintf(location, sizeof(location), "%s:%i", site->file, site->line);
+		printf("%-31s %-31s %8u %10llu %10u %10llu %10u\n",
+		       site->func, location, site->count,
+		       (unsigned long long)site->wait_total, site->wait_max,
+		       (unsigned long long)site->hold_total, site->hold_max);
+
+		printf("  wait:");
+		for(unsigned int j = 0; j < LOCKSTATS_BUCKETS; j++)
+			printf(" %u", site->wait_hist[j]);
+		printf("\n  hold:");
+		for(unsigned int j = 0; j < LOCKSTATS_BUCKETS; j++)
+			printf(" %u", site->hold_hist[j]);
+		printf("\n");
+	}
+
+	munmap(shm.ptr, shm.size);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,56 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Lock contention statistics prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef LOCKSTATS_H
+#define LOCKSTATS_H
+
+#include <stdint.h>
+
+// assert_sizeof
+#include "static_assert.h"
+
+// Name of the shared memory object holding the statistics
+#define SHARED_LOCKSTATS_NAME "FTL-lockstats"
+
+// Maximum number of distinct call sites of lock_shm() and friends (power of two)
+#define LOCKSTATS_SITES 256
+
+// Number of histogram buckets. Bucket 0 counts durations below one microsecond,
+// bucket i counts durations in [2^(i-1), 2^i) microseconds. The last bucket also
+// holds all longer durations (more than four seconds)
+#define LOCKSTATS_BUCKETS 24
+
+typedef struct {
+	char func[32];
+	char file[32];
+	int line;
+	unsigned int count;
+	uint64_t wait_total; // [us]
+	uint64_t hold_total; // [us]
+	uint32_t wait_max; // [us]
+	uint32_t hold_max; // [us]
+	uint32_t wait_hist[LOCKSTATS_BUCKETS];
+	uint32_t hold_hist[LOCKSTATS_BUCKETS];
+} lockSiteStats;
+ASSERT_SIZEOF(lockSiteStats, 288, 288, 288);
+
+typedef struct {
+	unsigned int sites;
+	lockSiteStats site[LOCKSTATS_SITES];
+} lockStatsData;
+
+extern lockStatsData *lockStats;
+
+uint64_t lockstats_now(void);
+int lockstats_site(const char *func, const char *file, const int line);
+uint64_t lockstats_wait(const int site, const uint64_t start);
+void lockstats_hold(const int site, const uint64_t start);
+int lockstats_cli(void);
+
+#endif //LOCKSTATS_H
@@ -56,6 +56,11 @@ int main (int argc, char* argv[])
 	// We handle real-time signals later (after dnsmasq has forked)
 	handle_SIGSEGV();
 
+	// Process pihole-FTL.conf
+	// This has to happen before initializing shared memory as the size of
+	// some shared memory objects depends on the configured MAXLOGAGE
+	read_FTLconf();
+
 	// Initialize shared memory
 	if(!init_shmem(true))
 	{
@@ -64,9 +69,6 @@ int main (int argc, char* argv[])
 		return EXIT_FAILURE;
 	}
 
-	// Process pihole-FTL.conf
-	read_FTLconf();
-
 	// pihole-FTL should really be run as user "pihole" to not mess up with file permissions
 	// print warning otherwise
 	if(strcmp(username, "pihole") != 0)
@@ -99,9 +101,7 @@ int main (int argc, char* argv[])
 	logg("Shutting down...");
 
 	// Cancel active threads as we don't need them any more
-	if(ipv4telnet) pthread_cancel(telnet_listenthreadv4);
-	if(ipv6telnet) pthread_cancel(telnet_listenthreadv6);
-	pthread_cancel(socket_listenthread);
+	pthread_cancel(api_listenthread);
 
 	// Save new queries to database (if database is used)
 	if(config.DBexport)
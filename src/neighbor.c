@@ -0,0 +1,350 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Asynchronous MAC address resolution
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "neighbor.h"
+// lock_shm(), getClient()
+#include "shmem.h"
+// struct config
+#include "config.h"
+// logg()
+#include "log.h"
+// killed
+#include "signals.h"
+// set_event()
+#include "events.h"
+// sched_run()
+#include "scheduler.h"
+// gravityDB_reload_groups(), lock_lists_write()
+#include "database/gravity-db.h"
+// prctl()
+#include <sys/prctl.h>
+// Netlink interface
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/neighbour.h>
+
+// First attribute of a neighbor message (NDA_RTA() is not exported by all
+// versions of the kernel headers)
+#define NEIGH_RTA(r) ((struct rtattr*)(void*)(((char*)(r)) + NLMSG_ALIGN(sizeof(struct ndmsg))))
+
+typedef struct {
+	struct in6_addr addr; // IPv4 addresses are stored as IPv4-mapped addresses
+	unsigned char hwlen;
+	unsigned char hwaddr[16];
+} neighborEntry;
+
+typedef struct {
+	int clientID;
+	struct in6_addr addr;
+} pendingClient;
+
+// Queue a client for asynchronous MAC address resolution. This has to be called
+// while holding the shared memory lock. The client is marked in shared memory
+// so that clients queued by forks are picked up as well
+void queue_neighbor_lookup(clientsData *client)
+{
+	if(client->flags.mac_pending || client->flags.mac_checks >= NEIGHBOR_CHECKS)
+		return;
+
+	client->flags.mac_pending = true;
+	set_event(RESOLVE_NEIGHBORS);
+}
+
+// Add an entry to a dynamically growing array
+static bool add_neighbor(neighborEntry **neigh, unsigned int *num, unsigned int *size,
+                         const struct in6_addr *addr, const unsigned char *hwaddr,
+                         const unsigned int hwlen)
+{
+	if(*num == *size)
+	{
+		const unsigned int new_size = *size > 0u ? 2u * *size : 64u;
+		neighborEntry *new_neigh = realloc(*neigh, new_size * sizeof(neighborEntry));
+		if(new_neigh == NULL)
+			return false;
+		*neigh = new_neigh;
+		*size = new_size;
+	}
+
+	neighborEntry *entry = &(*neigh)[(*num)++];
+	entry->addr = *addr;
+	entry->hwlen = hwlen < sizeof(entry->hwaddr) ? hwlen : sizeof(entry->hwaddr);
+	memcpy(entry->hwaddr, hwaddr, entry->hwlen);
+	return true;
+}
+
+// Dump the kernel's neighbor cache (ARP and NDP) using a netlink RTM_GETNEIGH
+// request. Returns the number of entries or -1 on error
+static int dump_neighbors(neighborEntry **neigh)
+{
+	static unsigned int seq = 0u;
+	unsigned int num = 0u, size = 0u;
+	*neigh = NULL;
+
+	const int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if(fd < 0)
+	{
+		logg("WARN: Cannot open netlink socket: %s", strerror(errno));
+		return -1;
+	}
+
+	struct {
+		struct nlmsghdr nlh;
+		struct ndmsg ndm;
+	} req;
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ndmsg));
+	req.nlh.nlmsg_type = RTM_GETNEIGH;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nlh.nlmsg_seq = ++seq;
+	req.ndm.ndm_family = AF_UNSPEC;
+
+	if(send(fd, &req, req.nlh.nlmsg_len, 0) < 0)
+	{
+		logg("WARN: Cannot request neighbor cache: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	union {
+		struct nlmsghdr nlh;
+		char buf[8192];
+	} buffer;
+	bool done = false, success = true;
+	while(!done && success)
+	{
+		ssize_t len = recv(fd, &buffer, sizeof(buffer), 0);
+		if(len < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			logg("WARN: Cannot read neighbor cache: %s", strerror(errno));
+			success = false;
+			break;
+		}
+
+		for(struct nlmsghdr *nlh = &buffer.nlh;
+		    NLMSG_OK(nlh, (size_t)len); nlh = NLMSG_NEXT(nlh, len))
+		{
+			// Skip replies to earlier (possibly interrupted) requests
+			if(nlh->nlmsg_seq != seq)
+				continue;
+
+			if(nlh->nlmsg_type == NLMSG_DONE)
+			{
+				done = true;
+				break;
+			}
+			else if(nlh->nlmsg_type == NLMSG_ERROR)
+			{
+				logg("WARN: Netlink error while reading neighbor cache");
+				success = false;
+				break;
+			}
+			else if(nlh->nlmsg_type != RTM_NEWNEIGH)
+				continue;
+
+			// Skip entries without a (valid) hardware address
+			const struct ndmsg *ndm = NLMSG_DATA(nlh);
+			if(ndm->ndm_state & (NUD_INCOMPLETE | NUD_FAILED | NUD_NOARP))
+				continue;
+
+			struct in6_addr addr;
+			const unsigned char *hwaddr = NULL;
+			unsigned int hwlen = 0u;
+			bool have_addr = false;
+			int attrlen = NLMSG_PAYLOAD(nlh, sizeof(struct ndmsg));
+			for(struct rtattr *rta = NEIGH_RTA(ndm); RTA_OK(rta, attrlen); rta = RTA_NEXT(rta, attrlen))
+			{
+				if(rta->rta_type == NDA_DST && ndm->ndm_family == AF_INET &&
+				   RTA_PAYLOAD(rta) == sizeof(struct in_addr))
+				{
+					mapIPv4(&addr, RTA_DATA(rta));
+					have_addr = true;
+				}
+				else if(rta->rta_type == NDA_DST && ndm->ndm_family == AF_INET6 &&
+				        RTA_PAYLOAD(rta) == sizeof(struct in6_addr))
+				{
+					memcpy(&addr, RTA_DATA(rta), sizeof(addr));
+					have_addr = true;
+				}
+				else if(rta->rta_type == NDA_LLADDR)
+				{
+					hwaddr = RTA_DATA(rta);
+					hwlen = RTA_PAYLOAD(rta);
+				}
+			}
+
+			if(have_addr && hwlen > 0u &&
+			   !add_neighbor(neigh, &num, &size, &addr, hwaddr, hwlen))
+			{
+				logg("WARN: No memory available for neighbor cache");
+				success = false;
+				break;
+			}
+		}
+	}
+
+	close(fd);
+
+	if(!success)
+	{
+		free(*neigh);
+		*neigh = NULL;
+		return -1;
+	}
+
+	return num;
+}
+
+// Look up all clients queued for MAC address resolution in the kernel's
+// neighbor cache. The neighbor cache is read without holding the lock
+static void resolve_neighbors(const time_t now)
+{
+	// Collect queued clients
+	pendingClient *pending = NULL;
+	unsigned int npending = 0u;
+	lock_shm();
+	for(int clientID = 0; clientID < counters->clients; clientID++)
+	{
+		const clientsData *client = getClient(clientID, true);
+		if(client == NULL || !client->flags.mac_pending)
+			continue;
+
+		pendingClient *new_pending = realloc(pending, (npending + 1u) * sizeof(pendingClient));
+		if(new_pending == NULL)
+			break;
+		pending = new_pending;
+		pending[npending].clientID = clientID;
+		pending[npending].addr = client->addr;
+		npending++;
+	}
+	unlock_shm();
+
+	if(npending == 0u)
+		return;
+
+	// Read the kernel's neighbor cache
+	neighborEntry *neigh = NULL;
+	const int nneigh = dump_neighbors(&neigh);
+	if(nneigh < 0)
+	{
+		// Try again next time without counting this as check
+		free(pending);
+		return;
+	}
+
+	// Store results
+	bool lists_locked = false;
+	lock_shm();
+	for(unsigned int i = 0u; i < npending; i++)
+	{
+		clientsData *client = getClient(pending[i].clientID, true);
+		if(client == NULL || !client->flags.mac_pending)
+			continue;
+
+		// The MAC address may have been found elsewhere in the meantime
+		// (e.g. from EDNS(0) information)
+		if(client->hwlen > 0)
+		{
+			client->flags.mac_pending = false;
+			continue;
+		}
+
+		const neighborEntry *entry = NULL;
+		for(int j = 0; j < nneigh; j++)
+		{
+			if(memcmp(&neigh[j].addr, &pending[i].addr, sizeof(neigh[j].addr)) == 0)
+			{
+				entry = &neigh[j];
+				break;
+			}
+		}
+
+		if(entry == NULL)
+		{
+			// Give up after too many unsuccessful checks (e.g. client
+			// behind a router)
+			client->flags.mac_checks++;
+			if(client->flags.mac_checks >= NEIGHBOR_CHECKS)
+				client->flags.mac_pending = false;
+
+			if(config.debug & DEBUG_ARP)
+				logg("Client %s not found in neighbor cache (%u%s check)",
+				     getstr(client->ippos), client->flags.mac_checks,
+				     client->flags.mac_pending ? "" : ", giving up");
+			continue;
+		}
+
+		memcpy(client->hwaddr, entry->hwaddr, entry->hwlen);
+		client->hwlen = entry->hwlen;
+		client->flags.mac_pending = false;
+
+		if(config.debug & DEBUG_ARP)
+		{
+			if(client->hwlen == 6)
+				logg("Neighbor cache returned hardware address "
+				     "%02X:%02X:%02X:%02X:%02X:%02X for client %s",
+				     client->hwaddr[0], client->hwaddr[1], client->hwaddr[2],
+				     client->hwaddr[3], client->hwaddr[4], client->hwaddr[5],
+				     getstr(client->ippos));
+			else
+				logg("Neighbor cache returned %i bytes of data for client %s",
+				     client->hwlen, getstr(client->ippos));
+		}
+
+		// The groups of this client may depend on its MAC address. The
+		// list statements may be in use by lookups running without the
+		// shared memory lock so we have to lock the lists, too
+		if(!lists_locked)
+		{
+			lock_lists_write();
+			lists_locked = true;
+		}
+		gravityDB_reload_groups(client);
+	}
+	if(lists_locked)
+		unlock_lists();
+	unlock_shm();
+
+	free(neigh);
+	free(pending);
+}
+
+void *neighbor_thread(void *val)
+{
+	// Set thread name
+	prctl(PR_SET_NAME, "neighbor", 0, 0, 0);
+
+	// Check clients queued by forks or not found the last time periodically
+	scheduler sched;
+	schedJob neighbor_job;
+	sched_init(&sched, "neighbor");
+	sched_add(&sched, &neighbor_job, "neighbors", resolve_neighbors, NEIGHBOR_INTERVAL, 0, 0);
+
+	while(!killed)
+	{
+		// Get event sequence before processing events so that we do not
+		// miss events set while we are busy
+		const unsigned int seq = event_sequence();
+
+		// Run immediately when new clients have been queued
+		if(get_and_clear_event(RESOLVE_NEIGHBORS))
+			resolve_neighbors(time(NULL));
+
+		// Run due jobs
+		const int timeout = sched_run(&sched);
+
+		// Sleep until the next periodic run or a new event is set
+		wait_for_event(seq, timeout);
+	}
+
+	return NULL;
+}
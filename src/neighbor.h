@@ -0,0 +1,27 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Asynchronous MAC address resolution prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef NEIGHBOR_H
+#define NEIGHBOR_H
+
+// clientsData
+#include "datastructure.h"
+
+// How often (in seconds) the kernel's neighbor cache is checked again for
+// clients whose MAC address is still unknown
+#define NEIGHBOR_INTERVAL 10
+
+// Number of times we look for the MAC address of a client before giving up
+// (e.g. for clients behind a router). Has to fit into client->flags.mac_checks
+#define NEIGHBOR_CHECKS 15
+
+void queue_neighbor_lookup(clientsData *client);
+void *neighbor_thread(void *val);
+
+#endif //NEIGHBOR_H
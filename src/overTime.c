@@ -46,17 +46,23 @@ static void initSlot(const unsigned int index, const time_t timestamp)
 		overTime[index].querytypedata[queryType] = 0;
 	}
 
-	// Zero overTime counter for all known clients
-	for(int clientID = 0; clientID < counters->clients; clientID++)
-	{
-		// Get client pointer
-		clientsData* client = getClient(clientID, true);
-		if(client != NULL)
-		{
-			// Set overTime data to zero
-			client->overTime[index] = 0;
-		}
-	}
+	// Release overTime counters of all clients in this slot
+	clear_client_overTime_slot(index);
+}
+
+// overTime is a ring of absolute slots: the interval containing a given
+// timestamp is always stored in the same slot. Advancing time only requires
+// initializing the slots rolling over into the covered time window, neither
+// queries nor clients need to be touched
+static unsigned int __attribute__((const)) absoluteSlot(const time_t timestamp)
+{
+	return (unsigned int)((timestamp / OVERTIME_INTERVAL) % OVERTIME_SLOTS);
+}
+
+// Timestamps of overTime slots are centered in their interval
+static time_t __attribute__((const)) centerTimestamp(const time_t timestamp)
+{
+	return timestamp - timestamp % OVERTIME_INTERVAL + OVERTIME_INTERVAL / 2;
 }
 
 void initOverTime(void)
@@ -64,137 +70,89 @@ void initOverTime(void)
 	// Get current timestamp
 	time_t now = time(NULL);
 
-	// The last timestamp (overTime[149]) should be the last interval of this hour
+	// The last timestamp should be the last interval of this hour
 	// If the current time is 09:35, the last interval is 09:50 - 10:00 (centered at 09:55)
-	time_t timestamp = now - now % 3600 + 3600 - (OVERTIME_INTERVAL / 2);
+	const time_t last = now - now % 3600 + 3600 - (OVERTIME_INTERVAL / 2);
+	const time_t first = last - (OVERTIME_SLOTS - 1)*OVERTIME_INTERVAL;
 
 	if(config.debug & DEBUG_OVERTIME)
 		logg("initOverTime(): Initializing %i slots from %llu to %llu",
-		     OVERTIME_SLOTS,
-		     (long long)timestamp-OVERTIME_SLOTS*OVERTIME_INTERVAL,
-		     (long long)timestamp);
+		     OVERTIME_SLOTS, (long long)first, (long long)last);
 
 	// Iterate over overTime
-	for(int i = OVERTIME_SLOTS-1; i >= 0 ; i--)
-	{
-		// Initialize onerTime slot
-		initSlot(i, timestamp);
-		// Prepare for next iteration
-		timestamp -= OVERTIME_INTERVAL;
-	}
+	for(time_t timestamp = first; timestamp <= last; timestamp += OVERTIME_INTERVAL)
+		initSlot(absoluteSlot(timestamp), timestamp);
+
+	counters->overTime_first = absoluteSlot(first);
 }
 
 unsigned int getOverTimeID(time_t timestamp)
 {
 	// Center timestamp in OVERTIME_INTERVAL
-	timestamp -= timestamp % OVERTIME_INTERVAL;
-	timestamp += OVERTIME_INTERVAL/2;
-
-	// Get timestamp of first interval
-	const time_t firstTimestamp = overTime[0].timestamp;
+	timestamp = centerTimestamp(timestamp);
 
-	// Compute overTime ID
-	const int id = (int) ((timestamp - firstTimestamp) / OVERTIME_INTERVAL);
+	// Get timestamps of first and last interval
+	const time_t firstTimestamp = overTime[counters->overTime_first].timestamp;
+	const time_t lastTimestamp = firstTimestamp + (OVERTIME_SLOTS - 1)*OVERTIME_INTERVAL;
 
 	// Check bounds manually
-	if(id < 0)
+	if(timestamp < firstTimestamp)
 	{
-		logg("WARN: getOverTimeID(%llu): %u is negative: %llu", (long long)timestamp, id, (long long)firstTimestamp);
-		// Return first timestamp in case negative timestamp was determined
-		return 0;
+		logg("WARN: getOverTimeID(%llu): Timestamp is before first interval: %llu", (long long)timestamp, (long long)firstTimestamp);
+		// Return first slot in case a too small timestamp was determined
+		return counters->overTime_first;
 	}
-	else if(id > OVERTIME_SLOTS-1)
+	else if(timestamp > lastTimestamp)
 	{
-		logg("WARN: getOverTimeID(%llu): %i is too large: %llu", (long long)timestamp, id, (long long)firstTimestamp);
-		// Return last timestamp in case a too large timestamp was determined
-		return OVERTIME_SLOTS-1;
+		logg("WARN: getOverTimeID(%llu): Timestamp is after last interval: %llu", (long long)timestamp, (long long)lastTimestamp);
+		// Return last slot in case a too large timestamp was determined
+		return absoluteSlot(lastTimestamp);
 	}
 
+	const unsigned int id = absoluteSlot(timestamp);
 	if(config.debug & DEBUG_OVERTIME)
 	{
 		// Debug output
-		logg("getOverTimeID(%llu): %i", (long long)timestamp, id);
+		logg("getOverTimeID(%llu): %u", (long long)timestamp, id);
 	}
 
-	return (unsigned int) id;
+	return id;
 }
 
-// This routine is called by garbage collection to rearrange the overTime structure for the next hour
-void moveOverTimeMemory(const time_t mintime)
+// Get the slot of the i-th interval (counted from the oldest one) of the time
+// window currently covered by overTime
+unsigned int __attribute__((pure)) getOverTimeSlot(const unsigned int i)
 {
-	const time_t oldestOverTimeIS = overTime[0].timestamp;
-	// Shift SHOULD timestamp into the future by the amount GC is running earlier
-	time_t oldestOverTimeSHOULD = mintime;
-
-	// Center in interval
-	oldestOverTimeSHOULD -= oldestOverTimeSHOULD % OVERTIME_INTERVAL;
-	oldestOverTimeSHOULD += OVERTIME_INTERVAL / 2;
+	return (counters->overTime_first + i) % OVERTIME_SLOTS;
+}
 
-	// Calculate the number of slots to be garbage collected, which is also the
-	// ID of the slot to move to the zero position
-	const unsigned int moveOverTime = (unsigned int) ((oldestOverTimeSHOULD - oldestOverTimeIS) / OVERTIME_INTERVAL);
+// This routine is called by garbage collection to advance the overTime window
+// for the next hour. Only the slots rolling over are initialized
+void advanceOverTime(const time_t mintime)
+{
+	const time_t oldFirst = overTime[counters->overTime_first].timestamp;
+	const time_t oldLast = oldFirst + (OVERTIME_SLOTS - 1)*OVERTIME_INTERVAL;
 
-	// The number of slots which will be moved (not garbage collected)
-	const unsigned int remainingSlots = OVERTIME_SLOTS - moveOverTime;
+	// Shift the window so that its oldest interval contains mintime
+	const time_t first = centerTimestamp(mintime);
+	const time_t last = first + (OVERTIME_SLOTS - 1)*OVERTIME_INTERVAL;
 
 	if(config.debug & DEBUG_OVERTIME)
 	{
-		logg("moveOverTimeMemory(): IS: %llu, SHOULD: %llu, MOVING: %u",
-		     (long long)oldestOverTimeIS, (long long)oldestOverTimeSHOULD, moveOverTime);
+		logg("advanceOverTime(): IS: %llu, SHOULD: %llu, MOVING: %lli",
+		     (long long)oldFirst, (long long)first, (long long)((first - oldFirst) / OVERTIME_INTERVAL));
 	}
 
-	// Check if the move over amount is valid. This prevents errors if the
+	// The window never moves backwards. This prevents errors if the
 	// function is called before GC is necessary.
-	if(moveOverTime > 0 && moveOverTime < OVERTIME_SLOTS)
-	{
-		// Move overTime memory
-		if(config.debug & DEBUG_OVERTIME)
-		{
-			logg("moveOverTimeMemory(): Moving overTime %u - %u to 0 - %u",
-			     moveOverTime, moveOverTime+remainingSlots, remainingSlots);
-		}
-
-		// Move overTime memory forward to update data structure
-		memmove(&overTime[0],
-		        &overTime[moveOverTime],
-		        remainingSlots*sizeof(*overTime));
-
-		// Correct time indices of queries. This is necessary because we just moved the slot this index points to
-		for(int queryID = 0; queryID < counters->queries; queryID++)
-		{
-			// Get query pointer
-			queriesData* query = getQuery(queryID, true);
-			if(query == NULL)
-				continue;
-
-			// Check if the index would become negative if we adjusted it
-			if(((int)query->timeidx - (int)moveOverTime) < 0)
-			{
-				// This should never happen, but we print a warning if it still happens
-				// We don't do anything in this case
-				logg("WARN: moveOverTimeMemory(): overTime time index correction failed (%i: %u / %u)",
-				     queryID, query->timeidx, moveOverTime);
-			}
-			else
-			{
-				query->timeidx -= moveOverTime;
-			}
-		}
-
-		// Move client-specific overTime memory
-		for(int clientID = 0; clientID < counters->clients; clientID++)
-		{
-			memmove(&(getClient(clientID, true)->overTime[0]),
-			        &(getClient(clientID, true)->overTime[moveOverTime]),
-			        remainingSlots*sizeof(int));
-		}
-
-		// Iterate over new overTime region and initialize it
-		for(unsigned int timeidx = remainingSlots; timeidx < OVERTIME_SLOTS ; timeidx++)
-		{
-			// This slot is OVERTIME_INTERVAL seconds after the previous slot
-			const time_t timestamp = overTime[timeidx-1].timestamp + OVERTIME_INTERVAL;
-			initSlot(timeidx, timestamp);
-		}
-	}
+	if(first <= oldFirst)
+		return;
+
+	// Initialize slots of the intervals newly entering the window. These
+	// are exactly the slots of the intervals leaving it
+	const time_t start = oldLast + OVERTIME_INTERVAL > first ? oldLast + OVERTIME_INTERVAL : first;
+	for(time_t timestamp = start; timestamp <= last; timestamp += OVERTIME_INTERVAL)
+		initSlot(absoluteSlot(timestamp), timestamp);
+
+	counters->overTime_first = absoluteSlot(first);
 }
@@ -19,14 +19,16 @@
 
 void initOverTime(void);
 unsigned int getOverTimeID(const time_t timestamp);
+unsigned int getOverTimeSlot(const unsigned int i) __attribute__((pure));
 
 /**
- * Move the overTime slots so the oldest interval starts with mintime. The time
- * given will be aligned to OVERTIME_INTERVAL.
+ * Advance the overTime window so the oldest interval starts with mintime. The
+ * time given will be aligned to OVERTIME_INTERVAL. Only slots rolling over are
+ * initialized, data of queries and clients is not moved.
  *
  * @param mintime The start of the oldest interval
  */
-void moveOverTimeMemory(const time_t mintime);
+void advanceOverTime(const time_t mintime);
 
 typedef struct {
 	unsigned char magic;
@@ -34,10 +36,11 @@ typedef struct {
 	int blocked;
 	int cached;
 	int forwarded;
+	int clients; // first per-client entry of this slot (index + 1)
 	time_t timestamp;
 	int querytypedata[TYPE_MAX-1];
 } overTimeData;
-ASSERT_SIZEOF(overTimeData, 96, 88, 88);
+ASSERT_SIZEOF(overTimeData, 96, 92, 92);
 
 extern overTimeData *overTime;
 
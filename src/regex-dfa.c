@@ -0,0 +1,1088 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Combined regex automaton
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "regex-dfa.h"
+// logg()
+#include "log.h"
+// hashData()
+#include "shmem.h"
+
+// All regex filters of one type which use only plain POSIX extended regular
+// expression syntax (literals, ".", bracket expressions, groups, alternation,
+// the repetition operators and the anchors "^" and "$") are combined into one
+// automaton. Filters using anything else (e.g. back-references, TRE's
+// approximate matching or macros like "\w") are not added and are still
+// matched using TRE.
+//
+// Every filter is compiled into a nondeterministic automaton (NFA) whose final
+// node tells which filter matched. All filters share one deterministic
+// automaton (DFA) which is built lazily while domains are matched: every DFA
+// state is the set of NFA nodes which are active after reading the domain so
+// far. As filters may match anywhere in the domain, the start nodes of all
+// filters are active at every position. They are not stored in the states.
+// The DFA states are cached and the cache is flushed when it becomes too
+// large. All filters matching a domain are found in a single pass over the
+// domain.
+//
+// Matching is always case-insensitive (like REG_ICASE), the domain is
+// lowercased while it is read.
+
+// Maximum memory used for cached DFA states before the cache is flushed
+#define DFA_MAX_MEMORY (4u*1024u*1024u)
+// Maximum number of NFA nodes of one filter (counted repetitions may expand
+// to many nodes), larger filters are matched using TRE
+#define RULE_MAX_NODES 4096u
+// Maximum count of counted repetitions (RE_DUP_MAX)
+#define REPEAT_MAX 255
+// Maximum nesting depth of groups
+#define MAX_DEPTH 64
+// Number of 64 bit words of a set of bytes
+#define SET_WORDS 4
+
+enum nfa_type { NFA_SET, NFA_SPLIT, NFA_EMPTY, NFA_BOL, NFA_EOL, NFA_MATCH };
+
+typedef struct {
+	uint32_t type;
+	uint32_t out;
+	// Second successor (NFA_SPLIT), set of bytes (NFA_SET) or filter (NFA_MATCH)
+	uint32_t arg;
+} nfaNode;
+
+typedef struct {
+	uint32_t *nodes; // Sorted, without start nodes
+	uint32_t num_nodes;
+	uint32_t *rules; // Filters matching when entering this state (sorted)
+	uint32_t num_rules;
+	int32_t *next; // Next state for every byte class, -1 = not known yet
+	uint32_t hash;
+} dfaState;
+
+struct regexDFA {
+	pthread_mutex_t lock;
+	// Sets of bytes, stored only once
+	uint64_t *sets;
+	uint32_t num_sets;
+	uint32_t sets_capacity;
+	uint32_t *set_index;
+	uint32_t set_index_capacity;
+	// NFA nodes of all filters and the start node of every filter
+	nfaNode *nodes;
+	uint32_t num_nodes;
+	uint32_t nodes_capacity;
+	uint32_t *roots;
+	uint32_t num_roots;
+	uint32_t roots_capacity;
+	// Built by regex_dfa_compile()
+	bool compiled;
+	uint8_t class_of[256]; // Byte class of every (lowercased) byte
+	uint8_t class_rep[256]; // A byte of every class
+	unsigned int num_classes;
+	bool *in_start; // Nodes active at every position
+	uint32_t *start_nodes;
+	uint32_t num_start_nodes;
+	uint32_t *start_rules; // Filters matching the empty string
+	uint32_t num_start_rules;
+	uint32_t *start_eot_rules; // Filters matching at the end of every domain
+	uint32_t num_start_eot_rules;
+	// Scratch space for computing states
+	uint32_t *stamp;
+	uint32_t current_stamp;
+	uint32_t *stack;
+	uint32_t *buf_nodes;
+	uint32_t *buf_rules;
+	uint32_t num_buf_nodes;
+	uint32_t num_buf_rules;
+	// Cached DFA states and a hash table of them (index + 1, 0 = empty)
+	dfaState *states;
+	uint32_t num_states;
+	uint32_t states_capacity;
+	uint32_t *state_index;
+	uint32_t state_index_capacity;
+	int32_t initial;
+	size_t memory;
+	unsigned int flushes;
+};
+
+// Parser
+
+enum ast_type { AST_EMPTY, AST_SET, AST_BOL, AST_EOL, AST_CAT, AST_ALT, AST_REPEAT };
+
+typedef struct {
+	enum ast_type type;
+	int left;
+	int right;
+	int min;
+	int max; // -1 = unbounded
+	uint32_t set;
+} astNode;
+
+typedef struct {
+	regexDFA *dfa;
+	const char *p;
+	astNode *nodes;
+	unsigned int num_nodes;
+	unsigned int capacity;
+	unsigned int depth;
+	bool error;
+} parser;
+
+regexDFA *new_regex_dfa(void)
+{
+	regexDFA *dfa = calloc(1, sizeof(regexDFA));
+	if(dfa == NULL)
+		return NULL;
+
+	pthread_mutex_init(&dfa->lock, NULL);
+	dfa->initial = -1;
+	return dfa;
+}
+
+static void flush_states(regexDFA *dfa)
+{
+	for(uint32_t i = 0; i < dfa->num_states; i++)
+	{
+		dfaState *state = &dfa->states[i];
+		if(state->nodes != NULL)
+			free(state->nodes);
+		if(state->rules != NULL)
+			free(state->rules);
+		if(state->next != NULL)
+			free(state->next);
+	}
+	dfa->num_states = 0u;
+	if(dfa->state_index != NULL)
+		memset(dfa->state_index, 0, dfa->state_index_capacity * sizeof(uint32_t));
+	dfa->initial = -1;
+	dfa->memory = 0u;
+}
+
+void free_regex_dfa(regexDFA *dfa)
+{
+	if(dfa == NULL)
+		return;
+
+	flush_states(dfa);
+	void *arrays[] = { dfa->sets, dfa->set_index, dfa->nodes, dfa->roots, dfa->in_start,
+	                   dfa->start_nodes, dfa->start_rules, dfa->start_eot_rules, dfa->stamp,
+	                   dfa->stack, dfa->buf_nodes, dfa->buf_rules, dfa->states, dfa->state_index };
+	for(size_t i = 0; i < sizeof(arrays)/sizeof(arrays[0]); i++)
+		if(arrays[i] != NULL)
+			free(arrays[i]);
+	pthread_mutex_destroy(&dfa->lock);
+	free(dfa);
+}
+
+// The lock may have been held by another thread of the parent at the time of
+// forking. This thread does not exist in the fork, the cached states it was
+// working on are discarded
+void regex_dfa_forked(regexDFA *dfa)
+{
+	if(dfa == NULL)
+		return;
+
+	if(pthread_mutex_trylock(&dfa->lock) == 0)
+	{
+		pthread_mutex_unlock(&dfa->lock);
+		return;
+	}
+	pthread_mutex_init(&dfa->lock, NULL);
+	flush_states(dfa);
+}
+
+unsigned int __attribute__((pure)) regex_dfa_rules(const regexDFA *dfa)
+{
+	return dfa != NULL ? dfa->num_roots : 0u;
+}
+
+static inline bool set_has(const uint64_t *set, const unsigned int c)
+{
+	return set[c / 64] & (1ull << (c % 64));
+}
+
+static inline void set_add(uint64_t *set, const unsigned int c)
+{
+	set[c / 64] |= 1ull << (c % 64);
+}
+
+static inline const uint64_t *get_set(const regexDFA *dfa, const uint32_t set)
+{
+	return &dfa->sets[(size_t)set * SET_WORDS];
+}
+
+static uint32_t hash_words(const uint32_t *words, const size_t num)
+{
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < num; i++)
+	{
+		hash ^= words[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static bool resize_set_index(regexDFA *dfa)
+{
+	const uint32_t capacity = dfa->set_index_capacity > 0 ? 2u * dfa->set_index_capacity : 256u;
+	uint32_t *index = calloc(capacity, sizeof(uint32_t));
+	if(index == NULL)
+		return false;
+
+	for(uint32_t set = 0; set < dfa->num_sets; set++)
+	{
+		uint32_t i = hashData(get_set(dfa, set), SET_WORDS * sizeof(uint64_t)) & (capacity - 1);
+		while(index[i] != 0)
+			i = (i + 1) & (capacity - 1);
+		index[i] = set + 1;
+	}
+
+	if(dfa->set_index != NULL)
+		free(dfa->set_index);
+	dfa->set_index = index;
+	dfa->set_index_capacity = capacity;
+	return true;
+}
+
+// Get the index of a set of bytes, add it if it is not known so far. Returns
+// -1 if memory is exhausted
+static int64_t intern_set(regexDFA *dfa, const uint64_t *set)
+{
+	const size_t size = SET_WORDS * sizeof(uint64_t);
+	if(2u * (dfa->num_sets + 1u) > dfa->set_index_capacity && !resize_set_index(dfa))
+		return -1;
+
+	uint32_t i = hashData(set, size) & (dfa->set_index_capacity - 1);
+	while(dfa->set_index[i] != 0)
+	{
+		const uint32_t known = dfa->set_index[i] - 1;
+		if(memcmp(get_set(dfa, known), set, size) == 0)
+			return known;
+		i = (i + 1) & (dfa->set_index_capacity - 1);
+	}
+
+	if(dfa->num_sets == dfa->sets_capacity)
+	{
+		const uint32_t capacity = dfa->sets_capacity > 0 ? 2u * dfa->sets_capacity : 64u;
+		uint64_t *sets = realloc(dfa->sets, capacity * size);
+		if(sets == NULL)
+			return -1;
+		dfa->sets = sets;
+		dfa->sets_capacity = capacity;
+	}
+	const uint32_t new = dfa->num_sets++;
+	memcpy(&dfa->sets[(size_t)new * SET_WORDS], set, size);
+	dfa->set_index[i] = new + 1;
+	return new;
+}
+
+static int new_ast(parser *ps, const enum ast_type type, const int left, const int right)
+{
+	if(ps->error)
+		return -1;
+
+	if(ps->num_nodes == ps->capacity)
+	{
+		const unsigned int capacity = ps->capacity > 0 ? 2u * ps->capacity : 32u;
+		astNode *nodes = realloc(ps->nodes, capacity * sizeof(astNode));
+		if(nodes == NULL)
+		{
+			ps->error = true;
+			return -1;
+		}
+		ps->nodes = nodes;
+		ps->capacity = capacity;
+	}
+
+	astNode *node = &ps->nodes[ps->num_nodes];
+	memset(node, 0, sizeof(*node));
+	node->type = type;
+	node->left = left;
+	node->right = right;
+	return ps->num_nodes++;
+}
+
+// Add a set of bytes to the AST. Letters are added in both cases, negation
+// is applied afterwards (like TRE does with REG_ICASE)
+static int new_set(parser *ps, uint64_t *set, const bool negate)
+{
+	for(unsigned int c = 'a'; c <= 'z'; c++)
+	{
+		if(set_has(set, c) || set_has(set, toupper(c)))
+		{
+			set_add(set, c);
+			set_add(set, toupper(c));
+		}
+	}
+	if(negate)
+		for(unsigned int i = 0; i < SET_WORDS; i++)
+			set[i] = ~set[i];
+
+	const int64_t index = intern_set(ps->dfa, set);
+	const int node = new_ast(ps, AST_SET, -1, -1);
+	if(index < 0 || node < 0)
+	{
+		ps->error = true;
+		return -1;
+	}
+	ps->nodes[node].set = index;
+	return node;
+}
+
+// Character classes which can be used in bracket expressions
+static bool add_class(uint64_t *set, const char *name, const size_t len)
+{
+	static const struct {
+		const char *name;
+		int (*func)(int);
+	} classes[] = {
+		{ "alnum", isalnum }, { "alpha", isalpha }, { "blank", isblank },
+		{ "cntrl", iscntrl }, { "digit", isdigit }, { "graph", isgraph },
+		{ "lower", islower }, { "print", isprint }, { "punct", ispunct },
+		{ "space", isspace }, { "upper", isupper }, { "xdigit", isxdigit }
+	};
+
+	for(size_t i = 0; i < sizeof(classes)/sizeof(classes[0]); i++)
+	{
+		if(strlen(classes[i].name) != len || strncmp(classes[i].name, name, len) != 0)
+			continue;
+
+		for(unsigned int c = 0; c < 128; c++)
+			if(classes[i].func(c))
+				set_add(set, c);
+		return true;
+	}
+	return false;
+}
+
+// Parse a bracket expression, ps->p points behind the opening bracket
+static int parse_bracket(parser *ps)
+{
+	uint64_t set[SET_WORDS] = { 0 };
+	bool negate = false;
+	if(*ps->p == '^')
+	{
+		negate = true;
+		ps->p++;
+	}
+
+	// A closing bracket at the beginning is an ordinary character
+	for(bool first = true; ; first = false)
+	{
+		const unsigned char *p = (const unsigned char *)ps->p;
+		if(p[0] == '\0' || p[0] >= 0x80)
+		{
+			ps->error = true;
+			return -1;
+		}
+		else if(p[0] == ']' && !first)
+		{
+			ps->p++;
+			break;
+		}
+		else if(p[0] == '[' && (p[1] == '.' || p[1] == '='))
+		{
+			// Collating elements and equivalence classes
+			ps->error = true;
+			return -1;
+		}
+		else if(p[0] == '[' && p[1] == ':')
+		{
+			const char *end = strstr(ps->p + 2, ":]");
+			if(end == NULL || !add_class(set, ps->p + 2, end - ps->p - 2))
+			{
+				ps->error = true;
+				return -1;
+			}
+			ps->p = end + 2;
+		}
+		else if(p[1] == '-' && p[2] != ']' && p[2] != '\0')
+		{
+			// Range
+			if(p[2] >= 0x80 || p[0] > p[2] || p[0] == '[' || p[2] == '[')
+			{
+				ps->error = true;
+				return -1;
+			}
+			for(unsigned int c = p[0]; c <= p[2]; c++)
+				set_add(set, c);
+			ps->p += 3;
+		}
+		else
+		{
+			set_add(set, p[0]);
+			ps->p++;
+		}
+	}
+
+	return new_set(ps, set, negate);
+}
+
+static int parse_alt(parser *ps);
+
+static int parse_atom(parser *ps)
+{
+	const unsigned char c = *ps->p;
+	uint64_t set[SET_WORDS] = { 0 };
+	switch(c)
+	{
+		case '(':
+		{
+			// TRE extensions like "(?i)" are not supported
+			if(ps->p[1] == '?' || ++ps->depth > MAX_DEPTH)
+				break;
+			ps->p++;
+			const int node = parse_alt(ps);
+			if(*ps->p != ')')
+				break;
+			ps->p++;
+			ps->depth--;
+			return node;
+		}
+		case '[':
+			ps->p++;
+			return parse_bracket(ps);
+		case '.':
+			ps->p++;
+			return new_set(ps, set, true);
+		case '^':
+			ps->p++;
+			return new_ast(ps, AST_BOL, -1, -1);
+		case '$':
+			ps->p++;
+			return new_ast(ps, AST_EOL, -1, -1);
+		case '\\':
+		{
+			// Only escaped punctuation, TRE has special meanings for
+			// escaped letters and digits (e.g. "\w" or back-references)
+			// and "\<" and "\>" are word boundary assertions
+			const unsigned char e = ps->p[1];
+			if(e == '\0' || e >= 0x80 || isalnum(e) || e == '<' || e == '>')
+				break;
+			ps->p += 2;
+			set_add(set, e);
+			return new_set(ps, set, false);
+		}
+		case '*':
+		case '+':
+		case '?':
+		case '{':
+			// Repetition without anything to repeat
+			break;
+		default:
+			if(c >= 0x80)
+				break;
+			ps->p++;
+			set_add(set, c);
+			return new_set(ps, set, false);
+	}
+
+	ps->error = true;
+	return -1;
+}
+
+static bool parse_count(parser *ps, int *count)
+{
+	if(!isdigit((unsigned char)*ps->p))
+		return false;
+
+	*count = 0;
+	while(isdigit((unsigned char)*ps->p))
+	{
+		*count = 10 * *count + (*ps->p++ - '0');
+		if(*count > REPEAT_MAX)
+			return false;
+	}
+	return true;
+}
+
+static int parse_piece(parser *ps)
+{
+	const int atom = parse_atom(ps);
+	if(ps->error)
+		return -1;
+
+	int min = 0, max = -1;
+	switch(*ps->p)
+	{
+		case '*':
+			break;
+		case '+':
+			min = 1;
+			break;
+		case '?':
+			max = 1;
+			break;
+		case '{':
+			ps->p++;
+			if(!parse_count(ps, &min))
+			{
+				ps->error = true;
+				return -1;
+			}
+			max = min;
+			if(*ps->p == ',')
+			{
+				ps->p++;
+				max = -1;
+				if(*ps->p != '}' && (!parse_count(ps, &max) || max < min))
+				{
+					ps->error = true;
+					return -1;
+				}
+			}
+			if(*ps->p != '}')
+			{
+				ps->error = true;
+				return -1;
+			}
+			break;
+		default:
+			return atom;
+	}
+	ps->p++;
+
+	// Repeated anchors and several repetition operators in a row (TRE
+	// treats some of them specially) are left to TRE
+	const enum ast_type type = ps->nodes[atom].type;
+	if(type == AST_BOL || type == AST_EOL || (*ps->p != '\0' && strchr("*+?{", *ps->p) != NULL))
+	{
+		ps->error = true;
+		return -1;
+	}
+
+	const int node = new_ast(ps, AST_REPEAT, atom, -1);
+	if(node < 0)
+		return -1;
+	ps->nodes[node].min = min;
+	ps->nodes[node].max = max;
+	return node;
+}
+
+static int parse_cat(parser *ps)
+{
+	int node = -1;
+	while(*ps->p != '\0' && *ps->p != '|' && !ps->error)
+	{
+		// A closing parenthesis outside of a group is an ordinary
+		// character for TRE
+		if(*ps->p == ')')
+		{
+			if(ps->depth == 0)
+				ps->error = true;
+			break;
+		}
+
+		const int piece = parse_piece(ps);
+		node = node < 0 ? piece : new_ast(ps, AST_CAT, node, piece);
+	}
+
+	// Empty expressions match the empty string
+	return node < 0 ? new_ast(ps, AST_EMPTY, -1, -1) : node;
+}
+
+static int parse_alt(parser *ps)
+{
+	int node = parse_cat(ps);
+	while(*ps->p == '|' && !ps->error)
+	{
+		ps->p++;
+		const int right = parse_cat(ps);
+		node = new_ast(ps, AST_ALT, node, right);
+	}
+	return node;
+}
+
+// NFA
+
+static uint32_t new_nfa(regexDFA *dfa, const uint32_t type, const uint32_t out, const uint32_t arg, bool *okay)
+{
+	if(!*okay)
+		return 0u;
+
+	if(dfa->num_nodes == dfa->nodes_capacity)
+	{
+		const uint32_t capacity = dfa->nodes_capacity > 0 ? 2u * dfa->nodes_capacity : 1024u;
+		nfaNode *nodes = realloc(dfa->nodes, capacity * sizeof(nfaNode));
+		if(nodes == NULL)
+		{
+			*okay = false;
+			return 0u;
+		}
+		dfa->nodes = nodes;
+		dfa->nodes_capacity = capacity;
+	}
+
+	nfaNode *node = &dfa->nodes[dfa->num_nodes];
+	node->type = type;
+	node->out = out;
+	node->arg = arg;
+	return dfa->num_nodes++;
+}
+
+// Compile an AST node into NFA nodes which continue with node next. Returns
+// the first node
+static uint32_t compile_ast(regexDFA *dfa, const parser *ps, const int ast, const uint32_t next,
+                            const uint32_t first_node, bool *okay)
+{
+	if(!*okay || dfa->num_nodes - first_node > RULE_MAX_NODES)
+	{
+		*okay = false;
+		return 0u;
+	}
+
+	const astNode *node = &ps->nodes[ast];
+	switch(node->type)
+	{
+		case AST_EMPTY:
+			return next;
+		case AST_SET:
+			return new_nfa(dfa, NFA_SET, next, node->set, okay);
+		case AST_BOL:
+			return new_nfa(dfa, NFA_BOL, next, 0u, okay);
+		case AST_EOL:
+			return new_nfa(dfa, NFA_EOL, next, 0u, okay);
+		case AST_CAT:
+		{
+			const uint32_t right = compile_ast(dfa, ps, node->right, next, first_node, okay);
+			return compile_ast(dfa, ps, node->left, right, first_node, okay);
+		}
+		case AST_ALT:
+		{
+			const uint32_t left = compile_ast(dfa, ps, node->left, next, first_node, okay);
+			const uint32_t right = compile_ast(dfa, ps, node->right, next, first_node, okay);
+			return new_nfa(dfa, NFA_SPLIT, left, right, okay);
+		}
+		case AST_REPEAT:
+		{
+			uint32_t current = next;
+			int copies = node->min;
+			if(node->max < 0)
+			{
+				// Loop: either another copy or continue
+				const uint32_t loop = new_nfa(dfa, NFA_SPLIT, 0u, next, okay);
+				const uint32_t body = compile_ast(dfa, ps, node->left, loop, first_node, okay);
+				if(*okay)
+					dfa->nodes[loop].out = body;
+				// "x+" starts with the copy, "x*" with the loop
+				if(copies > 0)
+				{
+					current = body;
+					copies--;
+				}
+				else
+					current = loop;
+			}
+			else
+			{
+				// Optional copies, each of them may continue with next
+				for(int i = node->min; i < node->max; i++)
+				{
+					const uint32_t body = compile_ast(dfa, ps, node->left, current, first_node, okay);
+					current = new_nfa(dfa, NFA_SPLIT, body, next, okay);
+				}
+			}
+			// Mandatory copies
+			for(int i = 0; i < copies; i++)
+				current = compile_ast(dfa, ps, node->left, current, first_node, okay);
+			return current;
+		}
+	}
+
+	*okay = false;
+	return 0u;
+}
+
+// Add a filter. Returns false if the filter cannot be matched by the automaton
+// and has to be matched using TRE
+bool regex_dfa_add(regexDFA *dfa, const char *regex, const unsigned int rule)
+{
+	if(dfa == NULL || dfa->compiled)
+		return false;
+
+	parser ps = { .dfa = dfa, .p = regex };
+	const int root = parse_alt(&ps);
+	bool okay = !ps.error && *ps.p == '\0' && root >= 0;
+
+	const uint32_t first_node = dfa->num_nodes;
+	if(okay)
+	{
+		const uint32_t match = new_nfa(dfa, NFA_MATCH, 0u, rule, &okay);
+		const uint32_t start = compile_ast(dfa, &ps, root, match, first_node, &okay);
+
+		if(okay && dfa->num_roots == dfa->roots_capacity)
+		{
+			const uint32_t capacity = dfa->roots_capacity > 0 ? 2u * dfa->roots_capacity : 64u;
+			uint32_t *roots = realloc(dfa->roots, capacity * sizeof(uint32_t));
+			if(roots != NULL)
+			{
+				dfa->roots = roots;
+				dfa->roots_capacity = capacity;
+			}
+			else
+				okay = false;
+		}
+		if(okay)
+			dfa->roots[dfa->num_roots++] = start;
+	}
+
+	// Remove the nodes of filters which cannot be added
+	if(!okay)
+		dfa->num_nodes = first_node;
+
+	if(ps.nodes != NULL)
+		free(ps.nodes);
+
+	return okay;
+}
+
+// Follow all transitions which do not read a byte, starting at the given
+// nodes. The reached nodes which read a byte (and pending "$" anchors) which
+// are not start nodes are stored in buf_nodes, the filters matching in
+// buf_rules. Start nodes are not visited again if skip_start is true, the
+// nodes reachable from them are start nodes themselves
+static void closure(regexDFA *dfa, const uint32_t *from, const uint32_t num,
+                    const bool at_bol, const bool at_eol, const bool skip_start)
+{
+	if(++dfa->current_stamp == 0u)
+	{
+		memset(dfa->stamp, 0, dfa->num_nodes * sizeof(uint32_t));
+		dfa->current_stamp = 1u;
+	}
+	const uint32_t stamp = dfa->current_stamp;
+	uint32_t sp = 0u;
+	for(uint32_t i = 0; i < num; i++)
+		dfa->stack[sp++] = from[i];
+
+	while(sp > 0)
+	{
+		const uint32_t n = dfa->stack[--sp];
+		if(dfa->stamp[n] == stamp)
+			continue;
+		dfa->stamp[n] = stamp;
+		if(skip_start && dfa->in_start[n])
+			continue;
+
+		const nfaNode *node = &dfa->nodes[n];
+		switch(node->type)
+		{
+			case NFA_SET:
+				if(!dfa->in_start[n])
+					dfa->buf_nodes[dfa->num_buf_nodes++] = n;
+				break;
+			case NFA_EOL:
+				if(at_eol)
+					dfa->stack[sp++] = node->out;
+				else if(!dfa->in_start[n])
+					dfa->buf_nodes[dfa->num_buf_nodes++] = n;
+				break;
+			case NFA_BOL:
+				if(at_bol)
+					dfa->stack[sp++] = node->out;
+				break;
+			case NFA_SPLIT:
+				dfa->stack[sp++] = node->out;
+				dfa->stack[sp++] = node->arg;
+				break;
+			case NFA_EMPTY:
+				dfa->stack[sp++] = node->out;
+				break;
+			case NFA_MATCH:
+				dfa->buf_rules[dfa->num_buf_rules++] = node->arg;
+				break;
+		}
+	}
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+	const uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+static bool resize_state_index(regexDFA *dfa)
+{
+	const uint32_t capacity = dfa->state_index_capacity > 0 ? 2u * dfa->state_index_capacity : 256u;
+	uint32_t *index = calloc(capacity, sizeof(uint32_t));
+	if(index == NULL)
+		return false;
+
+	for(uint32_t s = 0; s < dfa->num_states; s++)
+	{
+		uint32_t i = dfa->states[s].hash & (capacity - 1);
+		while(index[i] != 0)
+			i = (i + 1) & (capacity - 1);
+		index[i] = s + 1;
+	}
+
+	if(dfa->state_index != NULL)
+		free(dfa->state_index);
+	dfa->state_index = index;
+	dfa->state_index_capacity = capacity;
+	return true;
+}
+
+// Get the state of the nodes and filters in buf_nodes and buf_rules, add it
+// if it is not known so far. The cache may be flushed when a state is added.
+// Returns -1 if memory is exhausted
+static int32_t find_state(regexDFA *dfa)
+{
+	// States are identified by their nodes and the filters which matched
+	// when they were entered
+	qsort(dfa->buf_nodes, dfa->num_buf_nodes, sizeof(uint32_t), compare_u32);
+	qsort(dfa->buf_rules, dfa->num_buf_rules, sizeof(uint32_t), compare_u32);
+	// A filter may be reached both from the start nodes and from the state
+	uint32_t num_rules = 0u;
+	for(uint32_t i = 0; i < dfa->num_buf_rules; i++)
+		if(num_rules == 0u || dfa->buf_rules[num_rules - 1] != dfa->buf_rules[i])
+			dfa->buf_rules[num_rules++] = dfa->buf_rules[i];
+	dfa->num_buf_rules = num_rules;
+	const uint32_t hash = hash_words(dfa->buf_nodes, dfa->num_buf_nodes) ^
+	                      (31u * hash_words(dfa->buf_rules, dfa->num_buf_rules));
+
+	if(dfa->state_index_capacity > 0)
+	{
+		uint32_t i = hash & (dfa->state_index_capacity - 1);
+		while(dfa->state_index[i] != 0)
+		{
+			const dfaState *state = &dfa->states[dfa->state_index[i] - 1];
+			if(state->hash == hash && state->num_nodes == dfa->num_buf_nodes &&
+			   state->num_rules == dfa->num_buf_rules &&
+			   memcmp(state->nodes, dfa->buf_nodes, dfa->num_buf_nodes * sizeof(uint32_t)) == 0 &&
+			   memcmp(state->rules, dfa->buf_rules, dfa->num_buf_rules * sizeof(uint32_t)) == 0)
+				return dfa->state_index[i] - 1;
+			i = (i + 1) & (dfa->state_index_capacity - 1);
+		}
+	}
+
+	// New state
+	const size_t size = sizeof(dfaState) + (dfa->num_buf_nodes + dfa->num_buf_rules) * sizeof(uint32_t) +
+	                    dfa->num_classes * sizeof(int32_t);
+	if(dfa->memory + size > DFA_MAX_MEMORY)
+	{
+		flush_states(dfa);
+		dfa->flushes++;
+	}
+
+	if(2u * (dfa->num_states + 1u) > dfa->state_index_capacity && !resize_state_index(dfa))
+		return -1;
+	if(dfa->num_states == dfa->states_capacity)
+	{
+		const uint32_t capacity = dfa->states_capacity > 0 ? 2u * dfa->states_capacity : 64u;
+		dfaState *states = realloc(dfa->states, capacity * sizeof(dfaState));
+		if(states == NULL)
+			return -1;
+		dfa->states = states;
+		dfa->states_capacity = capacity;
+	}
+
+	dfaState *state = &dfa->states[dfa->num_states];
+	state->hash = hash;
+	state->num_nodes = dfa->num_buf_nodes;
+	state->num_rules = dfa->num_buf_rules;
+	state->nodes = malloc((dfa->num_buf_nodes + 1u) * sizeof(uint32_t));
+	state->rules = malloc((dfa->num_buf_rules + 1u) * sizeof(uint32_t));
+	state->next = malloc(dfa->num_classes * sizeof(int32_t));
+	if(state->nodes == NULL || state->rules == NULL || state->next == NULL)
+	{
+		if(state->nodes != NULL)
+			free(state->nodes);
+		if(state->rules != NULL)
+			free(state->rules);
+		if(state->next != NULL)
+			free(state->next);
+		return -1;
+	}
+	memcpy(state->nodes, dfa->buf_nodes, dfa->num_buf_nodes * sizeof(uint32_t));
+	memcpy(state->rules, dfa->buf_rules, dfa->num_buf_rules * sizeof(uint32_t));
+	memset(state->next, 0xff, dfa->num_classes * sizeof(int32_t));
+	dfa->memory += size;
+
+	uint32_t i = hash & (dfa->state_index_capacity - 1);
+	while(dfa->state_index[i] != 0)
+		i = (i + 1) & (dfa->state_index_capacity - 1);
+	dfa->state_index[i] = dfa->num_states + 1;
+
+	return dfa->num_states++;
+}
+
+static int32_t initial_state(regexDFA *dfa)
+{
+	if(dfa->initial < 0)
+	{
+		dfa->num_buf_nodes = dfa->num_buf_rules = 0u;
+		closure(dfa, dfa->roots, dfa->num_roots, true, false, false);
+		dfa->initial = find_state(dfa);
+	}
+	return dfa->initial;
+}
+
+// Compute the state after reading a byte of the given class
+static int32_t next_state(regexDFA *dfa, const int32_t current, const unsigned int class)
+{
+	const unsigned int c = dfa->class_rep[class];
+	uint32_t num = 0u;
+
+	// The successors of the current state and of the start nodes are
+	// collected in buf_rules first, closure() copies them before it
+	// writes buf_rules
+	const dfaState *state = &dfa->states[current];
+	uint32_t *targets = dfa->buf_rules;
+	for(uint32_t i = 0; i < state->num_nodes; i++)
+	{
+		const nfaNode *node = &dfa->nodes[state->nodes[i]];
+		if(node->type == NFA_SET && set_has(get_set(dfa, node->arg), c))
+			targets[num++] = node->out;
+	}
+	for(uint32_t i = 0; i < dfa->num_start_nodes; i++)
+	{
+		const nfaNode *node = &dfa->nodes[dfa->start_nodes[i]];
+		if(node->type == NFA_SET && set_has(get_set(dfa, node->arg), c))
+			targets[num++] = node->out;
+	}
+
+	dfa->num_buf_nodes = dfa->num_buf_rules = 0u;
+	closure(dfa, targets, num, false, false, true);
+	// Filters matching the empty string match everywhere
+	memcpy(dfa->buf_rules + dfa->num_buf_rules, dfa->start_rules, dfa->num_start_rules * sizeof(uint32_t));
+	dfa->num_buf_rules += dfa->num_start_rules;
+
+	// The current state is gone if the cache is flushed
+	const unsigned int flushes = dfa->flushes;
+	const int32_t next = find_state(dfa);
+	if(next >= 0 && dfa->flushes == flushes)
+		dfa->states[current].next[class] = next;
+	return next;
+}
+
+// Prepare the automaton after all filters have been added. Returns false if the
+// automaton cannot be used
+bool regex_dfa_compile(regexDFA *dfa)
+{
+	if(dfa == NULL || dfa->num_roots == 0)
+		return false;
+
+	// Divide the bytes into classes which are in the same sets. The
+	// automaton only needs to know the class of a byte
+	uint8_t class[256] = { 0 };
+	unsigned int num_classes = 1u;
+	for(uint32_t s = 0; s < dfa->num_sets; s++)
+	{
+		int16_t map[2][256];
+		memset(map, 0xff, sizeof(map));
+		unsigned int num = 0u;
+		const uint64_t *set = get_set(dfa, s);
+		for(unsigned int c = 0; c < 256; c++)
+		{
+			const unsigned int member = set_has(set, c);
+			if(map[member][class[c]] < 0)
+				map[member][class[c]] = num++;
+			class[c] = map[member][class[c]];
+		}
+		num_classes = num;
+	}
+	dfa->num_classes = num_classes;
+	for(unsigned int c = 0; c < 256; c++)
+	{
+		dfa->class_of[c] = class[tolower(c)];
+		dfa->class_rep[class[c]] = c;
+	}
+
+	// Scratch space. closure() starts with up to two nodes per node (the
+	// successors of a state and of the start nodes) and may push every
+	// node twice. buf_rules also holds these successors
+	const uint32_t n = dfa->num_nodes;
+	dfa->in_start = calloc(n, sizeof(bool));
+	dfa->stamp = calloc(n, sizeof(uint32_t));
+	dfa->stack = calloc(4u * n + dfa->num_roots + 1u, sizeof(uint32_t));
+	dfa->buf_nodes = calloc(n + 1u, sizeof(uint32_t));
+	dfa->buf_rules = calloc(2u * n + 2u * dfa->num_roots + 1u, sizeof(uint32_t));
+	dfa->start_nodes = calloc(n + 1u, sizeof(uint32_t));
+	dfa->start_rules = calloc(dfa->num_roots + 1u, sizeof(uint32_t));
+	dfa->start_eot_rules = calloc(n + 1u, sizeof(uint32_t));
+	if(dfa->in_start == NULL || dfa->stamp == NULL || dfa->stack == NULL ||
+	   dfa->buf_nodes == NULL || dfa->buf_rules == NULL || dfa->start_nodes == NULL ||
+	   dfa->start_rules == NULL || dfa->start_eot_rules == NULL)
+		return false;
+
+	// Nodes active at every position
+	dfa->num_buf_nodes = dfa->num_buf_rules = 0u;
+	closure(dfa, dfa->roots, dfa->num_roots, false, false, false);
+	memcpy(dfa->start_nodes, dfa->buf_nodes, dfa->num_buf_nodes * sizeof(uint32_t));
+	dfa->num_start_nodes = dfa->num_buf_nodes;
+	memcpy(dfa->start_rules, dfa->buf_rules, dfa->num_buf_rules * sizeof(uint32_t));
+	dfa->num_start_rules = dfa->num_buf_rules;
+	for(uint32_t i = 0; i < dfa->num_start_nodes; i++)
+		dfa->in_start[dfa->start_nodes[i]] = true;
+
+	// Filters matching at the end of every domain (e.g. "a*$")
+	uint32_t num = 0u;
+	for(uint32_t i = 0; i < dfa->num_start_nodes; i++)
+		if(dfa->nodes[dfa->start_nodes[i]].type == NFA_EOL)
+			dfa->start_eot_rules[num++] = dfa->nodes[dfa->start_nodes[i]].out;
+	dfa->num_buf_nodes = dfa->num_buf_rules = 0u;
+	closure(dfa, dfa->start_eot_rules, num, false, true, false);
+	memcpy(dfa->start_eot_rules, dfa->buf_rules, dfa->num_buf_rules * sizeof(uint32_t));
+	dfa->num_start_eot_rules = dfa->num_buf_rules;
+
+	dfa->compiled = true;
+	return true;
+}
+
+static inline void add_rules(uint64_t *matches, const uint32_t *rules, const uint32_t num)
+{
+	for(uint32_t i = 0; i < num; i++)
+		matches[rules[i] / 64] |= 1ull << (rules[i] % 64);
+}
+
+// Find all filters matching the input. The bits of the matching filters are
+// set in matches, which has to be large enough for all filters. Returns false
+// if the automaton cannot be used (out of memory)
+bool regex_dfa_match(regexDFA *dfa, const char *input, uint64_t *matches)
+{
+	if(dfa == NULL || !dfa->compiled)
+		return false;
+
+	pthread_mutex_lock(&dfa->lock);
+
+	int32_t current = initial_state(dfa);
+	for(const unsigned char *p = (const unsigned char*)input; current >= 0 && *p != '\0'; p++)
+	{
+		add_rules(matches, dfa->states[current].rules, dfa->states[current].num_rules);
+		const unsigned int class = dfa->class_of[*p];
+		const int32_t next = dfa->states[current].next[class];
+		current = next >= 0 ? next : next_state(dfa, current, class);
+	}
+
+	if(current >= 0)
+	{
+		const dfaState *state = &dfa->states[current];
+		add_rules(matches, state->rules, state->num_rules);
+
+		// End of the domain: "$" anchors of this state
+		uint32_t num = 0u;
+		uint32_t *targets = dfa->buf_rules;
+		for(uint32_t i = 0; i < state->num_nodes; i++)
+			if(dfa->nodes[state->nodes[i]].type == NFA_EOL)
+				targets[num++] = dfa->nodes[state->nodes[i]].out;
+		if(num > 0)
+		{
+			// The targets are copied before buf_rules is written
+			dfa->num_buf_nodes = dfa->num_buf_rules = 0u;
+			closure(dfa, targets, num, false, true, false);
+			add_rules(matches, dfa->buf_rules, dfa->num_buf_rules);
+		}
+		add_rules(matches, dfa->start_eot_rules, dfa->num_start_eot_rules);
+	}
+	else
+		logg("WARN: Regex automaton out of memory, using regex engine");
+
+	pthread_mutex_unlock(&dfa->lock);
+	return current >= 0;
+}
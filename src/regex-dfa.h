@@ -0,0 +1,26 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Combined regex automaton prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef REGEX_DFA_H
+#define REGEX_DFA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct regexDFA regexDFA;
+
+regexDFA *new_regex_dfa(void);
+void free_regex_dfa(regexDFA *dfa);
+bool regex_dfa_add(regexDFA *dfa, const char *regex, const unsigned int rule);
+bool regex_dfa_compile(regexDFA *dfa);
+unsigned int regex_dfa_rules(const regexDFA *dfa) __attribute__((pure));
+bool regex_dfa_match(regexDFA *dfa, const char *input, uint64_t *matches);
+void regex_dfa_forked(regexDFA *dfa);
+
+#endif //REGEX_DFA_H
@@ -16,6 +16,7 @@
 // data getter functions
 #include "datastructure.h"
 #include "database/gravity-db.h"
+#include "regex-dfa.h"
 // add_per_client_regex_client()
 #include "shmem.h"
 #include "database/message-table.h"
@@ -34,6 +35,33 @@ static regexData   *cli_regex = NULL;
 static unsigned int num_regex[REGEX_MAX] = { 0 };
 unsigned int regex_change = 0;
 
+// Wildcard rules such as "(\.|^)example\.com$" (as added by "pihole --wild")
+// are not compiled. They are kept in a hash table of their domains instead
+// and looked up by all suffixes of the queried domain. This takes as long as
+// the domain has labels, no matter how many wildcards there are. The other
+// regex filters are listed in plain
+typedef struct {
+	uint32_t hash;
+	unsigned int index;
+	char *domain;
+} wildcardEntry;
+
+typedef struct {
+	wildcardEntry *entries;
+	unsigned int capacity; // Power of two
+	unsigned int count;
+	unsigned int *plain;
+	unsigned int num_plain;
+} wildcardSet;
+
+static wildcardSet wildcards[REGEX_MAX] = {{ 0 }};
+
+// All other filters of a type which can be converted are combined into one
+// automaton. It finds every matching filter in a single pass over the domain
+// instead of running each of them on their own. Filters it cannot handle
+// (e.g. back-references or approximate matching) are still matched by TRE
+static regexDFA *automata[REGEX_MAX] = { NULL };
+
 static inline regexData *get_regex_ptr(const enum regex_type regexid)
 {
 	switch (regexid)
@@ -93,6 +121,181 @@ unsigned int __attribute__((pure)) get_num_regex(const enum regex_type regexid)
 }
 
 #define FTL_REGEX_SEP ";"
+// Get the domain of a wildcard rule "(\.|^)example\.com$" (or "(^|\.)...").
+// The lowercase domain is stored in domain (if not NULL) which has to be at
+// least as long as regexin. Returns false if this is not a wildcard rule
+static bool parse_wildcard(const char *regexin, char *domain)
+{
+	const char *p = regexin;
+	if(strncmp(p, "(\\.|^)", 6) != 0 && strncmp(p, "(^|\\.)", 6) != 0)
+		return false;
+	p += 6;
+
+	// Domain: labels of letters, digits, '-' and '_' separated by escaped dots
+	size_t len = 0u;
+	bool label = false;
+	for(; *p != '$' && *p != '\0'; p++)
+	{
+		if(isalnum((unsigned char)*p) || *p == '-' || *p == '_')
+		{
+			if(domain != NULL)
+				domain[len] = tolower((unsigned char)*p);
+			len++;
+			label = true;
+		}
+		else if(p[0] == '\\' && p[1] == '.' && label)
+		{
+			if(domain != NULL)
+				domain[len] = '.';
+			len++;
+			label = false;
+			p++;
+		}
+		else
+			return false;
+	}
+
+	// Must end with a label and '$'
+	if(*p != '$' || p[1] != '\0' || !label)
+		return false;
+
+	if(domain != NULL)
+		domain[len] = '\0';
+	return true;
+}
+
+// Check if domain is the domain of a wildcard or one of its subdomains
+static bool __attribute__((pure)) wildcard_match(const char *domain, const char *wildcard)
+{
+	const size_t len = strlen(domain), wlen = strlen(wildcard);
+	if(len < wlen || strcasecmp(domain + len - wlen, wildcard) != 0)
+		return false;
+	return len == wlen || domain[len - wlen - 1] == '.';
+}
+
+// Case-insensitive FNV-1a hash of a domain
+static uint32_t __attribute__((pure)) hash_domain(const char *domain)
+{
+	uint32_t hash = 2166136261u;
+	for(; *domain != '\0'; domain++)
+	{
+		hash ^= (unsigned char)tolower((unsigned char)*domain);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void free_wildcards(const enum regex_type regexid)
+{
+	wildcardSet *set = &wildcards[regexid];
+	if(set->entries != NULL)
+	{
+		for(unsigned int i = 0; i < set->capacity; i++)
+			if(set->entries[i].domain != NULL)
+				free(set->entries[i].domain);
+		free(set->entries);
+	}
+	if(set->plain != NULL)
+		free(set->plain);
+	memset(set, 0, sizeof(*set));
+}
+
+// Build the wildcard hash table and the list of other regex filters of this
+// type. match_regex() checks all filters one by one if this fails
+static void build_wildcards(const enum regex_type regexid)
+{
+	free_wildcards(regexid);
+
+	const regexData *regex = get_regex_ptr(regexid);
+	wildcardSet *set = &wildcards[regexid];
+	unsigned int num = 0u;
+	for(unsigned int index = 0; index < num_regex[regexid]; index++)
+		if(regex[index].available && regex[index].wildcard)
+			num++;
+
+	// Keep the table at most half full
+	set->capacity = 16u;
+	while(set->capacity < 2u * num)
+		set->capacity *= 2u;
+	set->entries = calloc(set->capacity, sizeof(wildcardEntry));
+	set->plain = calloc(num_regex[regexid] - num + 1u, sizeof(unsigned int));
+	if(set->entries == NULL || set->plain == NULL)
+	{
+		free_wildcards(regexid);
+		return;
+	}
+
+	for(unsigned int index = 0; index < num_regex[regexid]; index++)
+	{
+		if(!regex[index].wildcard)
+		{
+			set->plain[set->num_plain++] = index;
+			continue;
+		}
+		if(!regex[index].available)
+			continue;
+
+		char *domain = strdup(regex[index].string);
+		if(domain == NULL || !parse_wildcard(regex[index].string, domain))
+		{
+			if(domain != NULL)
+				free(domain);
+			free_wildcards(regexid);
+			return;
+		}
+
+		// The same domain may be there more than once (with different
+		// case), all of them are stored
+		const uint32_t hash = hash_domain(domain);
+		unsigned int i = hash & (set->capacity - 1u);
+		while(set->entries[i].domain != NULL)
+			i = (i + 1u) & (set->capacity - 1u);
+		set->entries[i].hash = hash;
+		set->entries[i].index = index;
+		set->entries[i].domain = domain;
+		set->count++;
+	}
+}
+
+// Find the first wildcard of this type enabled for the client which matches the
+// domain. Returns num_regex[regexid] if there is none
+static unsigned int __attribute__((pure)) match_wildcard(const char *input, const bool *client_regex,
+                                                          const enum regex_type regexid, const unsigned int offset)
+{
+	const wildcardSet *set = &wildcards[regexid];
+	unsigned int first = num_regex[regexid];
+	if(set->count == 0)
+		return first;
+
+	// Check the domain itself and all its parent domains
+	const char *suffix = input;
+	while(true)
+	{
+		const uint32_t hash = hash_domain(suffix);
+		for(unsigned int i = hash & (set->capacity - 1u); set->entries[i].domain != NULL;
+		    i = (i + 1u) & (set->capacity - 1u))
+		{
+			const wildcardEntry *entry = &set->entries[i];
+			if(entry->hash != hash || entry->index >= first ||
+			   strcasecmp(entry->domain, suffix) != 0)
+				continue;
+
+			// Only use wildcards enabled for this client
+			if(client_regex != NULL && !client_regex[offset + entry->index])
+				continue;
+
+			first = entry->index;
+		}
+
+		const char *dot = strchr(suffix, '.');
+		if(dot == NULL)
+			break;
+		suffix = dot + 1;
+	}
+
+	return first;
+}
+
 /* Compile regular expressions into data structures that can be used with
    regexec() to match against a string */
 static bool compile_regex(const char *regexin, const enum regex_type regexid)
@@ -100,6 +303,19 @@ static bool compile_regex(const char *regexin, const enum regex_type regexid)
 	regexData *regex = get_regex_ptr(regexid);
 	int index = num_regex[regexid]++;
 
+	// Wildcards are not compiled, they are looked up by their domain (see
+	// match_wildcard())
+	if(parse_wildcard(regexin, NULL))
+	{
+		if(config.debug & DEBUG_REGEX)
+			logg("   This regex is a wildcard and will be matched without regex engine");
+
+		regex[index].string = strdup(regexin);
+		regex[index].wildcard = true;
+		regex[index].available = true;
+		return true;
+	}
+
 	// Extract possible Pi-hole extensions
 	char rgxbuf[strlen(regexin) + 1u];
 	// Parse special FTL syntax if present
@@ -198,10 +414,18 @@ static bool compile_regex(const char *regexin, const enum regex_type regexid)
 	regex[index].string = strdup(regexin);
 	regex[index].available = true;
 
+	// Add this filter to the combined automaton if possible
+	if(automata[regexid] != NULL)
+	{
+		regex[index].dfa = regex_dfa_add(automata[regexid], rgxbuf, index);
+		if(!regex[index].dfa && config.debug & DEBUG_REGEX)
+			logg("   This regex cannot be combined and will be matched on its own");
+	}
+
 	return true;
 }
 
-int match_regex(const char *input, const DNSCacheData* dns_cache, const int clientID,
+int match_regex(const char *input, const DNSCacheData* dns_cache, const bool *client_regex,
                 const enum regex_type regexid, const bool regextest)
 {
 	int match_idx = -1;
@@ -210,21 +434,37 @@ int match_regex(const char *input, const DNSCacheData* dns_cache, const int clie
 	regmatch_t match = { 0 }; // This also disables any sub-matching
 #endif
 
-	// Check if we need to recompile regex because they were changed in
-	// another fork. If this is the case, reload everything (regex
-	// themselves as well as per-client enabled/disabled state)
-	if(regex_change != counters->regex_change)
-	{
-		logg("Reloading externally changed regular expressions");
-		read_regex_from_database();
-		// Update regex pointer as it will have changed (free_regex has
-		// been called)
-		regex = get_regex_ptr(regexid);
-	}
+	// Externally changed regular expressions are reloaded when the client
+	// snapshot is taken (see gravityDB_client_snapshot()), this function
+	// may be called without holding the shared memory lock
+
+	// Offset of this type in the per-client regex array
+	unsigned int offset = 0u;
+	if(regexid == REGEX_WHITELIST)
+		offset = num_regex[REGEX_BLACKLIST];
+	else if(regexid == REGEX_CLI)
+		offset = num_regex[REGEX_BLACKLIST] + num_regex[REGEX_WHITELIST];
+
+	// Look up wildcards first. Only the other filters in front of the first
+	// matching wildcard need to be checked then. In regex-test mode, all
+	// filters are checked one by one to report every match
+	const wildcardSet *set = &wildcards[regexid];
+	const bool indexed = !regextest && set->plain != NULL;
+	const unsigned int wildcard = indexed ? match_wildcard(input, client_regex, regexid, offset) : num_regex[regexid];
+	const unsigned int num = indexed ? set->num_plain : num_regex[regexid];
+
+	// Find all filters matched by the combined automaton at once
+	uint64_t matched[num_regex[regexid] / 64u + 1u];
+	const bool use_dfa = indexed && automata[regexid] != NULL &&
+	                     regex_dfa_match(automata[regexid], input, memset(matched, 0, sizeof(matched)));
 
 	// Loop over all configured regex filters of this type
-	for(unsigned int index = 0; index < num_regex[regexid]; index++)
+	for(unsigned int i = 0; i < num; i++)
 	{
+		const unsigned int index = indexed ? set->plain[i] : i;
+		if(index > wildcard)
+			break;
+
 		// Only check regex which have been successfully compiled ...
 		if(!regex[index].available)
 		{
@@ -237,37 +477,44 @@ int match_regex(const char *input, const DNSCacheData* dns_cache, const int clie
 			continue;
 		}
 		// ... and are enabled for this client
-		int regexID = index;
-		if(regexid == REGEX_WHITELIST)
-			regexID += num_regex[REGEX_BLACKLIST];
-		else if(regexid == REGEX_CLI)
-			regexID += num_regex[REGEX_BLACKLIST] +
-			           num_regex[REGEX_WHITELIST];
+		const unsigned int regexID = index + offset;
 
 		// Only use regular expressions enabled for this client
-		// We allow clientID = -1 to get all regex (for testing)
-		if(clientID >= 0 && !get_per_client_regex(clientID, regexID))
+		// We allow client_regex = NULL to get all regex (for testing)
+		if(client_regex != NULL && !client_regex[regexID])
 		{
 			if(config.debug & DEBUG_REGEX)
 			{
-				clientsData* client = getClient(clientID, true);
-				if(client != NULL)
-				{
-					logg("Regex %s (%u, DB ID %d) \"%s\" NOT ENABLED for client %s",
-					     regextype[regexid], index, regex[index].database_id,
-					     regex[index].string, getstr(client->ippos));
-				}
+				logg("Regex %s (%u, DB ID %d) \"%s\" NOT ENABLED for this client",
+				     regextype[regexid], index, regex[index].database_id,
+				     regex[index].string);
 			}
 			continue;
 		}
 
+		// Skip filters the automaton did not match right away
+		const bool dfa = use_dfa && regex[index].dfa;
+		const bool dfa_matched = dfa && (matched[index / 64u] >> (index % 64u)) & 1u;
+		if(dfa && !dfa_matched && !regex[index].inverted && !(config.debug & DEBUG_REGEX))
+			continue;
+
 		// Try to match the compiled regular expression against input
 		if(config.debug & DEBUG_REGEX)
 			logg("Executing: index = %d, preg = %p, str = \"%s\", pmatch = %p", index, &regex[index].regex, input, &match);
+		int retval;
+		if(regex[index].wildcard)
+		{
+			char domain[strlen(regex[index].string) + 1u];
+			parse_wildcard(regex[index].string, domain);
+			retval = wildcard_match(input, domain) ? REG_OK : REG_NOMATCH;
+		}
+		else if(dfa)
+			retval = dfa_matched ? REG_OK : REG_NOMATCH;
+		else
 #ifdef USE_TRE_REGEX
-		int retval = tre_regexec(&regex[index].regex, input, 0, &match, 0);
+			retval = tre_regexec(&regex[index].regex, input, 0, &match, 0);
 #else
-		int retval = regexec(&regex[index].regex, input, 0, NULL, 0);
+			retval = regexec(&regex[index].regex, input, 0, NULL, 0);
 #endif
 		// regexec() returns REG_OK for a successful match or REG_NOMATCH for failure.
 		if ((retval == REG_OK && !regex[index].inverted) ||
@@ -342,6 +589,19 @@ int match_regex(const char *input, const DNSCacheData* dns_cache, const int clie
 		}
 	}
 
+	// No other filter in front of it matched, use the wildcard
+	if(match_idx == -1 && wildcard < num_regex[regexid])
+	{
+		match_idx = regex[wildcard].database_id;
+
+		if(config.debug & DEBUG_REGEX)
+		{
+			logg("Regex %s (%u, DB ID %i) >> MATCH: \"%s\" vs. \"%s\" (wildcard)",
+			     regextype[regexid], wildcard, regex[wildcard].database_id,
+			     input, regex[wildcard].string);
+		}
+	}
+
 	// No match, no error, return false
 	return match_idx;
 }
@@ -392,7 +652,8 @@ static void free_regex(void)
 			if(!regex[index].available)
 				continue;
 
-			regfree(&regex[index].regex);
+			if(!regex[index].wildcard)
+				regfree(&regex[index].regex);
 
 			// Also free buffered regex strings
 			if(regex[index].string != NULL)
@@ -409,6 +670,9 @@ static void free_regex(void)
 
 		// Free array with regex datastructure
 		free_regex_ptr(regexid);
+		free_wildcards(regexid);
+		free_regex_dfa(automata[regexid]);
+		automata[regexid] = NULL;
 	}
 }
 
@@ -472,6 +736,9 @@ static void read_regex_table(const enum regex_type regexid)
 		regex = white_regex;
 	}
 
+	// Filters are added to the combined automaton while they are compiled
+	automata[regexid] = new_regex_dfa();
+
 	// Connect to regex table
 	if(!gravityDB_getTable(tableID))
 	{
@@ -520,6 +787,16 @@ static void read_regex_table(const enum regex_type regexid)
 	// Finalize statement and close gravity database handle
 	gravityDB_finalizeTable();
 
+	build_wildcards(regexid);
+
+	// Prepare the combined automaton. It is not used if no filter could be
+	// added to it
+	if(!regex_dfa_compile(automata[regexid]))
+	{
+		free_regex_dfa(automata[regexid]);
+		automata[regexid] = NULL;
+	}
+
 	if(config.debug & DEBUG_DATABASE)
 	{
 		logg("Read %i %s regex entries",
@@ -561,11 +838,20 @@ void read_regex_from_database(void)
 	}
 
 	// Print message to FTL's log after reloading regex filters
-	logg("Compiled %i whitelist and %i blacklist regex filters for %i clients in %.1f msec",
+	logg("Compiled %i whitelist and %i blacklist regex filters (%u and %u wildcards, %u and %u combined) for %i clients in %.1f msec",
 	     num_regex[REGEX_WHITELIST], num_regex[REGEX_BLACKLIST],
+	     wildcards[REGEX_WHITELIST].count, wildcards[REGEX_BLACKLIST].count,
+	     regex_dfa_rules(automata[REGEX_WHITELIST]), regex_dfa_rules(automata[REGEX_BLACKLIST]),
 	     counters->clients, timer_elapsed_msec(REGEX_TIMER));
 }
 
+// Called in forks (TCP workers) of the main process
+void regex_forked(void)
+{
+	for(enum regex_type regexid = REGEX_BLACKLIST; regexid < REGEX_MAX; regexid++)
+		regex_dfa_forked(automata[regexid]);
+}
+
 int regex_test(const bool debug_mode, const bool quiet, const char *domainin, const char *regexin)
 {
 	// Prepare counters and regex memories
@@ -599,13 +885,13 @@ int regex_test(const bool debug_mode, const bool quiet, const char *domainin, co
 		// Check user-provided domain against all loaded regular blacklist expressions
 		logg("%s Checking domain against blacklist...", cli_info());
 		timer_start(REGEX_TIMER);
-		int matchidx1 = match_regex(domainin, NULL, -1, REGEX_BLACKLIST, true);
+		int matchidx1 = match_regex(domainin, NULL, NULL, REGEX_BLACKLIST, true);
 		logg("    Time: %.3f msec", timer_elapsed_msec(REGEX_TIMER));
 
 		// Check user-provided domain against all loaded regular whitelist expressions
 		logg("%s Checking domain against whitelist...", cli_info());
 		timer_start(REGEX_TIMER);
-		int matchidx2 = match_regex(domainin, NULL, -1, REGEX_WHITELIST, true);
+		int matchidx2 = match_regex(domainin, NULL, NULL, REGEX_WHITELIST, true);
 		logg("    Time: %.3f msec", timer_elapsed_msec(REGEX_TIMER));
 		matchidx = MAX(matchidx1, matchidx2);
 
@@ -619,18 +905,36 @@ int regex_test(const bool debug_mode, const bool quiet, const char *domainin, co
 		// Compile CLI regex
 		timer_start(REGEX_TIMER);
 		log_ctrl(false, true); // Temporarily re-enable terminal output for error logging
+		automata[REGEX_CLI] = new_regex_dfa();
 		if(!compile_regex(regexin, REGEX_CLI))
 			return EXIT_FAILURE;
+		if(!regex_dfa_compile(automata[REGEX_CLI]))
+		{
+			free_regex_dfa(automata[REGEX_CLI]);
+			automata[REGEX_CLI] = NULL;
+		}
 		log_ctrl(false, !quiet); // Re-apply quiet option after compilation
 		logg("    Compiled regex filter in %.3f msec\n", timer_elapsed_msec(REGEX_TIMER));
 
 		// Check user-provided domain against user-provided regular expression
 		logg("Checking domain...");
 		timer_start(REGEX_TIMER);
-		matchidx = match_regex(domainin, NULL, -1, REGEX_CLI, true);
+		matchidx = match_regex(domainin, NULL, NULL, REGEX_CLI, true);
 		if(matchidx == -1)
 			logg("    NO MATCH!");
 		logg("   Time: %.3f msec", timer_elapsed_msec(REGEX_TIMER));
+
+		// The filter is matched by the regex engine above. If it can also
+		// be combined into the automaton used while resolving, both have to
+		// agree (inverted filters are inverted after matching)
+		uint64_t matched = 0u;
+		if(automata[REGEX_CLI] != NULL && cli_regex[0].dfa &&
+		   regex_dfa_match(automata[REGEX_CLI], domainin, &matched) &&
+		   ((matched & 1u) != 0u) != ((matchidx > -1) != cli_regex[0].inverted))
+		{
+			logg("%s Regex automaton and regex engine disagree", cli_cross());
+			return EXIT_FAILURE;
+		}
 	}
 
 	// Return status 0 = MATCH, 1 = ERROR, 2 = NO MATCH
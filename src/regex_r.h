@@ -14,6 +14,7 @@
 #include "datastructure.h"
 
 extern const char *regextype[];
+extern unsigned int regex_change;
 
 // Use TRE instead of GNU regex library (compiled into FTL itself)
 #define USE_TRE_REGEX
@@ -31,19 +32,22 @@ typedef struct {
 	bool available;
 	bool inverted;
 	bool query_type_inverted;
+	bool wildcard;
+	bool dfa;
 	enum query_types query_type;
 	int database_id;
 	char *string;
 	regex_t regex;
 } regexData;
-ASSERT_SIZEOF(regexData, 32, 20, 20);
+ASSERT_SIZEOF(regexData, 40, 24, 24);
 
 unsigned int get_num_regex(const enum regex_type regexid) __attribute__((pure));
-int match_regex(const char *input, const DNSCacheData* dns_cache, const int clientID,
+int match_regex(const char *input, const DNSCacheData* dns_cache, const bool *client_regex,
                 const enum regex_type regexid, const bool regextest);
 void allocate_regex_client_enabled(clientsData *client, const int clientID);
 void reload_per_client_regex(clientsData *client);
 void read_regex_from_database(void);
+void regex_forked(void);
 
 int regex_test(const bool debug_mode, const bool quiet, const char *domainin, const char *regexin);
 
@@ -31,6 +31,8 @@
 #include "database/message-table.h"
 // Eventqueue routines
 #include "events.h"
+// sched_run()
+#include "scheduler.h"
 
 static bool res_initialized = false;
 
@@ -468,7 +470,11 @@ static void resolveClients(const bool onlynew, const bool force_refreshing)
 		}
 
 		// Store obtained host name (may be unchanged)
-		client->namepos = newnamepos;
+		if(newnamepos != oldnamepos)
+		{
+			freestr(client->namepos);
+			client->namepos = newnamepos;
+		}
 		// Mark entry as not new
 		client->flags.new = false;
 
@@ -559,7 +565,11 @@ static void resolveUpstreams(const bool onlynew)
 		}
 
 		// Store obtained host name (may be unchanged)
-		upstream->namepos = newnamepos;
+		if(newnamepos != oldnamepos)
+		{
+			freestr(upstream->namepos);
+			upstream->namepos = newnamepos;
+		}
 		// Mark entry as not new
 		upstream->new = false;
 
@@ -576,6 +586,13 @@ static void resolveUpstreams(const bool onlynew)
 	}
 }
 
+// Update possibly changed client host names
+static void reresolve(const time_t now)
+{
+	if(resolver_ready)
+		set_event(RERESOLVE_HOSTNAMES);
+}
+
 void *DNSclient_thread(void *val)
 {
 	// Set thread name
@@ -584,8 +601,22 @@ void *DNSclient_thread(void *val)
 	// Initial delay until we first try to resolve anything
 	sleepms(2000);
 
+	// Re-resolve all host names every hour. Spread this a bit so not all
+	// Pi-holes query their upstream servers at the same time
+	scheduler sched;
+	schedJob reresolve_job;
+	sched_init(&sched, "DNS client");
+	sched_add(&sched, &reresolve_job, "re-resolve", reresolve, RERESOLVE_INTERVAL, 0, RERESOLVE_JITTER);
+
 	while(!killed)
 	{
+		// Get event sequence before processing events so that we do not
+		// miss events set while we are busy
+		const unsigned int seq = event_sequence();
+
+		// Run due jobs
+		const int timeout = sched_run(&sched);
+
 		// Run whenever necessary to resolve only new clients and
 		// upstream servers
 		if(resolver_ready && get_and_clear_event(RESOLVE_NEW_HOSTNAMES))
@@ -599,12 +630,6 @@ void *DNSclient_thread(void *val)
 			resolveUpstreams(true);
 		}
 
-		// Run every hour to update possibly changed client host names
-		if(resolver_ready && (time(NULL) % RERESOLVE_INTERVAL == 0))
-		{
-			set_event(RERESOLVE_HOSTNAMES);      // done below
-		}
-
 		bool force_refreshing = false;
 		if(get_and_clear_event(RERESOLVE_HOSTNAMES_FORCE))
 		{
@@ -623,8 +648,9 @@ void *DNSclient_thread(void *val)
 			resolveUpstreams(false);
 		}
 
-		// Idle for 1 sec before checking again the time criteria
-		sleepms(1000);
+		// Sleep until the next job is due or a new event is set. Check
+		// again every second until the resolver is ready
+		wait_for_event(seq, resolver_ready ? timeout : 1000);
 	}
 
 	return NULL;
@@ -0,0 +1,193 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Periodic job scheduler
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "scheduler.h"
+// struct config
+#include "config.h"
+// logg()
+#include "log.h"
+// ms_until()
+#include "timers.h"
+// INT_MAX
+#include <limits.h>
+
+// Every thread owns its scheduler and runs its jobs itself. Jobs are kept in
+// a hashed timer wheel with one-second slots: a job due at time t lives in
+// slot t % SCHED_WHEEL_SLOTS. When the scheduler runs, it visits the slots of
+// all seconds which passed since it ran the last time so that no job is
+// missed when the thread was busy (or the system was suspended) while a job
+// became due.
+
+// Monotonic time in milliseconds
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+}
+
+// Insert job into the wheel. Jobs are appended so that jobs due in the same
+// second run in the order they were added
+static void wheel_insert(scheduler *sched, schedJob *job)
+{
+	job->due = job->base;
+	if(job->jitter > 0)
+		job->due += random() % (job->jitter + 1);
+
+	schedJob **slot = &sched->wheel[job->due % SCHED_WHEEL_SLOTS];
+	while(*slot != NULL)
+		slot = &(*slot)->next;
+	job->next = NULL;
+	*slot = job;
+}
+
+// Get the first multiple of the job's interval (plus offset) after now
+static void first_base(schedJob *job, const time_t now)
+{
+	const time_t aligned = now - job->offset;
+	job->base = aligned - aligned % job->interval + job->offset + job->interval;
+}
+
+void sched_init(scheduler *sched, const char *name)
+{
+	memset(sched, 0, sizeof(*sched));
+	sched->name = name;
+	sched->last_tick = time(NULL);
+}
+
+// Add a periodic job. It will be run every interval seconds, aligned to
+// multiples of the interval plus offset
+void sched_add(scheduler *sched, schedJob *job, const char *name, void (*run)(const time_t now),
+               const time_t interval, const time_t offset, const unsigned int jitter)
+{
+	memset(job, 0, sizeof(*job));
+	job->name = name;
+	job->run = run;
+	job->interval = interval > 0 ? interval : 1;
+	job->offset = offset;
+	job->jitter = jitter;
+
+	first_base(job, time(NULL));
+	wheel_insert(sched, job);
+
+	if(config.debug & DEBUG_EVENTS)
+		logg("Scheduler %s: Added job %s (interval %lds, jitter %us)",
+		     sched->name, job->name, (long)job->interval, job->jitter);
+}
+
+// The clock went backwards, schedule all jobs again relative to now
+static void sched_reset(scheduler *sched, const time_t now)
+{
+	schedJob *jobs = NULL;
+	for(unsigned int i = 0; i < SCHED_WHEEL_SLOTS; i++)
+	{
+		while(sched->wheel[i] != NULL)
+		{
+			schedJob *job = sched->wheel[i];
+			sched->wheel[i] = job->next;
+			job->next = jobs;
+			jobs = job;
+		}
+	}
+
+	while(jobs != NULL)
+	{
+		schedJob *job = jobs;
+		jobs = job->next;
+		first_base(job, now);
+		wheel_insert(sched, job);
+	}
+}
+
+// Run all jobs which are due. Returns the number of milliseconds until the
+// next job is due
+int sched_run(scheduler *sched)
+{
+	const time_t now = time(NULL);
+	if(now < sched->last_tick)
+	{
+		logg("Scheduler %s: Clock went backwards, rescheduling jobs", sched->name);
+		sched_reset(sched, now);
+	}
+
+	// Collect due jobs from the slots of all seconds since the last run.
+	// Visiting each slot once is enough even after long pauses as all jobs
+	// due in the past are collected from their slot regardless of the lap
+	time_t ticks = now - sched->last_tick;
+	if(ticks > SCHED_WHEEL_SLOTS)
+		ticks = SCHED_WHEEL_SLOTS;
+	schedJob *due = NULL, **due_tail = &due;
+	for(time_t t = now - ticks + 1; t <= now; t++)
+	{
+		schedJob **job = &sched->wheel[t % SCHED_WHEEL_SLOTS];
+		while(*job != NULL)
+		{
+			if((*job)->due <= now)
+			{
+				// Move job from the wheel to the list of due jobs
+				*due_tail = *job;
+				*job = (*job)->next;
+				due_tail = &(*due_tail)->next;
+				*due_tail = NULL;
+			}
+			else
+				job = &(*job)->next;
+		}
+	}
+	sched->last_tick = now;
+
+	// Run due jobs
+	while(due != NULL)
+	{
+		schedJob *job = due;
+		due = job->next;
+
+		if(job->due < now)
+			job->late++;
+
+		const double start = now_ms();
+		job->run(now);
+		const double took = now_ms() - start;
+
+		job->runs++;
+		job->total_ms += took;
+		if(took > job->max_ms)
+			job->max_ms = took;
+
+		// Schedule next run. Intervals which have already passed (because
+		// the job ran late or took very long) are merged into this run
+		const time_t end = time(NULL);
+		job->base += job->interval;
+		if(job->base <= end)
+		{
+			const time_t missed = (end - job->base) / job->interval + 1;
+			job->skipped += missed;
+			job->base += missed * job->interval;
+		}
+		wheel_insert(sched, job);
+
+		if(config.debug & DEBUG_EVENTS)
+		{
+			logg("Scheduler %s: Job %s took %.1f ms (runs: %u, late: %u, skipped: %u, avg: %.1f ms, max: %.1f ms)",
+			     sched->name, job->name, took, job->runs, job->late, job->skipped,
+			     job->total_ms / job->runs, job->max_ms);
+		}
+	}
+
+	// Find the next due job
+	time_t next = 0;
+	for(unsigned int i = 0; i < SCHED_WHEEL_SLOTS; i++)
+		for(const schedJob *job = sched->wheel[i]; job != NULL; job = job->next)
+			if(next == 0 || job->due < next)
+				next = job->due;
+
+	return next > 0 ? ms_until(next) : INT_MAX;
+}
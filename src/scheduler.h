@@ -0,0 +1,49 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Periodic job scheduler prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdbool.h>
+// time_t
+#include <time.h>
+
+// Number of one-second slots of the timer wheel. Jobs due further in the
+// future than this stay in their slot and are skipped until their lap comes
+#define SCHED_WHEEL_SLOTS 64
+
+typedef struct schedJob {
+	const char *name;
+	void (*run)(const time_t now);
+	time_t interval; // [s]
+	time_t offset; // [s], jobs are due at multiples of interval plus offset
+	unsigned int jitter; // [s], random delay added to every due time
+	time_t base; // Nominal due time (without jitter)
+	time_t due;
+	struct schedJob *next;
+	// Statistics
+	unsigned int runs;
+	unsigned int late; // Runs started after their due second had passed
+	unsigned int skipped; // Intervals merged into a late run
+	double total_ms;
+	double max_ms;
+} schedJob;
+
+typedef struct {
+	const char *name;
+	time_t last_tick;
+	schedJob *wheel[SCHED_WHEEL_SLOTS];
+} scheduler;
+
+void sched_init(scheduler *sched, const char *name);
+void sched_add(scheduler *sched, schedJob *job, const char *name, void (*run)(const time_t now),
+               const time_t interval, const time_t offset, const unsigned int jitter);
+int sched_run(scheduler *sched);
+
+#endif //SCHEDULER_H
@@ -13,8 +13,10 @@
 #include "config.h"
 #include "setupVars.h"
 
-int setupVarsElements = 0;
-char ** setupVarsArray = NULL;
+// The parsed values are kept per thread as API requests reading setupVars.conf
+// are handled concurrently by several threads
+static _Thread_local int setupVarsElements = 0;
+static _Thread_local char ** setupVarsArray = NULL;
 
 void check_setupVarsconf(void)
 {
@@ -66,8 +68,8 @@ void trim_whitespace(char *string)
 // process (e.g. setupVarsArray will
 // actually point to memory addresses
 // which we allocate for this buffer.
-char * linebuffer = NULL;
-size_t linebuffersize = 0;
+static _Thread_local char * linebuffer = NULL;
+static _Thread_local size_t linebuffersize = 0;
 
 char * read_setupVarsconf(const char * key)
 {
@@ -137,7 +139,8 @@ char * read_setupVarsconf(const char * key)
 // setupVarsArray[3] = NULL
 void getSetupVarsArray(const char * input)
 {
-	char * p = strtok((char*)input, ",");
+	char * saveptr = NULL;
+	char * p = strtok_r((char*)input, ",", &saveptr);
 
 	/* split string and append tokens to 'res' */
 
@@ -145,7 +148,7 @@ void getSetupVarsArray(const char * input)
 		setupVarsArray = realloc(setupVarsArray, sizeof(char*) * ++setupVarsElements);
 		if(setupVarsArray == NULL) return;
 		setupVarsArray[setupVarsElements-1] = p;
-		p = strtok(NULL, ",");
+		p = strtok_r(NULL, ",", &saveptr);
 	}
 
 	/* realloc one extra element for the last NULL */
@@ -19,9 +19,15 @@
 #include <sys/statvfs.h>
 // get_num_regex()
 #include "regex_r.h"
+// timer_start()
+#include "timers.h"
+// lockstats_wait()
+#include "lockstats.h"
+// statsSnapshotData
+#include "snapshot.h"
 
 /// The version of shared memory used
-#define SHARED_MEMORY_VERSION 11
+#define SHARED_MEMORY_VERSION 23
 
 /// The name of the shared memory. Use this when connecting to the shared memory.
 #define SHMEM_PATH "/dev/shm"
@@ -31,11 +37,20 @@
 #define SHARED_DOMAINS_NAME "FTL-domains"
 #define SHARED_CLIENTS_NAME "FTL-clients"
 #define SHARED_QUERIES_NAME "FTL-queries"
+#define SHARED_QUERIES_COLD_NAME "FTL-queries-cold"
 #define SHARED_UPSTREAMS_NAME "FTL-upstreams"
 #define SHARED_OVERTIME_NAME "FTL-overTime"
 #define SHARED_SETTINGS_NAME "FTL-settings"
 #define SHARED_DNS_CACHE "FTL-dns-cache"
 #define SHARED_PER_CLIENT_REGEX "FTL-per-client-regex"
+#define SHARED_DOMAINS_HASH_NAME "FTL-domains-hash"
+#define SHARED_CLIENTS_HASH_NAME "FTL-clients-hash"
+#define SHARED_DNS_CACHE_HASH_NAME "FTL-dns-cache-hash"
+#define SHARED_QUERIES_HASH_NAME "FTL-queries-hash"
+#define SHARED_STRINGS_HASH_NAME "FTL-strings-hash"
+#define SHARED_STR_HANDLES_NAME "FTL-string-handles"
+#define SHARED_CLIENT_OVERTIME_HASH_NAME "FTL-client-overTime-hash"
+#define SHARED_CLIENT_OVERTIME_NAME "FTL-client-overTime"
 
 // Limit from which on we warn users about space running out in SHMEM_PATH
 // default: 90%
@@ -46,29 +61,100 @@ countersStruct *counters = NULL;
 
 /// The pointer in shared memory to the shared string buffer
 static SharedMemory shm_lock = { 0 };
+static SharedMemory shm_lockstats = { 0 };
+static SharedMemory shm_stats = { 0 };
 static SharedMemory shm_strings = { 0 };
+static SharedMemory shm_str_handles = { 0 };
 static SharedMemory shm_counters = { 0 };
 static SharedMemory shm_domains = { 0 };
 static SharedMemory shm_clients = { 0 };
 static SharedMemory shm_queries = { 0 };
+static SharedMemory shm_queries_cold = { 0 };
 static SharedMemory shm_upstreams = { 0 };
 static SharedMemory shm_overTime = { 0 };
+static SharedMemory shm_client_overTime = { 0 };
 static SharedMemory shm_settings = { 0 };
 static SharedMemory shm_dns_cache = { 0 };
 static SharedMemory shm_per_client_regex = { 0 };
+static SharedMemory shm_hash[HASH_TABLES] = {{ 0 }};
+static const char *hash_names[HASH_TABLES] = { SHARED_DOMAINS_HASH_NAME, SHARED_CLIENTS_HASH_NAME,
+                                               SHARED_DNS_CACHE_HASH_NAME, SHARED_QUERIES_HASH_NAME,
+                                               SHARED_STRINGS_HASH_NAME, SHARED_CLIENT_OVERTIME_HASH_NAME };
+
+// A bucket of a shared-memory hash index. The stored ID is offset by one so
+// that a zero-initialized shared memory object is an empty hash table
+typedef struct {
+	uint32_t hash;
+	int id;
+} hashBucket;
+ASSERT_SIZEOF(hashBucket, 8, 8, 8);
 
 // Variable size array structs
 static queriesData *queries = NULL;
+static queriesColdData *queries_cold = NULL;
 static clientsData *clients = NULL;
 static domainsData *domains = NULL;
 static upstreamsData *upstreams = NULL;
 static DNSCacheData *dns_cache = NULL;
 
+// Handles of interned strings. A handle stores the position of its string in
+// the shared string buffer. Free handles are linked through their pos field
+typedef struct {
+	unsigned int pos;
+	unsigned int refs;
+} strEntry;
+ASSERT_SIZEOF(strEntry, 8, 8, 8);
+static strEntry *str_handles = NULL;
+
+// Per-client overTime counts are stored sparsely: only (client, slot) pairs
+// that saw queries get an entry. All entries of one slot are chained through
+// next (storing index + 1, zero terminates) starting at overTime[slot].clients
+// so they can be released at once when the slot rolls over. Free entries are
+// linked the same way
+typedef struct {
+	int clientID;
+	unsigned int slot;
+	int count;
+	int next;
+} clientOverTimeEntry;
+ASSERT_SIZEOF(clientOverTimeEntry, 16, 16, 16);
+static clientOverTimeEntry *client_overTime = NULL;
+
+// Shared memory is protected by a robust process-shared mutex. Read-only
+// accessors (API requests) register themselves as readers and release the
+// mutex while they are working so they can run concurrently. Writers hold the
+// mutex and additionally wait until all active readers are done. No new
+// readers are admitted while a writer is waiting
+//
+// The robust mutex is recovered when its owner dies, the reader and writer
+// counts are not. They are therefore also kept per process and dropped by
+// waiting processes once the process which added them does not exist anymore
+#define LOCK_HOLDERS 32
+
+typedef struct {
+	pid_t pid;
+	unsigned int readers;
+	unsigned int writers;
+} lockHolder;
+
 typedef struct {
 	pthread_mutex_t lock;
+	pthread_cond_t readersDone;
+	pthread_cond_t writersDone;
+	unsigned int readers;
+	unsigned int writers;
 	bool waitingForLock;
+	lockHolder holders[LOCK_HOLDERS];
 } ShmLock;
 static ShmLock *shmLock = NULL;
+
+// Call site and time the lock was obtained for lock contention statistics.
+// The exclusive lock is held by at most one thread of this process while
+// read locks may be held by several threads at the same time
+static int lock_site = -1;
+static uint64_t lock_obtained = 0;
+static _Thread_local int read_site = -1;
+static _Thread_local uint64_t read_obtained = 0;
 static ShmSettings *shmSettings = NULL;
 
 static int pagesize;
@@ -146,16 +232,23 @@ static bool chown_shmem(SharedMemory *sharedMemory, struct passwd *ent_pw)
 void chown_all_shmem(struct passwd *ent_pw)
 {
 	chown_shmem(&shm_lock, ent_pw);
+	chown_shmem(&shm_lockstats, ent_pw);
+	chown_shmem(&shm_stats, ent_pw);
 	chown_shmem(&shm_strings, ent_pw);
+	chown_shmem(&shm_str_handles, ent_pw);
 	chown_shmem(&shm_counters, ent_pw);
 	chown_shmem(&shm_domains, ent_pw);
 	chown_shmem(&shm_clients, ent_pw);
 	chown_shmem(&shm_queries, ent_pw);
+	chown_shmem(&shm_queries_cold, ent_pw);
 	chown_shmem(&shm_upstreams, ent_pw);
 	chown_shmem(&shm_overTime, ent_pw);
+	chown_shmem(&shm_client_overTime, ent_pw);
 	chown_shmem(&shm_settings, ent_pw);
 	chown_shmem(&shm_dns_cache, ent_pw);
 	chown_shmem(&shm_per_client_regex, ent_pw);
+	for(unsigned int i = 0; i < HASH_TABLES; i++)
+		chown_shmem(&shm_hash[i], ent_pw);
 }
 
 // A function that duplicates a string and replaces all characters "s" by "r"
@@ -216,6 +309,45 @@ bool strcmp_escaped(const char *a, const char *b)
 }
 
 
+// Key used to look up strings in the interning hash index
+typedef struct {
+	const char *str;
+	size_t len;
+} strKey;
+
+// Compare a string key against the interned string with a given ID
+static bool str_matches(const int ID, const void *key)
+{
+	const strKey *k = key;
+	const char *str = &((const char*)shm_strings.ptr)[str_handles[ID].pos];
+	return strncmp(str, k->str, k->len) == 0 && str[k->len] == '\0';
+}
+
+// Return a free string handle, enlarging the handle table when necessary
+static unsigned int new_str_handle(void)
+{
+	// Re-use a previously freed handle if available
+	if(shmSettings->free_str_handle != 0)
+	{
+		const unsigned int handle = shmSettings->free_str_handle;
+		shmSettings->free_str_handle = str_handles[handle].pos;
+		return handle;
+	}
+
+	if(shmSettings->num_str_handles >= (unsigned int)counters->str_handles_MAX)
+	{
+		realloc_shm(&shm_str_handles, 2*counters->str_handles_MAX, sizeof(strEntry), true);
+		str_handles = (strEntry*)shm_str_handles.ptr;
+		counters->str_handles_MAX *= 2;
+	}
+
+	return shmSettings->num_str_handles++;
+}
+
+// Add a string to the shared string pool. Strings are interned: when the
+// same string is already stored, its reference counter is incremented and
+// the existing handle is returned. Every stored handle has to be released
+// using freestr() when it is overwritten
 size_t addstr(const char *input)
 {
 	if(input == NULL)
@@ -228,7 +360,7 @@ size_t addstr(const char *input)
 	size_t len = strlen(input) + 1;
 
 	// If this is an empty string (only the terminating character is present),
-	// use the shared memory string at position zero instead of creating a new
+	// use the shared memory string with handle zero instead of creating a new
 	// entry here. We also ensure that the given string is not too long to
 	// prevent possible memory corruption caused by strncpy() further down
 	if(len == 1)
@@ -247,17 +379,33 @@ size_t addstr(const char *input)
 	if(N > 0)
 		logg("INFO: FTL escaped %ui characters in \"%s\"", N, str);
 
+	// Check if this string is already known
+	const strKey key = { str, len - 1 };
+	const uint32_t hash = hashData(str, len - 1);
+	const int known = hash_lookup(STRINGS_HASH, hash, str_matches, &key);
+	if(known > -1)
+	{
+		str_handles[known].refs++;
+		if(N > 0)
+			free(str);
+		return known;
+	}
+
 	// Debugging output
 	if(config.debug & DEBUG_SHMEM)
 		logg("Adding \"%s\" (len %zu) to buffer. next_str_pos is %u", str, len, shmSettings->next_str_pos);
 
-	// Reserve additional memory if necessary
-	if(shmSettings->next_str_pos + len > shm_strings.size &&
-	   !realloc_shm(&shm_strings, shm_strings.size + pagesize, sizeof(char), true))
+	// Reserve additional memory if necessary. We grow the buffer by a
+	// quarter of its size (at least one page) to avoid frequent remapping
+	if(shmSettings->next_str_pos + len > shm_strings.size)
 	{
-		if(N > 0)
-			free(str);
-		return 0;
+		const size_t step = pagesize * (1 + shm_strings.size / (4*pagesize));
+		if(!realloc_shm(&shm_strings, shm_strings.size + step, sizeof(char), true))
+		{
+			if(N > 0)
+				free(str);
+			return 0;
+		}
 	}
 
 	// Store new string buffer size in corresponding counters entry
@@ -265,29 +413,104 @@ size_t addstr(const char *input)
 	counters->strings_MAX = shm_strings.size;
 
 	// Copy the C string pointed by str into the shared string buffer
-	strncpy(&((char*)shm_strings.ptr)[shmSettings->next_str_pos], str, len);
+	char *dest = &((char*)shm_strings.ptr)[shmSettings->next_str_pos];
+	strncpy(dest, str, len);
+	dest[len - 1] = '\0';
 	if(N > 0)
 		free(str);
 
+	// Create handle for this string
+	const unsigned int handle = new_str_handle();
+	str_handles[handle].pos = shmSettings->next_str_pos;
+	str_handles[handle].refs = 1;
+	hash_insert(STRINGS_HASH, hash, handle);
+
 	// Increment string length counter
 	shmSettings->next_str_pos += len;
 
-	// Return start of stored string
-	return (shmSettings->next_str_pos - len);
+	// Return handle of stored string
+	return handle;
 }
 
-const char *getstr(const size_t pos)
+// Release a reference to an interned string. The memory occupied by strings
+// without any remaining references is reclaimed by compact_strings()
+void freestr(const size_t handle)
 {
-	// Only access the string memory if this memory region has already been set
-	if(pos < shmSettings->next_str_pos)
-		return &((const char*)shm_strings.ptr)[pos];
+	// The empty string at handle zero is never freed
+	if(handle == 0 || handle >= shmSettings->num_str_handles || str_handles[handle].refs == 0)
+		return;
+
+	if(--str_handles[handle].refs > 0)
+		return;
+
+	// Remove string from the interning index
+	const char *str = &((const char*)shm_strings.ptr)[str_handles[handle].pos];
+	const size_t len = strlen(str);
+	hash_remove(STRINGS_HASH, hashData(str, len), handle);
+	shmSettings->str_garbage += len + 1;
+
+	// Add handle to the list of free handles
+	str_handles[handle].pos = shmSettings->free_str_handle;
+	shmSettings->free_str_handle = handle;
+}
+
+const char *getstr(const size_t handle)
+{
+	// Only access the string memory if this handle is in use
+	if(handle == 0 || (handle < shmSettings->num_str_handles && str_handles[handle].refs > 0))
+		return &((const char*)shm_strings.ptr)[str_handles[handle].pos];
 	else
 	{
-		logg("WARN: Tried to access %zu but next_str_pos is %u", pos, shmSettings->next_str_pos);
+		logg("WARN: Tried to access string %zu but it is not in use (%u handles)",
+		     handle, shmSettings->num_str_handles);
 		return "";
 	}
 }
 
+// Remove unreferenced strings from the shared string buffer by moving all
+// remaining strings to the front. Handles are not affected by this. This
+// routine needs to be called while holding the shared memory lock
+void compact_strings(void)
+{
+	// Only compact when at least a quarter of the buffer is wasted
+	if(shmSettings->str_garbage < shmSettings->next_str_pos / 4)
+		return;
+
+	if(config.debug & DEBUG_SHMEM)
+		timer_start(STRINGS_TIMER);
+
+	char *buffer = calloc(shmSettings->next_str_pos, sizeof(char));
+	if(buffer == NULL)
+	{
+		logg("WARN: Cannot compact strings, memory allocation failed");
+		return;
+	}
+
+	// The empty string stays at position zero
+	unsigned int next_pos = 1;
+	const char *strings = shm_strings.ptr;
+	for(unsigned int handle = 1; handle < shmSettings->num_str_handles; handle++)
+	{
+		if(str_handles[handle].refs == 0)
+			continue;
+
+		const size_t len = strlen(&strings[str_handles[handle].pos]) + 1;
+		memcpy(&buffer[next_pos], &strings[str_handles[handle].pos], len);
+		str_handles[handle].pos = next_pos;
+		next_pos += len;
+	}
+
+	memcpy(shm_strings.ptr, buffer, next_pos);
+	free(buffer);
+
+	if(config.debug & DEBUG_SHMEM)
+		logg("Compacted strings from %u to %u bytes (took %.2f ms)",
+		     shmSettings->next_str_pos, next_pos, timer_elapsed_msec(STRINGS_TIMER));
+
+	shmSettings->next_str_pos = next_pos;
+	shmSettings->str_garbage = 0;
+}
+
 /// Create a mutex for shared memory
 static pthread_mutex_t create_mutex(void) {
 	logg("Creating mutex");
@@ -312,12 +535,35 @@ static pthread_mutex_t create_mutex(void) {
 	return lock;
 }
 
+/// Create a condition variable for shared memory
+static pthread_cond_t create_cond(void) {
+	pthread_condattr_t cond_attr = {};
+	pthread_cond_t cond = {};
+
+	// Initialize the condition variable attributes
+	pthread_condattr_init(&cond_attr);
+
+	// Allow the condition variable to be used by other processes
+	pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+
+	// Initialize the condition variable
+	pthread_cond_init(&cond, &cond_attr);
+
+	// Destroy the attributes since we're done with them
+	pthread_condattr_destroy(&cond_attr);
+
+	return cond;
+}
+
 static void remap_shm(void)
 {
 	// Remap shared object pointers which might have changed
 	realloc_shm(&shm_queries, counters->queries_MAX, sizeof(queriesData), false);
 	queries = (queriesData*)shm_queries.ptr;
 
+	realloc_shm(&shm_queries_cold, counters->queries_MAX, sizeof(queriesColdData), false);
+	queries_cold = (queriesColdData*)shm_queries_cold.ptr;
+
 	realloc_shm(&shm_domains, counters->domains_MAX, sizeof(domainsData), false);
 	domains = (domainsData*)shm_domains.ptr;
 
@@ -333,23 +579,131 @@ static void remap_shm(void)
 	realloc_shm(&shm_strings, counters->strings_MAX, sizeof(char), false);
 	// strings are not exposed by a global pointer
 
+	realloc_shm(&shm_str_handles, counters->str_handles_MAX, sizeof(strEntry), false);
+	str_handles = (strEntry*)shm_str_handles.ptr;
+
+	realloc_shm(&shm_client_overTime, counters->client_overTime_MAX, sizeof(clientOverTimeEntry), false);
+	client_overTime = (clientOverTimeEntry*)shm_client_overTime.ptr;
+
+	// Hash indices store IDs instead of pointers so they remain valid when
+	// the indexed objects move, only the index objects themselves may have
+	// been resized (and rebuilt) by another process
+	for(unsigned int i = 0; i < HASH_TABLES; i++)
+		realloc_shm(&shm_hash[i], counters->hash[i].size, sizeof(hashBucket), false);
+
 	// Update local counter to reflect that we absorbed this change
 	local_shm_counter = shmSettings->global_shm_counter;
 }
 
-void _lock_shm(const char* func, const int line, const char * file) {
-	// Signal that FTL is waiting for a lock
-	shmLock->waitingForLock = true;
+// Obtain the shared memory mutex, recovering it if its previous owner died
+static int obtain_mutex(void)
+{
+	int result = pthread_mutex_lock(&shmLock->lock);
 
-	if(config.debug & DEBUG_LOCKS)
-		logg("Waiting for lock in %s() (%s:%i)", func, file, line);
+	if(result == EOWNERDEAD) {
+		// Try to make the lock consistent if the other process died while
+		// holding the lock
+		result = pthread_mutex_consistent(&shmLock->lock);
+	}
 
-	int result = pthread_mutex_lock(&shmLock->lock);
+	return result;
+}
 
-	if(config.debug & DEBUG_LOCKS)
-		logg("Obtained lock for %s() (%s:%i)", func, file, line);
+// Get the entry of this process in the list of lock holders, it is added if
+// add is true. Has to be called with the mutex held. Returns NULL if there is
+// none, the counts of this process are not tracked then
+static lockHolder *get_lock_holder(const bool add)
+{
+	const pid_t pid = getpid();
+	lockHolder *unused = NULL;
+	for(unsigned int i = 0; i < LOCK_HOLDERS; i++)
+	{
+		if(shmLock->holders[i].pid == pid)
+			return &shmLock->holders[i];
+		if(unused == NULL && shmLock->holders[i].pid == 0)
+			unused = &shmLock->holders[i];
+	}
+
+	if(add && unused != NULL)
+		unused->pid = pid;
+	else
+		unused = NULL;
+	return unused;
+}
+
+// Free the entry of a process which does not hold any read lock and does not
+// wait for readers anymore
+static void put_lock_holder(lockHolder *holder)
+{
+	if(holder != NULL && holder->readers == 0 && holder->writers == 0)
+		holder->pid = 0;
+}
+
+// Drop the counts of processes which died while holding a read lock or while
+// waiting for readers. Has to be called with the mutex held
+static void release_dead_lock_holders(void)
+{
+	for(unsigned int i = 0; i < LOCK_HOLDERS; i++)
+	{
+		lockHolder *holder = &shmLock->holders[i];
+		if(holder->pid == 0 || kill(holder->pid, 0) == 0 || errno != ESRCH)
+			continue;
+
+		logg("WARN: Process %i died while holding %u read lock(s), releasing them",
+		     (int)holder->pid, holder->readers);
+		shmLock->readers = shmLock->readers > holder->readers ? shmLock->readers - holder->readers : 0u;
+		shmLock->writers = shmLock->writers > holder->writers ? shmLock->writers - holder->writers : 0u;
+		memset(holder, 0, sizeof(*holder));
+
+		if(shmLock->readers == 0)
+			pthread_cond_broadcast(&shmLock->readersDone);
+		if(shmLock->writers == 0)
+			pthread_cond_broadcast(&shmLock->writersDone);
+	}
+}
+
+// Wait for a condition variable of the lock. Dead lock holders are checked for
+// once a second. Has to be called with the mutex held
+static void wait_for_lock_holders(pthread_cond_t *cond)
+{
+	struct timespec timeout;
+	clock_gettime(CLOCK_REALTIME, &timeout);
+	timeout.tv_sec += 1;
+
+	const int result = pthread_cond_timedwait(cond, &shmLock->lock, &timeout);
+	if(result == EOWNERDEAD)
+		pthread_mutex_consistent(&shmLock->lock);
+	else if(result == ETIMEDOUT)
+		release_dead_lock_holders();
+}
+
+// Wait until no reader is active anymore. Has to be called with the mutex held
+static void wait_for_readers(void)
+{
+	if(shmLock->readers == 0)
+		return;
+
+	// Waiting releases the mutex, block new readers meanwhile
+	lockHolder *holder = get_lock_holder(true);
+	shmLock->writers++;
+	if(holder != NULL)
+		holder->writers++;
 
-	// Check if this process needs to remap the shared memory objects
+	while(shmLock->readers > 0)
+		wait_for_lock_holders(&shmLock->readersDone);
+
+	if(holder != NULL && holder->writers > 0)
+		holder->writers--;
+	put_lock_holder(holder);
+	if(shmLock->writers > 0 && --shmLock->writers == 0)
+		pthread_cond_broadcast(&shmLock->writersDone);
+}
+
+// Check if this process needs to remap the shared memory objects. Has to be
+// called without any active reader as readers of this process may be using
+// the current mappings
+static void check_remap(void)
+{
 	if(shmSettings != NULL &&
 	   local_shm_counter != shmSettings->global_shm_counter)
 	{
@@ -358,22 +712,43 @@ void _lock_shm(const char* func, const int line, const char * file) {
 		             local_shm_counter, shmSettings->global_shm_counter);
 		remap_shm();
 	}
+}
+
+void _lock_shm(const char* func, const int line, const char * file) {
+	const uint64_t start = lockstats_now();
+
+	// Signal that FTL is waiting for a lock
+	shmLock->waitingForLock = true;
+
+	if(config.debug & DEBUG_LOCKS)
+		logg("Waiting for lock in %s() (%s:%i)", func, file, line);
+
+	const int result = obtain_mutex();
+
+	// Wait until active readers are done. New readers cannot start as
+	// long as we are holding the mutex
+	wait_for_readers();
+
+	// Record lock contention
+	lock_site = lockstats_site(func, file, line);
+	lock_obtained = lockstats_wait(lock_site, start);
+
+	if(config.debug & DEBUG_LOCKS)
+		logg("Obtained lock for %s() (%s:%i)", func, file, line);
+
+	check_remap();
 
 	// Turn off the waiting for lock signal to notify everyone who was
 	// deferring to FTL that they can jump in the lock queue.
 	shmLock->waitingForLock = false;
 
-	if(result == EOWNERDEAD) {
-		// Try to make the lock consistent if the other process died while
-		// holding the lock
-		result = pthread_mutex_consistent(&shmLock->lock);
-	}
-
 	if(result != 0)
 		logg("Failed to obtain SHM lock: %s", strerror(result));
 }
 
 void _unlock_shm(const char* func, const int line, const char * file) {
+	lockstats_hold(lock_site, lock_obtained);
+
 	int result = pthread_mutex_unlock(&shmLock->lock);
 
 	if(config.debug & DEBUG_LOCKS)
@@ -383,6 +758,75 @@ void _unlock_shm(const char* func, const int line, const char * file) {
 		logg("Failed to unlock SHM lock: %s", strerror(result));
 }
 
+void _lock_shm_read(const char* func, const int line, const char * file) {
+	const uint64_t start = lockstats_now();
+
+	if(config.debug & DEBUG_LOCKS)
+		logg("Waiting for read lock in %s() (%s:%i)", func, file, line);
+
+	const int result = obtain_mutex();
+	if(result != 0)
+		logg("Failed to obtain SHM lock: %s", strerror(result));
+
+	// Give precedence to writers waiting for active readers
+	while(shmLock->writers > 0)
+		wait_for_lock_holders(&shmLock->writersDone);
+
+	// Remapping is only possible when no other reader is active
+	if(shmSettings != NULL &&
+	   local_shm_counter != shmSettings->global_shm_counter)
+	{
+		wait_for_readers();
+		check_remap();
+	}
+
+	// Register as reader and release the mutex so other readers can
+	// proceed concurrently
+	shmLock->readers++;
+	lockHolder *holder = get_lock_holder(true);
+	if(holder != NULL)
+		holder->readers++;
+	read_site = lockstats_site(func, file, line);
+	read_obtained = lockstats_wait(read_site, start);
+	pthread_mutex_unlock(&shmLock->lock);
+
+	if(config.debug & DEBUG_LOCKS)
+		logg("Obtained read lock for %s() (%s:%i)", func, file, line);
+}
+
+void _unlock_shm_read(const char* func, const int line, const char * file) {
+	const int result = obtain_mutex();
+	if(result != 0)
+		logg("Failed to obtain SHM lock: %s", strerror(result));
+
+	lockstats_hold(read_site, read_obtained);
+
+	lockHolder *holder = get_lock_holder(false);
+	if(holder != NULL && holder->readers > 0)
+		holder->readers--;
+	put_lock_holder(holder);
+
+	// Wake up waiting writers if this was the last active reader
+	if(shmLock->readers > 0 && --shmLock->readers == 0)
+		pthread_cond_broadcast(&shmLock->readersDone);
+
+	pthread_mutex_unlock(&shmLock->lock);
+
+	if(config.debug & DEBUG_LOCKS)
+		logg("Removed read lock in %s() (%s:%i)", func, file, line);
+}
+
+bool _yield_shm_read(const char* func, const int line, const char * file) {
+	// Nothing to do if nobody is waiting for the lock
+	if(!shmLock->waitingForLock)
+		return false;
+
+	// Let waiting writers proceed, then continue reading
+	_unlock_shm_read(func, line, file);
+	_lock_shm_read(func, line, file);
+	return true;
+}
+
 bool init_shmem(bool create_new)
 {
 	// Get kernel's page size
@@ -397,9 +841,28 @@ bool init_shmem(bool create_new)
 	if(create_new)
 	{
 		shmLock->lock = create_mutex();
+		shmLock->readersDone = create_cond();
+		shmLock->writersDone = create_cond();
+		shmLock->readers = 0;
+		shmLock->writers = 0;
 		shmLock->waitingForLock = false;
+		memset(shmLock->holders, 0, sizeof(shmLock->holders));
 	}
 
+	/****************************** lock contention statistics ******************************/
+	// Try to create shared memory object
+	shm_lockstats = create_shm(SHARED_LOCKSTATS_NAME, sizeof(lockStatsData), create_new);
+	if(shm_lockstats.ptr == NULL)
+		return false;
+	lockStats = (lockStatsData*)shm_lockstats.ptr;
+
+	/****************************** published statistics ******************************/
+	// Try to create shared memory object
+	shm_stats = create_shm(SHARED_STATS_NAME, sizeof(statsSnapshotData), create_new);
+	if(shm_stats.ptr == NULL)
+		return false;
+	statsSnapshots = (statsSnapshotData*)shm_stats.ptr;
+
 	/****************************** shared counters struct ******************************/
 	// Try to create shared memory object
 	shm_counters = create_shm(SHARED_COUNTERS_NAME, sizeof(countersStruct), create_new);
@@ -442,6 +905,25 @@ bool init_shmem(bool create_new)
 		shmSettings->next_str_pos = 1;
 	}
 
+	/****************************** shared string handles ******************************/
+	size_t size = pagesize / sizeof(strEntry);
+	// Try to create shared memory object
+	shm_str_handles = create_shm(SHARED_STR_HANDLES_NAME, size*sizeof(strEntry), create_new);
+	if(shm_str_handles.ptr == NULL)
+		return false;
+	str_handles = (strEntry*)shm_str_handles.ptr;
+	if(create_new)
+	{
+		counters->str_handles_MAX = size;
+
+		// Handle zero is the permanent empty string at position zero
+		str_handles[0].pos = 0;
+		str_handles[0].refs = 1;
+		shmSettings->num_str_handles = 1;
+		shmSettings->free_str_handle = 0;
+		shmSettings->str_garbage = 0;
+	}
+
 	/****************************** shared domains struct ******************************/
 	// Try to create shared memory object
 	shm_domains = create_shm(SHARED_DOMAINS_NAME, pagesize*sizeof(domainsData), create_new);
@@ -452,7 +934,7 @@ bool init_shmem(bool create_new)
 		counters->domains_MAX = pagesize;
 
 	/****************************** shared clients struct ******************************/
-	size_t size = get_optimal_object_size(sizeof(clientsData), 1);
+	size = get_optimal_object_size(sizeof(clientsData), 1);
 	// Try to create shared memory object
 	shm_clients = create_shm(SHARED_CLIENTS_NAME, size*sizeof(clientsData), create_new);
 	if(shm_clients.ptr == NULL)
@@ -480,7 +962,19 @@ bool init_shmem(bool create_new)
 	if(create_new)
 		counters->queries_MAX = pagesize;
 
+	/****************************** shared queries details ******************************/
+	// Try to create shared memory object
+	shm_queries_cold = create_shm(SHARED_QUERIES_COLD_NAME, pagesize*sizeof(queriesColdData), create_new);
+	if(shm_queries_cold.ptr == NULL)
+		return false;
+	queries_cold = (queriesColdData*)shm_queries_cold.ptr;
+
 	/****************************** shared overTime struct ******************************/
+	// We need to be able to hold MAXLOGAGE + 1 hours as we need some reserve
+	// due to that GC is only running once an hours so the shown data can be
+	// MAXLOGAGE hours + 59 minutes
+	if(create_new)
+		counters->overTime_slots = ((config.maxlogage + 3599)/3600 + 1)*3600/OVERTIME_INTERVAL;
 	size = get_optimal_object_size(sizeof(overTimeData), OVERTIME_SLOTS);
 	// Try to create shared memory object
 	shm_overTime = create_shm(SHARED_OVERTIME_NAME, size*sizeof(overTimeData), create_new);
@@ -492,6 +986,20 @@ bool init_shmem(bool create_new)
 		initOverTime();
 	}
 
+	/****************************** shared client overTime entries ******************************/
+	size = pagesize / sizeof(clientOverTimeEntry);
+	// Try to create shared memory object
+	shm_client_overTime = create_shm(SHARED_CLIENT_OVERTIME_NAME, size*sizeof(clientOverTimeEntry), create_new);
+	if(shm_client_overTime.ptr == NULL)
+		return false;
+	client_overTime = (clientOverTimeEntry*)shm_client_overTime.ptr;
+	if(create_new)
+	{
+		counters->client_overTime_MAX = size;
+		counters->client_overTime_used = 0;
+		counters->client_overTime_free = 0;
+	}
+
 	/****************************** shared DNS cache struct ******************************/
 	size = get_optimal_object_size(sizeof(DNSCacheData), 1);
 	// Try to create shared memory object
@@ -509,25 +1017,51 @@ bool init_shmem(bool create_new)
 	if(shm_per_client_regex.ptr == NULL)
 		return false;
 
+	/****************************** shared hash indices ******************************/
+	// The number of buckets has to be a power of two, this is always true for
+	// one memory page of buckets
+	size = pagesize / sizeof(hashBucket);
+	for(unsigned int i = 0; i < HASH_TABLES; i++)
+	{
+		// Try to create shared memory object
+		shm_hash[i] = create_shm(hash_names[i], size*sizeof(hashBucket), create_new);
+		if(shm_hash[i].ptr == NULL)
+			return false;
+		if(create_new)
+		{
+			counters->hash[i].size = size;
+			counters->hash[i].used = 0;
+		}
+	}
+
 	return true;
 }
 
 void destroy_shmem(void)
 {
+	pthread_cond_destroy(&shmLock->readersDone);
+	pthread_cond_destroy(&shmLock->writersDone);
 	pthread_mutex_destroy(&shmLock->lock);
 	shmLock = NULL;
 
 	delete_shm(&shm_lock);
+	delete_shm(&shm_lockstats);
+	delete_shm(&shm_stats);
 	delete_shm(&shm_strings);
+	delete_shm(&shm_str_handles);
 	delete_shm(&shm_counters);
 	delete_shm(&shm_domains);
 	delete_shm(&shm_clients);
 	delete_shm(&shm_queries);
+	delete_shm(&shm_queries_cold);
 	delete_shm(&shm_upstreams);
 	delete_shm(&shm_overTime);
+	delete_shm(&shm_client_overTime);
 	delete_shm(&shm_settings);
 	delete_shm(&shm_dns_cache);
 	delete_shm(&shm_per_client_regex);
+	for(unsigned int i = 0; i < HASH_TABLES; i++)
+		delete_shm(&shm_hash[i]);
 }
 
 /// Create shared memory
@@ -654,6 +1188,14 @@ void *enlarge_shmem_struct(const char type)
 	// Reallocate enough space for requested object
 	realloc_shm(sharedMemory, sharedMemory->size/sizeofobj + allocation_step, sizeofobj, true);
 
+	// The cold parts of queries are stored in a parallel array of the same length
+	if(type == QUERIES)
+	{
+		realloc_shm(&shm_queries_cold, shm_queries_cold.size/sizeof(queriesColdData) + allocation_step,
+		            sizeof(queriesColdData), true);
+		queries_cold = (queriesColdData*)shm_queries_cold.ptr;
+	}
+
 	// Add allocated memory to corresponding counter
 	*counter += allocation_step;
 
@@ -822,6 +1364,7 @@ void memory_check(const enum memory_type which)
 		case QUERIES:
 			if(counters->queries >= counters->queries_MAX-1)
 			{
+				const int oldMAX = counters->queries_MAX;
 				// Have to reallocate shared memory
 				queries = enlarge_shmem_struct(QUERIES);
 				if(queries == NULL)
@@ -829,6 +1372,20 @@ void memory_check(const enum memory_type which)
 					logg("FATAL: Memory allocation failed! Exiting");
 					exit(EXIT_FAILURE);
 				}
+
+				// If the ring buffer wraps around, move the part between its
+				// head and the end of the old memory to the end of the new
+				// memory so the free space is again located behind the tail
+				if(counters->oldest_query_slot > 0)
+				{
+					const int step = counters->queries_MAX - oldMAX;
+					const int head = counters->oldest_query_slot;
+					memmove(&queries[head + step], &queries[head], (oldMAX - head)*sizeof(queriesData));
+					memset(&queries[head], 0, step*sizeof(queriesData));
+					memmove(&queries_cold[head + step], &queries_cold[head], (oldMAX - head)*sizeof(queriesColdData));
+					memset(&queries_cold[head], 0, step*sizeof(queriesColdData));
+					counters->oldest_query_slot += step;
+				}
 			}
 			break;
 		case UPSTREAMS:
@@ -924,6 +1481,21 @@ bool get_per_client_regex(const int clientID, const int regexID)
 	return ((bool*) shm_per_client_regex.ptr)[id];
 }
 
+// Copy the enabled/disabled state of all regex of a client into a process-private
+// buffer which has to be freed by the caller. Returns NULL on memory errors
+bool *copy_per_client_regex(const int clientID)
+{
+	const unsigned int num_regex_tot = get_num_regex(REGEX_MAX); // total number
+	bool *copy = calloc(num_regex_tot > 0u ? num_regex_tot : 1u, sizeof(bool));
+	if(copy == NULL)
+		return NULL;
+
+	for(unsigned int i = 0u; i < num_regex_tot; i++)
+		copy[i] = get_per_client_regex(clientID, i);
+
+	return copy;
+}
+
 void set_per_client_regex(const int clientID, const int regexID, const bool value)
 {
 	const unsigned int num_regex_tot = get_num_regex(REGEX_MAX); // total number
@@ -939,6 +1511,247 @@ void set_per_client_regex(const int clientID, const int regexID, const bool valu
 	((bool*) shm_per_client_regex.ptr)[id] = value;
 }
 
+// Key of the per-client overTime hash index
+typedef struct {
+	int clientID;
+	unsigned int slot;
+} clientOverTimeKey;
+
+static bool client_overTime_matches(const int ID, const void *key)
+{
+	const clientOverTimeKey *k = key;
+	return client_overTime[ID].clientID == k->clientID &&
+	       client_overTime[ID].slot == k->slot;
+}
+
+static int find_client_overTime(const int clientID, const unsigned int slot, uint32_t *hash)
+{
+	const clientOverTimeKey key = { clientID, slot };
+	*hash = hashData(&key, sizeof(key));
+	return hash_lookup(CLIENT_OVERTIME_HASH, *hash, client_overTime_matches, &key);
+}
+
+// Return an entry to the list of free entries
+static void free_client_overTime(const int ID)
+{
+	const clientOverTimeKey key = { client_overTime[ID].clientID, client_overTime[ID].slot };
+	hash_remove(CLIENT_OVERTIME_HASH, hashData(&key, sizeof(key)), ID);
+	client_overTime[ID].next = counters->client_overTime_free;
+	counters->client_overTime_free = ID + 1;
+}
+
+int __attribute__((pure)) get_client_overTime(const int clientID, const unsigned int slot)
+{
+	uint32_t hash;
+	const int ID = find_client_overTime(clientID, slot, &hash);
+	return ID > -1 ? client_overTime[ID].count : 0;
+}
+
+void change_client_overTime(const int clientID, const unsigned int slot, const int mod)
+{
+	uint32_t hash;
+	const int known = find_client_overTime(clientID, slot, &hash);
+	if(known > -1)
+	{
+		client_overTime[known].count += mod;
+		return;
+	}
+	else if(mod == 0)
+		return;
+
+	// Get a new entry, re-use a previously freed one if available
+	int ID;
+	if(counters->client_overTime_free > 0)
+	{
+		ID = counters->client_overTime_free - 1;
+		counters->client_overTime_free = client_overTime[ID].next;
+	}
+	else
+	{
+		if(counters->client_overTime_used >= counters->client_overTime_MAX)
+		{
+			if(!realloc_shm(&shm_client_overTime, 2*counters->client_overTime_MAX,
+			                sizeof(clientOverTimeEntry), true))
+				return;
+			client_overTime = (clientOverTimeEntry*)shm_client_overTime.ptr;
+			counters->client_overTime_MAX *= 2;
+		}
+		ID = counters->client_overTime_used++;
+	}
+
+	// Prepend entry to the chain of this slot
+	client_overTime[ID].clientID = clientID;
+	client_overTime[ID].slot = slot;
+	client_overTime[ID].count = mod;
+	client_overTime[ID].next = overTime[slot].clients;
+	overTime[slot].clients = ID + 1;
+	hash_insert(CLIENT_OVERTIME_HASH, hash, ID);
+}
+
+void get_client_overTime_slot(const unsigned int slot, int *counts, const int num_clients)
+{
+	for(int next = overTime[slot].clients; next > 0; next = client_overTime[next - 1].next)
+	{
+		const clientOverTimeEntry *entry = &client_overTime[next - 1];
+		if(entry->clientID < num_clients)
+			counts[entry->clientID] += entry->count;
+	}
+}
+
+void reset_client_overTime(const int clientID)
+{
+	for(int slot = 0; slot < OVERTIME_SLOTS; slot++)
+	{
+		int *link = &overTime[slot].clients;
+		while(*link > 0)
+		{
+			const int ID = *link - 1;
+			if(client_overTime[ID].clientID == clientID)
+			{
+				// Unlink entry before releasing it
+				*link = client_overTime[ID].next;
+				free_client_overTime(ID);
+			}
+			else
+				link = &client_overTime[ID].next;
+		}
+	}
+}
+
+void clear_client_overTime_slot(const unsigned int slot)
+{
+	int next = overTime[slot].clients;
+	while(next > 0)
+	{
+		const int ID = next - 1;
+		next = client_overTime[ID].next;
+		free_client_overTime(ID);
+	}
+	overTime[slot].clients = 0;
+}
+
+// FNV-1a hash of a string
+uint32_t __attribute__ ((pure)) hashStr(const char *str)
+{
+	uint32_t hash = 2166136261u;
+	while(*str)
+	{
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// FNV-1a hash of a binary object
+uint32_t __attribute__ ((pure)) hashData(const void *data, const size_t len)
+{
+	const unsigned char *p = data;
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < len; i++)
+	{
+		hash ^= p[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Store an ID in the first free bucket following its home bucket (linear probing)
+static void hash_place(hashBucket *buckets, const unsigned int mask, const uint32_t hash, const int id)
+{
+	unsigned int i = hash & mask;
+	while(buckets[i].id != 0)
+		i = (i + 1u) & mask;
+	buckets[i].hash = hash;
+	buckets[i].id = id;
+}
+
+// Double the number of buckets of a hash index and re-insert all entries
+// using their stored hashes
+static void hash_grow(const enum hash_table which)
+{
+	const int oldsize = counters->hash[which].size;
+	const int newsize = 2*oldsize;
+
+	hashBucket *old = calloc(oldsize, sizeof(hashBucket));
+	if(old == NULL)
+	{
+		logg("FATAL: Memory allocation failed! Exiting");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(old, shm_hash[which].ptr, oldsize*sizeof(hashBucket));
+
+	realloc_shm(&shm_hash[which], newsize, sizeof(hashBucket), true);
+	counters->hash[which].size = newsize;
+
+	hashBucket *buckets = (hashBucket*)shm_hash[which].ptr;
+	memset(buckets, 0, newsize*sizeof(hashBucket));
+	for(int i = 0; i < oldsize; i++)
+		if(old[i].id != 0)
+			hash_place(buckets, newsize - 1, old[i].hash, old[i].id);
+
+	free(old);
+}
+
+// Return the ID stored for a key or -1 if the key is not in the index. The
+// callback is used to resolve collisions by comparing against the real key
+int hash_lookup(const enum hash_table which, const uint32_t hash,
+                bool (*match)(const int ID, const void *key), const void *key)
+{
+	const hashBucket *buckets = (hashBucket*)shm_hash[which].ptr;
+	const unsigned int mask = counters->hash[which].size - 1;
+	for(unsigned int i = hash & mask; buckets[i].id != 0; i = (i + 1u) & mask)
+	{
+		if(buckets[i].hash == hash && match(buckets[i].id - 1, key))
+			return buckets[i].id - 1;
+	}
+	return -1;
+}
+
+void hash_insert(const enum hash_table which, const uint32_t hash, const int ID)
+{
+	// Keep the load factor below 75% to ensure short probe sequences
+	if(4*(counters->hash[which].used + 1) > 3*counters->hash[which].size)
+		hash_grow(which);
+
+	hash_place((hashBucket*)shm_hash[which].ptr, counters->hash[which].size - 1, hash, ID + 1);
+	counters->hash[which].used++;
+}
+
+void hash_remove(const enum hash_table which, const uint32_t hash, const int ID)
+{
+	hashBucket *buckets = (hashBucket*)shm_hash[which].ptr;
+	const unsigned int mask = counters->hash[which].size - 1;
+
+	// Find bucket holding this ID
+	unsigned int i = hash & mask;
+	while(buckets[i].id != 0 && buckets[i].id != ID + 1)
+		i = (i + 1u) & mask;
+	if(buckets[i].id == 0)
+		return;
+
+	// Backward-shift deletion: move following entries of the probe sequence
+	// into the hole unless this would place them before their home bucket
+	for(unsigned int j = (i + 1u) & mask; buckets[j].id != 0; j = (j + 1u) & mask)
+	{
+		const unsigned int home = buckets[j].hash & mask;
+		if(((j - home) & mask) >= ((j - i) & mask))
+		{
+			buckets[i] = buckets[j];
+			i = j;
+		}
+	}
+	buckets[i].hash = 0;
+	buckets[i].id = 0;
+	counters->hash[which].used--;
+}
+
+// Remove all entries from a hash index
+void hash_clear(const enum hash_table which)
+{
+	memset(shm_hash[which].ptr, 0, counters->hash[which].size*sizeof(hashBucket));
+	counters->hash[which].used = 0;
+}
+
 static inline bool check_range(int ID, int MAXID, const char* type, int line, const char * function, const char * file)
 {
 	if(ID < 0 || ID > MAXID)
@@ -967,13 +1780,36 @@ static inline bool check_magic(int ID, bool checkMagic, unsigned char magic, con
 
 queriesData* _getQuery(int queryID, bool checkMagic, int line, const char * function, const char * file)
 {
-	if(check_range(queryID, counters->queries_MAX, "query", line, function, file) &&
-	   check_magic(queryID, checkMagic, queries[queryID].magic, "query", line, function, file))
-		return &queries[queryID];
+	// Queries are stored in a ring buffer and addressed by monotonically
+	// increasing IDs. Translate the ID into the slot holding this query
+	const unsigned int offset = (unsigned int)queryID - (unsigned int)counters->oldest_query;
+	if(offset >= (unsigned int)counters->queries_MAX)
+	{
+		logg("FATAL: Trying to access query ID %i, but valid range is %i - %i",
+		     queryID, counters->oldest_query, counters->oldest_query + counters->queries_MAX - 1);
+		logg("       found in %s() (%s:%i)", function, file, line);
+		return NULL;
+	}
+	const int slot = (counters->oldest_query_slot + offset) % counters->queries_MAX;
+	if(check_magic(queryID, checkMagic, queries[slot].magic, "query", line, function, file))
+		return &queries[slot];
 	else
 		return NULL;
 }
 
+queriesColdData* _getQueryCold(const queriesData *query, int line, const char * function, const char * file)
+{
+	// The cold part of a query is stored at the same slot as its hot part
+	const long slot = query != NULL ? (long)(query - queries) : -1;
+	if(slot < 0 || slot >= counters->queries_MAX)
+	{
+		logg("FATAL: Trying to access details of invalid query at slot %li", slot);
+		logg("       found in %s() (%s:%i)", function, file, line);
+		return NULL;
+	}
+	return &queries_cold[slot];
+}
+
 clientsData* _getClient(int clientID, bool checkMagic, int line, const char * function, const char * file)
 {
 	if(check_range(clientID, counters->clients_MAX, "client", line, function, file) &&
@@ -14,6 +14,7 @@
 #include <sys/stat.h>        /* For mode constants */
 #include <fcntl.h>           /* For O_* constants */
 #include <stdbool.h>
+#include <stdint.h>
 
 // TYPE_MAX
 #include "datastructure.h"
@@ -32,8 +33,11 @@ typedef struct {
 	int version;
 	unsigned int global_shm_counter;
 	unsigned int next_str_pos;
+	unsigned int num_str_handles;
+	unsigned int free_str_handle;
+	unsigned int str_garbage;
 } ShmSettings;
-ASSERT_SIZEOF(ShmSettings, 12, 12, 12);
+ASSERT_SIZEOF(ShmSettings, 24, 24, 24);
 
 typedef struct {
 	int queries;
@@ -49,6 +53,7 @@ typedef struct {
 	int clients_MAX;
 	int domains_MAX;
 	int strings_MAX;
+	int str_handles_MAX;
 	int gravity;
 	int querytype[TYPE_MAX-1];
 	int reply_NODATA;
@@ -59,10 +64,26 @@ typedef struct {
 	int dns_cache_size;
 	int dns_cache_MAX;
 	unsigned int regex_change;
+	int oldest_query;
+	int oldest_query_slot;
+	unsigned int query_id_shift; // Sum of all rebases of query IDs (wraps around)
+	int overTime_slots;
+	unsigned int overTime_first;
+	int client_overTime_MAX;
+	int client_overTime_used;
+	int client_overTime_free;
+	struct {
+		int size;
+		int used;
+	} hash[HASH_TABLES];
 } countersStruct;
 
 extern countersStruct *counters;
 
+// How many overTime slots do we have? This depends on the configured
+// MAXLOGAGE and is fixed when shared memory is created
+#define OVERTIME_SLOTS (counters->overTime_slots)
+
 /// Create shared memory
 ///
 /// \param name the name of the shared memory
@@ -94,10 +115,27 @@ void _lock_shm(const char* func, const int line, const char* file);
 #define unlock_shm() _unlock_shm(__FUNCTION__, __LINE__, __FILE__)
 void _unlock_shm(const char* func, const int line, const char* file);
 
+/// Block until shared memory can be read. Multiple readers may be active at
+/// the same time, shared memory must not be modified while holding this lock.
+#define lock_shm_read() _lock_shm_read(__FUNCTION__, __LINE__, __FILE__)
+void _lock_shm_read(const char* func, const int line, const char* file);
+
+/// Release a read lock obtained using lock_shm_read()
+#define unlock_shm_read() _unlock_shm_read(__FUNCTION__, __LINE__, __FILE__)
+void _unlock_shm_read(const char* func, const int line, const char* file);
+
+/// Temporarily release a read lock if a writer is waiting for the lock. Long
+/// running readers should call this regularly. Returns true if the lock was
+/// released in which case shared memory may have changed meanwhile
+#define yield_shm_read() _yield_shm_read(__FUNCTION__, __LINE__, __FILE__)
+bool _yield_shm_read(const char* func, const int line, const char* file);
+
 bool init_shmem(bool create_new);
 void destroy_shmem(void);
 size_t addstr(const char *str);
-const char *getstr(const size_t pos);
+void freestr(const size_t handle);
+const char *getstr(const size_t handle);
+void compact_strings(void);
 void *enlarge_shmem_struct(const char type);
 
 /**
@@ -110,17 +148,13 @@ char *str_escape(const char *input, unsigned int *N);
  */
 bool strcmp_escaped(const char *a, const char *b);
 
-/**
- * Create a new overTime client shared memory block.
- * This also updates `overTimeClientData`.
- */
-void newOverTimeClient(const int clientID);
-
-/**
- * Add a new overTime slot to each overTime client shared memory block.
- * This also updates `overTimeClientData`.
- */
-void addOverTimeClientSlot(void);
+// Sparse per-client overTime data, only slots with queries occupy memory
+int get_client_overTime(const int clientID, const unsigned int slot) __attribute__((pure));
+void change_client_overTime(const int clientID, const unsigned int slot, const int mod);
+// Add the counts of all clients in a slot to counts[clientID]
+void get_client_overTime_slot(const unsigned int slot, int *counts, const int num_clients);
+void reset_client_overTime(const int clientID);
+void clear_client_overTime_slot(const unsigned int slot);
 
 // Change ownership of shared memory objects
 void chown_all_shmem(struct passwd *ent_pw);
@@ -129,8 +163,18 @@ void chown_all_shmem(struct passwd *ent_pw);
 void add_per_client_regex(unsigned int clientID);
 void reset_per_client_regex(const int clientID);
 bool get_per_client_regex(const int clientID, const int regexID);
+bool *copy_per_client_regex(const int clientID) __attribute__ ((malloc));
 void set_per_client_regex(const int clientID, const int regexID, const bool value);
 
 void memory_check(const enum memory_type which);
 
+// Shared-memory hash indices mapping keys to IDs of shared memory structs
+uint32_t hashStr(const char *str) __attribute__ ((pure));
+uint32_t hashData(const void *data, const size_t len) __attribute__ ((pure));
+int hash_lookup(const enum hash_table which, const uint32_t hash,
+                bool (*match)(const int ID, const void *key), const void *key);
+void hash_insert(const enum hash_table which, const uint32_t hash, const int ID);
+void hash_remove(const enum hash_table which, const uint32_t hash, const int ID);
+void hash_clear(const enum hash_table which);
+
 #endif //SHARED_MEMORY_SERVER_H
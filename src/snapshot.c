@@ -0,0 +1,182 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Published statistics snapshot
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "snapshot.h"
+// struct overTime
+#include "overTime.h"
+// logg()
+#include "log.h"
+// struct config
+#include "config.h"
+
+// The housekeeper publishes the statistics once per second into one of two
+// buffers and then flips the current buffer. Every buffer is guarded by a
+// sequence counter which is odd while the buffer is being written so readers
+// can detect (and retry) torn reads without taking any lock.
+// The object is created in init_shmem()
+statsSnapshotData *statsSnapshots = NULL;
+
+// Number of attempts to read a consistent snapshot before taking the lock
+#define SNAPSHOT_READ_ATTEMPTS 8
+
+/* qsort comparision function (count field), sort DESC */
+static int __attribute__((pure)) cmpupstream(const void *a, const void *b)
+{
+	const upstreamSnapshot *up1 = (const upstreamSnapshot*)a;
+	const upstreamSnapshot *up2 = (const upstreamSnapshot*)b;
+
+	if (up1->count > up2->count)
+		return -1;
+	else if (up1->count < up2->count)
+		return 1;
+	else
+		return 0;
+}
+
+static void fill_upstream(upstreamSnapshot *snap, const upstreamsData *upstream)
+{
+	const char *ip = getstr(upstream->ippos);
+	const char *name = upstream->namepos != 0 ? getstr(upstream->namepos) : ip;
+	strncpy(snap->ip, ip, sizeof(snap->ip) - 1);
+	snap->ip[sizeof(snap->ip) - 1] = '\0';
+	strncpy(snap->name, name, sizeof(snap->name) - 1);
+	snap->name[sizeof(snap->name) - 1] = '\0';
+	snap->port = upstream->port;
+	snap->count = upstream->count;
+}
+
+// Compute the statistics from live data. This has to be called while
+// holding the shared memory lock (a read lock is sufficient)
+static void fill_snapshot(statsSnapshot *stats)
+{
+	const time_t now = time(NULL);
+	stats->published = now;
+	stats->counters = *counters;
+
+	// unique_clients: count only clients that have been active within the most recent 24 hours
+	stats->activeclients = 0;
+	for(int clientID = 0; clientID < counters->clients; clientID++)
+	{
+		// Get client pointer
+		const clientsData* client = getClient(clientID, true);
+		if(client != NULL && client->count > 0)
+			stats->activeclients++;
+	}
+
+	// Start with the first non-empty overTime slot and end with the last
+	// non-empty one
+	int from = -1, until = OVERTIME_SLOTS;
+	const time_t mintime = overTime[getOverTimeSlot(0)].timestamp;
+	for(int slot = 0; slot < OVERTIME_SLOTS; slot++)
+	{
+		const unsigned int idx = getOverTimeSlot(slot);
+		if(from < 0 && (overTime[idx].total > 0 || overTime[idx].blocked > 0) &&
+		   overTime[idx].timestamp >= mintime)
+			from = slot;
+
+		if(overTime[idx].timestamp >= now)
+		{
+			until = slot;
+			break;
+		}
+	}
+	stats->overTime_num = 0u;
+	for(int slot = from; from > -1 && slot < until && stats->overTime_num < SNAPSHOT_OVERTIME_SLOTS; slot++)
+	{
+		const unsigned int idx = getOverTimeSlot(slot);
+		overTimeSnapshot *snap = &stats->overTime[stats->overTime_num++];
+		snap->timestamp = (int32_t)overTime[idx].timestamp;
+		snap->total = overTime[idx].total;
+		snap->blocked = overTime[idx].blocked;
+	}
+
+	// Get the upstream destinations with the most queries as well as the
+	// first ones (unsorted)
+	stats->upstreams_num = 0u;
+	memset(stats->upstream_unsorted, 0, sizeof(stats->upstream_unsorted));
+	for(int upstreamID = 0; upstreamID < counters->upstreams; upstreamID++)
+	{
+		const upstreamsData* upstream = getUpstream(upstreamID, true);
+		if(upstream == NULL)
+			continue;
+
+		if(upstreamID < SNAPSHOT_UPSTREAMS)
+			fill_upstream(&stats->upstream_unsorted[upstreamID], upstream);
+
+		// Replace the upstream with the fewest queries if this one has
+		// more. The sorted list is kept sorted in descending order
+		unsigned int pos = stats->upstreams_num;
+		if(pos == SNAPSHOT_UPSTREAMS)
+		{
+			if(upstream->count <= stats->upstream_sorted[pos - 1].count)
+				continue;
+			pos--;
+		}
+		else
+			stats->upstreams_num++;
+
+		fill_upstream(&stats->upstream_sorted[pos], upstream);
+		qsort(stats->upstream_sorted, stats->upstreams_num, sizeof(upstreamSnapshot), cmpupstream);
+	}
+}
+
+// Publish a new snapshot. This has to be called while holding the shared
+// memory lock (a read lock is sufficient). Only the housekeeper thread of the
+// main process writes snapshots
+void publish_stats_snapshot(void)
+{
+	if(statsSnapshots == NULL)
+		return;
+
+	const unsigned int next = 1u - atomic_load(&statsSnapshots->current);
+	statsSnapshot *stats = &statsSnapshots->buffer[next];
+
+	// Mark buffer as being written
+	const unsigned int seq = atomic_load_explicit(&stats->seq, memory_order_relaxed);
+	atomic_store_explicit(&stats->seq, seq + 1u, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	fill_snapshot(stats);
+
+	// Mark buffer as complete and make it the current one
+	atomic_store_explicit(&stats->seq, seq + 2u, memory_order_release);
+	atomic_store_explicit(&statsSnapshots->current, next, memory_order_release);
+}
+
+// Get a copy of the most recently published statistics. No lock is needed
+// unless no consistent snapshot is available (e.g. right after starting)
+void get_stats_snapshot(statsSnapshot *stats)
+{
+	for(unsigned int i = 0; statsSnapshots != NULL && i < SNAPSHOT_READ_ATTEMPTS; i++)
+	{
+		const unsigned int current = atomic_load_explicit(&statsSnapshots->current, memory_order_acquire);
+		const statsSnapshot *snap = &statsSnapshots->buffer[current];
+
+		const unsigned int seq = atomic_load_explicit(&snap->seq, memory_order_acquire);
+		if(seq & 1u)
+			continue;
+
+		memcpy(stats, snap, sizeof(*stats));
+		atomic_thread_fence(memory_order_acquire);
+
+		// Check that the buffer was not rewritten while we were copying
+		if(atomic_load_explicit(&snap->seq, memory_order_relaxed) == seq &&
+		   stats->published > 0)
+			return;
+	}
+
+	if(config.debug & DEBUG_API)
+		logg("No consistent statistics snapshot available, computing live data");
+
+	lock_shm_read();
+	fill_snapshot(stats);
+	unlock_shm_read();
+}
@@ -0,0 +1,68 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2021 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Published statistics snapshot prototypes
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdatomic.h>
+// INET6_ADDRSTRLEN
+#include <netinet/in.h>
+
+// countersStruct
+#include "shmem.h"
+// assert_sizeof
+#include "static_assert.h"
+
+// Name of the shared memory object holding the published statistics
+#define SHARED_STATS_NAME "FTL-stats"
+
+// Maximum number of overTime intervals (see MAXLOGAGE_LIMIT)
+#define SNAPSHOT_OVERTIME_SLOTS ((MAXLOGAGE_LIMIT + 1)*3600/OVERTIME_INTERVAL)
+
+// Number of upstream destinations reported by getUpstreamDestinations()
+#define SNAPSHOT_UPSTREAMS 8
+
+typedef struct {
+	int32_t timestamp;
+	int total;
+	int blocked;
+} overTimeSnapshot;
+ASSERT_SIZEOF(overTimeSnapshot, 12, 12, 12);
+
+typedef struct {
+	char ip[INET6_ADDRSTRLEN];
+	in_port_t port;
+	int count;
+	char name[256];
+} upstreamSnapshot;
+ASSERT_SIZEOF(upstreamSnapshot, 308, 308, 308);
+
+typedef struct {
+	atomic_uint seq; // odd while the buffer is being written
+	int64_t published;
+	countersStruct counters;
+	int activeclients;
+	unsigned int overTime_num;
+	unsigned int upstreams_num;
+	overTimeSnapshot overTime[SNAPSHOT_OVERTIME_SLOTS];
+	upstreamSnapshot upstream_sorted[SNAPSHOT_UPSTREAMS];
+	upstreamSnapshot upstream_unsorted[SNAPSHOT_UPSTREAMS];
+} statsSnapshot;
+
+typedef struct {
+	atomic_uint current;
+	statsSnapshot buffer[2];
+} statsSnapshotData;
+
+extern statsSnapshotData *statsSnapshots;
+
+void publish_stats_snapshot(void);
+void get_stats_snapshot(statsSnapshot *stats);
+
+#endif //SNAPSHOT_H
@@ -29,8 +29,9 @@ ssize_t FTLrecv(int sockfd, void *buf, size_t len, int flags, const char *file,
 	while(ret < 0 && errno == EINTR);
 
 	// Final error checking (may have faild for some other reason then an
-	// EINTR = interrupted system call)
-	if(ret < 0)
+	// EINTR = interrupted system call). Having no data to read is not an error
+	// for non-blocking calls
+	if(ret < 0 && !((flags & MSG_DONTWAIT) && errno == EAGAIN))
 		logg("WARN: Could not recv() in %s() (%s:%i): %s",
              func, file, line, strerror(errno));
 
@@ -27,7 +27,7 @@ ssize_t FTLwrite(int fd, const void *buf, size_t total, const char *file, const
 	{
 		// Reset errno before trying to write
 		errno = 0;
-		ret = write(fd, buf, total);
+		ret = write(fd, (const char*)buf + written, total - written);
         if(ret > 0)
             written += ret;
 	}
@@ -11,6 +11,8 @@
 #include "FTL.h"
 #include "timers.h"
 #include "log.h"
+// INT_MAX
+#include <limits.h>
 
 struct timespec t0[NUMTIMERS];
 
@@ -60,3 +62,15 @@ void sleepms(const int milliseconds)
 	tv.tv_usec = (milliseconds % 1000) * 1000;
 	select(0, NULL, NULL, NULL, &tv);
 }
+
+// Milliseconds until the given (wall clock) time is reached, zero if it has
+// already passed
+int ms_until(const time_t deadline)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	const long long ms = (long long)(deadline - now.tv_sec) * 1000LL - now.tv_nsec / 1000000L;
+	if(ms <= 0)
+		return 0;
+	return ms > INT_MAX ? INT_MAX : (int)ms;
+}
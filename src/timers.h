@@ -10,6 +10,9 @@
 #ifndef TIMERS_H
 #define TIMERS_H
 
+// time_t
+#include <time.h>
+
 // Timer enumeration
 enum timers {
 	DATABASE_WRITE_TIMER,
@@ -18,6 +21,7 @@ enum timers {
 	LISTS_TIMER,
 	REGEX_TIMER,
 	ARP_TIMER,
+	STRINGS_TIMER,
 	LAST_TIMER
 	} __attribute__ ((packed));
 
@@ -26,5 +30,6 @@ enum timers {
 void timer_start(const enum timers i);
 double timer_elapsed_msec(const enum timers i);
 void sleepms(const int milliseconds);
+int ms_until(const time_t deadline);
 
 #endif //TIMERS_H
@@ -14,8 +14,19 @@
 @test "Running a second instance is detected and prevented" {
   run bash -c 'su pihole -s /bin/sh -c "/home/pihole/pihole-FTL -f"'
   printf "%s\n" "${lines[@]}"
-  [[ ${lines[9]} == *"Initialization of shared memory failed." ]]
-  [[ ${lines[10]} == *"--> pihole-FTL is already running as PID "* ]]
+  [[ "${lines[@]}" == *"Initialization of shared memory failed."*"--> pihole-FTL is already running as PID "* ]]
+}
+
+@test "Configured MAXLOGAGE is reported on startup" {
+  run bash -c 'echo "MAXLOGAGE=48" >> /etc/pihole/pihole-FTL.conf; su pihole -s /bin/sh -c "/home/pihole/pihole-FTL -f"; sed -i "/^MAXLOGAGE=/d" /etc/pihole/pihole-FTL.conf'
+  printf "%s\n" "${lines[@]}"
+  [[ "${lines[@]}" == *"MAXLOGAGE: Keeping up to 48.0 hours of log data in memory"* ]]
+}
+
+@test "Out-of-range MAXLOGAGE falls back to 24 hours" {
+  run bash -c 'echo "MAXLOGAGE=1000" >> /etc/pihole/pihole-FTL.conf; su pihole -s /bin/sh -c "/home/pihole/pihole-FTL -f"; sed -i "/^MAXLOGAGE=/d" /etc/pihole/pihole-FTL.conf'
+  printf "%s\n" "${lines[@]}"
+  [[ "${lines[@]}" == *"MAXLOGAGE: Keeping up to 24.0 hours of log data in memory"* ]]
 }
 
 @test "Starting tests without prior history" {
@@ -288,6 +299,20 @@
   [[ ${lines[17]} == "" ]]
 }
 
+@test "Lock statistics available via API" {
+  run bash -c 'echo ">lockstats >quit" | nc -v 127.0.0.1 4711'
+  printf "%s\n" "${lines[@]}"
+  [[ "${lines[@]}" == *"_FTL_new_query dnsmasq_interface.c:"* ]]
+}
+
+@test "Lock statistics available via CLI" {
+  run bash -c './pihole-FTL lockstats'
+  printf "%s\n" "${lines[@]}"
+  [[ ${lines[0]} == "Function"*"Location"*"Count"*"Wait [us]"*"Max [us]"*"Hold [us]"*"Max [us]" ]]
+  [[ "${lines[@]}" == *"_FTL_new_query"*"dnsmasq_interface.c:"* ]]
+  [[ $status == 0 ]]
+}
+
 # Here and below: It is not meaningful to assume a particular order
 # here as the values are sorted before output. It is unpredictable in
 # which order they may come out. While this has always been the same
@@ -817,6 +842,90 @@
   [[ ${lines[1]} == *"Overwriting previous querytype setting" ]]
 }
 
+@test "Regex Test 41: Regex automaton agrees on anchors" {
+  run bash -c './pihole-FTL -q regex-test "ads.example.com" "^ads\."'
+  printf "%s\n" "${lines[@]}"
+  [[ $status == 0 ]]
+  run bash -c './pihole-FTL -q regex-test "myads.example.com" "^ads\."'
+  printf "%s\n" "${lines[@]}"
+  [[ $status == 2 ]]
+  run bash -c './pihole-FTL -q regex-test "ad.doubleclick.net" "(^|\.)doubleclick\.net$"'
+  printf "%s\n" "${lines[@]}"
+  [[ $status == 0 ]]
+  run bash -c './pihole-FTL -q regex-test "notdoubleclick.net" "(^|\.)doubleclick\.net$"'
+  printf "%s\n" "${lines[@]}"
+  [[ $status == 2 ]]
+}
+
+@test "Regex Test 42: Regex automaton agrees on bracket expressions" {
+  run bash -c './pihole-FTL -q regex-test "ad7.example.com" "^ad[sx0-9][^a-z.]\."'
+  printf "%s\n" "${lines[@]}"
+  [[ $status == 2 ]]
+  run bash -c './pihole-FTL -q regex-test "ad77.example.com" "^ad[sx0-9][^a-z.]\."'
+  printf "%s\n" "${lines[@]}"
+  [[ $status == 0 ]]
+  run bash -c './pihole-FTL -q regex-test "a-b.example.com" "^[[:alpha:]][]-][[:alpha:]]\."'
+  printf "%s\n" "${lines[@]}"
+  [[ $status == 0 ]]
+}
+
+@test "Regex Test 43: Regex automaton agrees on counted repetitions" {
+  run bash -c './pihole-FTL -q regex-test "track1.example.com" "^track[0-9]{2,3}\."'
+  printf "%s\n" "${lines[@]}"
+  [[ $status == 2 ]]
+  run bash -c './pihole-FTL -q regex-test "track123.example.com" "^track[0-9]{2,3}\."'
+  printf "%s\n" "${lines[@]}"
+  [[ $status == 0 ]]
+  run bash -c './pihole-FTL -q regex-test "track1234.example.com" "^track[0-9]{2,3}\."'
+  printf "%s\n" "${lines[@]}"
+  [[ $status == 2 ]]
+  run bash -c './pihole-FTL -q regex-test "xxx.example.com" "^x{3}\."'
+  printf "%s\n" "${lines[@]}"
+  [[ $status == 0 ]]
+}
+
+@test "Regex Test 44: Regex automaton agrees on alternation" {
+  run bash -c './pihole-FTL -q regex-test "stat.example.com" "^(ads|track|stat)\."'
+  printf "%s\n" "${lines[@]}"
+  [[ $status == 0 ]]
+  run bash -c './pihole-FTL -q regex-test "stats.example.com" "^(ads|track|stat)\."'
+  printf "%s\n" "${lines[@]}"
+  [[ $status == 2 ]]
+  run bash -c './pihole-FTL -q regex-test "abcd" "^(a|ab)(c|bcd)d*$"'
+  printf "%s\n" "${lines[@]}"
+  [[ $status == 0 ]]
+}
+
+@test "Regex Test 45: Regex automaton agrees on case folding" {
+  run bash -c './pihole-FTL -q regex-test "ADS.Example.COM" "^ads\.example\.com$"'
+  printf "%s\n" "${lines[@]}"
+  [[ $status == 0 ]]
+  run bash -c './pihole-FTL -q regex-test "tracker.example.com" "^TRACK[A-Z]+\."'
+  printf "%s\n" "${lines[@]}"
+  [[ $status == 0 ]]
+}
+
+@test "Regex Test 46: Regex automaton agrees on inverted filters" {
+  run bash -c './pihole-FTL -q regex-test "example.com" "^[a-z]+\.com$;invert"'
+  printf "%s\n" "${lines[@]}"
+  [[ $status == 2 ]]
+  run bash -c './pihole-FTL -q regex-test "example.net" "^[a-z]+\.com$;invert"'
+  printf "%s\n" "${lines[@]}"
+  [[ $status == 0 ]]
+}
+
+@test "Regex Test 47: Word boundaries \"\<\" and \"\>\" are assertions" {
+  run bash -c './pihole-FTL -q regex-test "my.ads.example.com" "\<ads\>"'
+  printf "%s\n" "${lines[@]}"
+  [[ $status == 0 ]]
+  run bash -c './pihole-FTL -q regex-test "myads.example.com" "\<ads\>"'
+  printf "%s\n" "${lines[@]}"
+  [[ $status == 2 ]]
+  run bash -c './pihole-FTL -q regex-test "ads<.example.com" "ads\<"'
+  printf "%s\n" "${lines[@]}"
+  [[ $status == 2 ]]
+}
+
 # x86_64-musl is built on busybox which has a slightly different
 # variant of ls displaying three, instead of one, spaces between the
 # user and group names.